@@ -0,0 +1,231 @@
+#!/usr/bin/env python3
+# Replay recorded JSON-RPC sessions into r2mcp over stdin and report the
+# latency of every tool, the throughput, the bytes written and the peak RSS.
+#
+# Sessions are files with one JSON-RPC message per line. The ids are
+# renumbered on the fly, "$FILE" is replaced by the binary of the corpus
+# being tested and "$CURSOR" by the cursor of the previous paged result
+# (lines using it are skipped once there are no more pages).
+
+import argparse
+import json
+import math
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+CURSOR_RE = re.compile(r'cursor "([^"]+)"')
+
+
+def load_corpus(path):
+    bins = []
+    with open(path) as f:
+        for line in f:
+            line = line.split("#", 1)[0].strip()
+            if not line:
+                continue
+            line = os.path.expanduser(os.path.join(HERE, line) if not line.startswith("/") else line)
+            if os.path.isfile(line):
+                bins.append(line)
+            else:
+                print("skipping missing binary %s" % line, file=sys.stderr)
+    return bins
+
+
+def load_session(path):
+    msgs = []
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if line and not line.startswith("#"):
+                msgs.append(json.loads(line))
+    return msgs
+
+
+def substitute(obj, binary, cursor):
+    if isinstance(obj, dict):
+        return {k: substitute(v, binary, cursor) for k, v in obj.items()}
+    if isinstance(obj, list):
+        return [substitute(v, binary, cursor) for v in obj]
+    if obj == "$FILE":
+        return binary
+    if obj == "$CURSOR":
+        return cursor
+    return obj
+
+
+def uses_cursor(obj):
+    return "\"$CURSOR\"" in json.dumps(obj)
+
+
+def next_cursor(result):
+    if not isinstance(result, dict):
+        return None
+    sc = result.get("structuredContent")
+    if isinstance(sc, dict) and sc.get("nextCursor"):
+        return sc["nextCursor"]
+    for item in result.get("content", []):
+        m = CURSOR_RE.search(item.get("text", ""))
+        if m:
+            return m.group(1)
+    return None
+
+
+def label(msg):
+    if msg.get("method") in ("tools/call", "tool/call"):
+        return msg.get("params", {}).get("name", "?")
+    return msg.get("method", "?")
+
+
+def run_once(args, session, binary, cache_dir, samples):
+    env = dict(os.environ)
+    env["R2MCP_CACHE_DIR"] = cache_dir
+    env.setdefault("R2MCP_LOG_LEVEL", "error")
+    env.setdefault("R2MCP_LOGFILE", "")
+    proc = subprocess.Popen([args.r2mcp], stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                            stderr=subprocess.DEVNULL, env=env)
+    out_bytes = 0
+    calls = 0
+    cursor = None
+    next_id = 1
+    start = time.perf_counter()
+    for msg in session:
+        if uses_cursor(msg) and not cursor:
+            continue
+        msg = substitute(msg, binary, cursor)
+        request = "id" in msg
+        if request:
+            msg["id"] = next_id
+            next_id += 1
+        t0 = time.perf_counter()
+        proc.stdin.write((json.dumps(msg) + "\n").encode())
+        proc.stdin.flush()
+        if not request:
+            continue
+        while True:
+            line = proc.stdout.readline()
+            if not line:
+                raise RuntimeError("r2mcp exited while waiting for %s" % label(msg))
+            out_bytes += len(line)
+            res = json.loads(line)
+            if res.get("id") == msg["id"]:
+                break
+        dt = time.perf_counter() - t0
+        calls += 1
+        name = label(msg)
+        s = samples.setdefault(name, {"ms": [], "bytes": 0, "errors": 0})
+        s["ms"].append(dt * 1000)
+        s["bytes"] += len(line)
+        if "error" in res or res.get("result", {}).get("isError"):
+            s["errors"] += 1
+        cursor = next_cursor(res.get("result"))
+    wall = time.perf_counter() - start
+    proc.stdin.close()
+    _, _, ru = os.wait4(proc.pid, 0)
+    proc.stdout.close()
+    # ru_maxrss is in kilobytes on Linux and in bytes on macOS
+    rss = ru.ru_maxrss if sys.platform == "darwin" else ru.ru_maxrss * 1024
+    return calls, wall, out_bytes, rss
+
+
+def percentile(values, p):
+    values = sorted(values)
+    if not values:
+        return 0.0
+    # nearest rank
+    k = max(0, min(len(values) - 1, int(math.ceil(p / 100.0 * len(values))) - 1))
+    return values[k]
+
+
+def report(samples, totals):
+    rows = {}
+    for name, s in sorted(samples.items()):
+        ms = s["ms"]
+        rows[name] = {
+            "calls": len(ms),
+            "errors": s["errors"],
+            "p50_ms": percentile(ms, 50),
+            "p99_ms": percentile(ms, 99),
+            "mean_ms": sum(ms) / len(ms),
+            "bytes": s["bytes"],
+        }
+    out = dict(totals)
+    out["tools"] = rows
+    return out
+
+
+def print_report(r, base=None):
+    print("%-24s %7s %6s %10s %10s %10s %12s" % ("tool", "calls", "errors", "p50 ms", "p99 ms", "mean ms", "bytes"))
+    for name, t in r["tools"].items():
+        line = "%-24s %7d %6d %10.2f %10.2f %10.2f %12d" % (name, t["calls"], t["errors"],
+                                                         t["p50_ms"], t["p99_ms"], t["mean_ms"], t["bytes"])
+        b = base["tools"].get(name) if base else None
+        if b and b["p50_ms"] > 0:
+            line += "  p50 %+.1f%%" % (100.0 * (t["p50_ms"] - b["p50_ms"]) / b["p50_ms"])
+        print(line)
+    print("calls: %d in %.2fs, %.1f calls/s" % (r["calls"], r["seconds"], r["calls_per_second"]))
+    print("bytes written: %d" % r["bytes_written"])
+    print("peak rss: %.1f MB" % (r["peak_rss"] / 1048576.0))
+    if base and base.get("calls_per_second"):
+        print("throughput vs baseline: %+.1f%%" % (100.0 * (r["calls_per_second"] - base["calls_per_second"]) / base["calls_per_second"]))
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Replay JSON-RPC sessions into r2mcp")
+    ap.add_argument("--r2mcp", default=os.path.join(HERE, "..", "r2mcp"), help="server binary")
+    ap.add_argument("--corpus", default=os.path.join(HERE, "corpus.txt"), help="file listing the binaries")
+    ap.add_argument("--repeat", type=int, default=3, help="runs of every session and binary")
+    ap.add_argument("--cache", action="store_true", help="keep the analysis cache between runs")
+    ap.add_argument("--json", help="write the report to this file")
+    ap.add_argument("--compare", help="report to compare with, written by --json")
+    ap.add_argument("sessions", nargs="*", help="session files (bench/sessions/*.jsonl by default)")
+    args = ap.parse_args()
+
+    sessions = args.sessions or sorted(os.path.join(HERE, "sessions", f)
+                                       for f in os.listdir(os.path.join(HERE, "sessions")) if f.endswith(".jsonl"))
+    bins = load_corpus(args.corpus)
+    if not bins:
+        print("no binaries to test, check %s" % args.corpus, file=sys.stderr)
+        return 1
+    samples = {}
+    calls = 0
+    seconds = 0.0
+    written = 0
+    peak = 0
+    with tempfile.TemporaryDirectory(prefix="r2mcp-bench") as tmp:
+        for path in sessions:
+            session = load_session(path)
+            for binary in bins:
+                for i in range(args.repeat):
+                    cache_dir = tmp if args.cache else tempfile.mkdtemp(dir=tmp)
+                    c, w, b, rss = run_once(args, session, binary, cache_dir, samples)
+                    calls += c
+                    seconds += w
+                    written += b
+                    peak = max(peak, rss)
+                    print("%s %s #%d: %d calls in %.2fs" % (os.path.basename(path), os.path.basename(binary), i, c, w),
+                          file=sys.stderr)
+    r = report(samples, {
+        "calls": calls,
+        "seconds": seconds,
+        "calls_per_second": calls / seconds if seconds else 0.0,
+        "bytes_written": written,
+        "peak_rss": peak,
+    })
+    base = None
+    if args.compare:
+        with open(args.compare) as f:
+            base = json.load(f)
+    print_report(r, base)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(r, f, indent=2)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -4,20 +4,272 @@
 #include <r_util/r_json.h>
 #include <r_util/r_print.h>
 
-#define R2MCP_DEBUG   1
-#define R2MCP_LOGFILE "/tmp/r2mcp.txt"
+#include <pthread.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <netdb.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#if __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
 
-static char *handle_mcp_request(const char *method, RJson *params, const char *id);
-static inline void r2mcp_log(const char *x) {
-	eprintf ("RESULT %s\n", x);
-#if R2MCP_DEBUG
-	r_file_dump (R2MCP_LOGFILE, (const ut8 *)(x), -1, true);
-	r_file_dump (R2MCP_LOGFILE, (const ut8 *)"\n", -1, true);
+// Build with -DR2MCP_LOGGING=0 to compile all logging out of the hot path
+#ifndef R2MCP_LOGGING
+#define R2MCP_LOGGING 1
+#endif
+#define R2MCP_LOGFILE       "/tmp/r2mcp.txt"
+#define R2MCP_LOG_RING_SIZE (1024 * 1024)
+#define R2MCP_LOG_MAXLEN    4096
+
+// Same levels and order as the MCP logging/setLevel method (RFC 5424)
+typedef enum {
+	R2MCP_LOGLVL_DEBUG,
+	R2MCP_LOGLVL_INFO,
+	R2MCP_LOGLVL_NOTICE,
+	R2MCP_LOGLVL_WARNING,
+	R2MCP_LOGLVL_ERROR,
+	R2MCP_LOGLVL_CRITICAL,
+	R2MCP_LOGLVL_ALERT,
+	R2MCP_LOGLVL_EMERGENCY,
+	R2MCP_LOGLVL_OFF,
+} R2McpLogLevel;
+
+static const char *r2mcp_log_names[] = {
+	"debug", "info", "notice", "warning", "error", "critical", "alert", "emergency", "off"
+};
+
+// Records are appended to a byte ring by the request path and written out
+// by a background thread, so logging never blocks on the disk. Records that
+// do not fit are dropped and accounted for instead of stalling the caller.
+typedef struct {
+	char *ring;
+	size_t head; // total bytes produced
+	size_t tail; // total bytes written out
+	size_t dropped;
+	size_t maxlen;
+	int fd;
+	bool to_stderr;
+	bool running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} R2McpLogger;
+
+static volatile int r2mcp_log_level = R2MCP_LOGLVL_OFF;
+static R2McpLogger logger = {
+	.fd = -1,
+	.maxlen = R2MCP_LOG_MAXLEN,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+#if R2MCP_LOGGING
+#define r2mcp_log_enabled(level) ((int)(level) >= r2mcp_log_level)
+#else
+#define r2mcp_log_enabled(level) false
+#endif
+
+static int r2mcp_log_level_from_name(const char *name) {
+	if (name) {
+		int i;
+		for (i = 0; i <= R2MCP_LOGLVL_OFF; i++) {
+			if (!strcmp (name, r2mcp_log_names[i])) {
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
+static void log_sink_write(int fd, const char *data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write (fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+static void log_flush_range(size_t tail, size_t head) {
+	while (tail < head) {
+		size_t off = tail % R2MCP_LOG_RING_SIZE;
+		size_t n = R_MIN (head - tail, R2MCP_LOG_RING_SIZE - off);
+		if (logger.fd != -1) {
+			log_sink_write (logger.fd, logger.ring + off, n);
+		}
+		if (logger.to_stderr) {
+			log_sink_write (STDERR_FILENO, logger.ring + off, n);
+		}
+		tail += n;
+	}
+}
+
+static void *log_writer_thread(void *user) {
+	(void)user;
+	pthread_mutex_lock (&logger.lock);
+	for (;;) {
+		while (logger.running && logger.head == logger.tail && !logger.dropped) {
+			pthread_cond_wait (&logger.cond, &logger.lock);
+		}
+		if (logger.head == logger.tail && !logger.dropped) {
+			break;
+		}
+		const size_t tail = logger.tail;
+		const size_t head = logger.head;
+		const size_t dropped = logger.dropped;
+		logger.dropped = 0;
+		// producers only touch the free part of the ring, unlock while writing
+		pthread_mutex_unlock (&logger.lock);
+		if (dropped > 0) {
+			char note[64];
+			int len = snprintf (note, sizeof (note), "[warning] %zu log records dropped\n", dropped);
+			if (logger.fd != -1) {
+				log_sink_write (logger.fd, note, len);
+			}
+		}
+		log_flush_range (tail, head);
+		pthread_mutex_lock (&logger.lock);
+		logger.tail = head;
+	}
+	pthread_mutex_unlock (&logger.lock);
+	return NULL;
+}
+
+static void log_ring_put(const char *data, size_t len) {
+	size_t off = logger.head % R2MCP_LOG_RING_SIZE;
+	size_t n = R_MIN (len, R2MCP_LOG_RING_SIZE - off);
+	memcpy (logger.ring + off, data, n);
+	memcpy (logger.ring, data + n, len - n);
+	logger.head += len;
+}
+
+static void r2mcp_log_push(int level, const char *prefix, const char *msg, size_t len) {
+	char hdr[32];
+	char trunc[64];
+	size_t tlen = 0;
+	const size_t hlen = snprintf (hdr, sizeof (hdr), "[%s] ", r2mcp_log_names[level]);
+	const size_t plen = prefix ? strlen (prefix) : 0;
+	if (len > logger.maxlen) {
+		tlen = snprintf (trunc, sizeof (trunc), "... (%zu bytes truncated)", len - logger.maxlen);
+		len = logger.maxlen;
+	}
+	const size_t total = hlen + plen + len + tlen + 1;
+	pthread_mutex_lock (&logger.lock);
+	if (!logger.running || total > R2MCP_LOG_RING_SIZE - (logger.head - logger.tail)) {
+		logger.dropped++;
+	} else {
+		log_ring_put (hdr, hlen);
+		log_ring_put (prefix, plen);
+		log_ring_put (msg, len);
+		log_ring_put (trunc, tlen);
+		log_ring_put ("\n", 1);
+		pthread_cond_signal (&logger.cond);
+	}
+	pthread_mutex_unlock (&logger.lock);
+}
+
+static inline void r2mcp_log(int level, const char *x) {
+	if (r2mcp_log_enabled (level)) {
+		r2mcp_log_push (level, NULL, x, strlen (x));
+	}
+}
+
+// Log a request or response body, truncated to R2MCP_LOG_MAXLEN bytes
+static inline void r2mcp_log_payload(int level, const char *prefix, const char *x, size_t len) {
+	if (r2mcp_log_enabled (level)) {
+		r2mcp_log_push (level, prefix, x, len);
+	}
+}
+
+static bool r2mcp_log_start(void) {
+#if R2MCP_LOGGING
+	if (logger.running) {
+		return true;
+	}
+	char *path = r_sys_getenv ("R2MCP_LOGFILE");
+	const char *logfile = path ? path : R2MCP_LOGFILE;
+	if (*logfile) {
+		logger.fd = open (logfile, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	}
+	free (path);
+	char *maxlen = r_sys_getenv ("R2MCP_LOG_MAXLEN");
+	if (R_STR_ISNOTEMPTY (maxlen)) {
+		logger.maxlen = (size_t)atoi (maxlen);
+	}
+	free (maxlen);
+	logger.to_stderr = true;
+	logger.ring = malloc (R2MCP_LOG_RING_SIZE);
+	if (!logger.ring) {
+		return false;
+	}
+	logger.running = true;
+	if (pthread_create (&logger.thread, NULL, log_writer_thread, NULL)) {
+		logger.running = false;
+		R_FREE (logger.ring);
+		return false;
+	}
+	return true;
 #else
-	// do nothing
+	return false;
 #endif
 }
 
+static void r2mcp_log_set_level(int level) {
+	if (level != R2MCP_LOGLVL_OFF && !r2mcp_log_start ()) {
+		level = R2MCP_LOGLVL_OFF;
+	}
+	r2mcp_log_level = level;
+}
+
+// The level comes from R2MCP_LOG_LEVEL, or R2MCP_DEBUG=1/0 for debug/off
+static void r2mcp_log_init(void) {
+	int level = R2MCP_LOGLVL_INFO;
+	char *env = r_sys_getenv ("R2MCP_DEBUG");
+	if (R_STR_ISNOTEMPTY (env)) {
+		level = atoi (env) > 0 ? R2MCP_LOGLVL_DEBUG : R2MCP_LOGLVL_OFF;
+	}
+	free (env);
+	env = r_sys_getenv ("R2MCP_LOG_LEVEL");
+	int l = r2mcp_log_level_from_name (env);
+	if (l != -1) {
+		level = l;
+	}
+	free (env);
+	r2mcp_log_set_level (level);
+}
+
+// Stop the writer thread once everything queued so far is on disk
+static void r2mcp_log_fini(void) {
+	if (!logger.running) {
+		return;
+	}
+	r2mcp_log_level = R2MCP_LOGLVL_OFF;
+	pthread_mutex_lock (&logger.lock);
+	logger.running = false;
+	pthread_cond_signal (&logger.cond);
+	pthread_mutex_unlock (&logger.lock);
+	pthread_join (logger.thread, NULL);
+	if (logger.fd != -1) {
+		close (logger.fd);
+		logger.fd = -1;
+	}
+	R_FREE (logger.ring);
+}
+
+static char *handle_mcp_request(const char *method, RJson *params, const char *id);
+
 // TODO: move into r2
 static st64 r_json_get_num(const RJson *json, const char *key) {
 	if (!json || !key) {
@@ -81,10 +333,251 @@ typedef struct {
 	const RJson *client_info;
 } ServerState;
 
-// TODO: remove globals
-static RCore *r_core = NULL;
-static bool file_opened = false;
-static char current_file[1024] = { 0 };
+// Server metrics. Counters are bumped with relaxed atomics on the request
+// path and only read by the serverStats tool and the /metrics endpoint.
+// Durations are in microseconds of the monotonic clock.
+#define R2MCP_HIST_BUCKETS 10
+
+// Upper bounds of the latency histogram buckets, the last one is +Inf
+static const ut64 r2mcp_hist_le[R2MCP_HIST_BUCKETS - 1] = {
+	1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 30000000
+};
+
+typedef struct {
+	ut64 calls;
+	ut64 errors;
+	ut64 memo_hits;
+	ut64 us;
+	ut64 max_us;
+	ut64 bytes_out;
+	ut64 hist[R2MCP_HIST_BUCKETS];
+} R2McpToolStats;
+
+// Where the time of a request goes
+typedef enum {
+	R2MCP_PHASE_PARSE,   // JSON-RPC parsing of the incoming messages
+	R2MCP_PHASE_COMMAND, // r_core_cmd_str through r2_cmd
+	R2MCP_PHASE_FILTER,  // filtering the output lines of commands
+	R2MCP_PHASE_SEND,    // writing responses and notifications
+	R2MCP_PHASE_COUNT
+} R2McpPhase;
+
+static const char *r2mcp_phase_names[R2MCP_PHASE_COUNT] = { "parse", "command", "filter", "send" };
+
+typedef struct {
+	ut64 started;
+	ut64 messages;
+	ut64 bytes_in;
+	ut64 bytes_out;
+	ut64 prefetched; // tool calls run by the idle-time prefetcher
+	ut64 timeouts;   // tool calls interrupted by their deadline
+	ut64 truncated;  // tool results cut to their byte budget
+	ut64 refused;    // tool calls refused by the session memory ceiling
+	ut64 phase_us[R2MCP_PHASE_COUNT];
+	ut64 phase_calls[R2MCP_PHASE_COUNT];
+	R2McpToolStats *tools; // indexed like the tool registry
+} R2McpStats;
+
+static R2McpStats stats = { 0 };
+
+static inline void stats_add(ut64 *counter, ut64 n) {
+	__atomic_fetch_add (counter, n, __ATOMIC_RELAXED);
+}
+
+static void stats_max(ut64 *max, ut64 v) {
+	ut64 cur = __atomic_load_n (max, __ATOMIC_RELAXED);
+	while (v > cur && !__atomic_compare_exchange_n (max, &cur, v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+// Account the time since start to a phase
+static inline void stats_phase(R2McpPhase phase, ut64 start) {
+	stats_add (&stats.phase_us[phase], r_time_now_mono () - start);
+	stats_add (&stats.phase_calls[phase], 1);
+}
+
+// Resident memory of the whole process. All the session cores share it,
+// so sessions get charged with what it grew while loading and analyzing.
+static ut64 stats_rss(void) {
+#if __linux__
+	ut64 size = 0, resident = 0;
+	FILE *fd = fopen ("/proc/self/statm", "r");
+	if (fd) {
+		if (fscanf (fd, "%" PFMT64u " %" PFMT64u, &size, &resident) != 2) {
+			resident = 0;
+		}
+		fclose (fd);
+	}
+	return resident * sysconf (_SC_PAGESIZE);
+#else
+	// peak instead of current, in bytes on macOS
+	struct rusage ru;
+	return getrusage (RUSAGE_SELF, &ru) ? 0 : (ut64)ru.ru_maxrss;
+#endif
+}
+
+#define R2MCP_MAX_SESSIONS 8
+
+// How the file of a session is loaded
+typedef enum {
+	R2MCP_OPEN_AUTO,     // mmap for local files, buffered for anything else
+	R2MCP_OPEN_MMAP,     // read-only mmap:// backend, pages are read on demand
+	R2MCP_OPEN_BUFFERED, // regular io backend, with bin.cache
+} R2McpOpenMode;
+
+// One opened binary with its own RCore, so switching between files keeps
+// their analysis around. Sessions are kept in most-recently-used order.
+typedef struct {
+	ut32 id;
+	RCore *core;
+	char *path;
+	R2McpOpenMode open_mode;
+	RConfigNode **settings; // nodes of the r2_settings_table keys in this core
+	int refs;  // the pool list and every queued or running job hold one
+	bool busy; // a worker is running a job on this core
+	struct r2mcp_analysis_t *analysis; // last background analysis
+	char *hash;       // cache key of the file, NULL without cache
+	char *cache_file; // analysis script edits are appended to
+	int cache_level;  // analysis level available in the cache, -1 if none
+	int level;        // analysis level run on the core, -1 if none
+	RList *dirty;     // R2McpDirty, functions edited since the last analysis
+	RList *edits;     // every command run by r2_mutate since it was opened
+	struct r2mcp_index_t *index; // xref and name lookup tables
+	HtPP *memo;       // tool call key => finished tool result
+	ut64 mem;         // estimated bytes held by its core, see session_measure
+	size_t memo_bytes;
+	ut64 generation; // bumped by analysis and edits, invalidates memo
+	ut64 memo_generation;
+	ut64 memo_hits;
+	ut64 memo_misses;
+	HtUP *decomp;     // function address => R2McpDecomp, survives edits
+	size_t decomp_bytes;
+	ut64 decomp_hits;
+	ut64 decomp_misses;
+} R2McpSession;
+
+typedef struct r2mcp_client_t R2McpClient;
+
+// Progress of a running analysis, fed by the radare2 log messages that
+// are emitted from the thread running it
+typedef struct {
+	RCore *core;
+	R2McpClient *client; // where the notifications go
+	char *token; // progressToken of the request, NULL if none
+	int step;
+	char *pass; // last analysis step reported by radare2
+	int functions;
+} R2McpProgress;
+
+typedef enum {
+	R2MCP_ANALYSIS_RUNNING,
+	R2MCP_ANALYSIS_DONE,
+	R2MCP_ANALYSIS_FAILED,
+	R2MCP_ANALYSIS_CANCELLED,
+} R2McpAnalysisState;
+
+// Background analysis runs on a second core loaded with the same file and
+// its cached analysis, so the session core keeps answering queries. Once
+// finished, the analyzed core replaces the session one and every edit done
+// on the session is replayed on it.
+typedef struct r2mcp_analysis_t {
+	R2McpProgress progress;
+	R2McpSession *ss;
+	int level;
+	R2McpAnalysisState state;
+	ut64 started;
+	ut64 finished;
+	RCore *core; // analyzed by the thread, created before it starts
+	bool cancel;
+} R2McpAnalysis;
+
+// Calls on different sessions only run at the same time when radare2
+// gives every core its own RCons, see r2_cons_gate_enter
+#define R2MCP_WORKERS 4
+
+// A tools/call request handed to a worker thread. The request is parsed
+// from msg, a copy of the framed message, because the job outlives the
+// read buffer.
+typedef struct {
+	char *msg;
+	RJson *request;
+	char *id;
+	R2McpClient *client; // where the response goes
+	R2McpSession *ss; // NULL for tools not working on a session
+	bool cancelled;   // set by notifications/cancelled while running
+	bool running;     // past the RCons gate, its core may be broken
+} R2McpJob;
+
+// The lock protects the session list, the session refs/busy fields and the
+// job queue. Workers pick the oldest job whose session is not busy, so
+// each RCore is only used by one thread at a time while jobs on other
+// sessions keep running.
+typedef struct {
+	RList *sessions; // R2McpSession, most recently used first
+	RCore *spare;    // core inherited from the warm daemon, for the first openFile
+	int max_sessions;
+	ut32 next_id;
+	ut32 id_step;  // between session ids, the number of shards in a shard
+	RList *jobs;   // R2McpJob, in arrival order
+	RList *active; // R2McpJob being run by a worker
+	int analyses;  // background analysis threads running
+	RList *prefetch;           // R2McpPrefetch plans, NULL when disabled
+	R2McpSession *prefetching; // session the prefetcher has claimed
+	bool prefetch_yield;       // a request wants the prefetcher out
+	int prefetch_waiters;      // requests waiting for its call to end
+	pthread_t prefetcher;
+	pthread_t *workers;
+	int nworkers;
+	bool running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} R2McpPool;
+
+static R2McpPool pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+// A tools/call forwarded to a shard process, waiting for its response
+typedef struct {
+	ut64 id;             // JSON-RPC id on the shard connection
+	char *result;        // tool result or error response, NULL until done
+	bool done;
+	R2McpClient *client; // where the notifications of the call go
+	R2McpJob *job;       // job making the call, to forward its cancellation
+	const char *token;   // progressToken of the call, NULL if none
+} R2McpShardCall;
+
+typedef struct {
+	pid_t pid;
+	int fd;       // coordinator end of the socket pair
+	bool alive;   // until the shard closes its end
+	bool reading; // the reader thread was started
+	pthread_t reader;
+	pthread_mutex_t wlock; // keeps the requests written whole
+	RList *pending;        // R2McpShardCall
+} R2McpShard;
+
+#define R2MCP_SHARDS_MAX 64
+
+// The lock protects the pending calls, the routing tables and last. It is
+// never held while writing to a shard.
+typedef struct {
+	R2McpShard *list;
+	int count;      // 0 unless this process is the coordinator
+	ut64 next_id;
+	HtPP *paths;    // file path => shard index + 1
+	HtUP *sessions; // session id => file path, for split analyses
+	ut32 last;      // session of the last routed call
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} R2McpShards;
+
+static R2McpShards shards = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+static pthread_mutex_t stdout_lock = PTHREAD_MUTEX_INITIALIZER;
 static volatile sig_atomic_t running = 1;
 static bool is_direct_mode = false;
 static ServerState server_state = {
@@ -99,41 +592,209 @@ static ServerState server_state = {
 };
 
 // Forward declarations
-static void process_mcp_message(const char *msg);
+static bool process_mcp_message(R2McpClient *client, char *msg);
 static void direct_mode_loop(void);
+static void prefetch_yield_locked(void);
+static void prefetch_interrupt_locked(void);
+static void prefetch_request_locked(R2McpSession *ss);
+static void decomp_clear(R2McpSession *ss);
+static void dirty_clear(R2McpSession *ss);
+static void index_free(struct r2mcp_index_t *ix);
+static void budget_init(void);
+static void watchdog_start(void);
+static void watchdog_stop(void);
+static size_t json_escape(char *dst, const char *s);
+static void json_write_str(RStrBuf *sb, const char *s);
+static void json_write(RStrBuf *sb, const RJson *js);
+static bool shards_start(int n);
+static void shards_stop(void);
+static void shard_cancel(R2McpJob *job);
+static char *shard_invoke(const char *name, RJson *params, ut32 session);
+static char *shard_open_file(const char *filepath, RJson *params);
+static char *shard_list_sessions(void);
 
 #define JSON_RPC_VERSION "2.0"
 #define MCP_VERSION      "2024-11-05"
 
+// Incremental JSON-RPC framer state. Bytes in [rpos, size) are unconsumed,
+// bytes in [rpos, scan) have already been classified so every read only
+// scans the new data. Messages are returned as views into data.
 typedef struct {
 	char *data;
 	size_t size;
 	size_t capacity;
+	size_t rpos;     // read cursor, start of the unconsumed data
+	size_t scan;     // next byte to classify
+	size_t start;    // offset of the message being framed (depth > 0)
+	int depth;       // brace nesting level outside of strings
+	bool in_string;  // inside a JSON string literal
+	bool escape;     // previous byte was a backslash inside a string
+	size_t term_pos; // byte overwritten with the NUL terminator of the last view
+	char term_chr;
+	bool term_set;
 } ReadBuffer;
 
+// Settings every session core runs with
+typedef struct {
+	const char *key;
+	ut64 value;
+	bool is_bool;
+} R2McpSetting;
+
+static const R2McpSetting r2_settings_table[] = {
+	{ "scr.color", 0, false },
+	{ "scr.utf8", false, true },
+	{ "scr.interactive", false, true },
+	{ "emu.str", true, true },
+	{ "asm.bytes", false, true },
+	{ "anal.strings", true, true },
+	{ "asm.lines", false, true },
+	{ "anal.hasnext", true, true }, // TODO: optional
+	{ "asm.lines.fcn", false, true },
+	{ "asm.cmt.right", false, true },
+	{ "scr.html", false, true },
+	{ "scr.prompt", false, true },
+	{ "scr.echo", false, true },
+	{ "scr.flush", true, true },
+	{ "scr.null", false, true },
+	{ "scr.pipecolor", false, true },
+	{ "scr.limit", 16768, false },
+};
+
+#define R2MCP_SETTINGS_COUNT (sizeof (r2_settings_table) / sizeof (r2_settings_table[0]))
+
+static void r2_setting_apply(RCore *core, const R2McpSetting *s) {
+	if (s->is_bool) {
+		r_config_set_b (core->config, s->key, s->value);
+	} else {
+		r_config_set_i (core->config, s->key, s->value);
+	}
+}
+
 static void r2_settings(RCore *core) {
-	r_config_set_i (core->config, "scr.color", 0);
-	r_config_set_b (core->config, "scr.utf8", false);
-	r_config_set_b (core->config, "scr.interactive", false);
-	r_config_set_b (core->config, "emu.str", true);
-	r_config_set_b (core->config, "asm.bytes", false);
-	r_config_set_b (core->config, "anal.strings", true);
-	r_config_set_b (core->config, "asm.lines", false);
-	r_config_set_b (core->config, "anal.hasnext", true); // TODO: optional
-	r_config_set_b (core->config, "asm.lines.fcn", false);
-	r_config_set_b (core->config, "asm.cmt.right", false);
-	r_config_set_b (core->config, "scr.html", false);
-	r_config_set_b (core->config, "scr.prompt", false);
-	r_config_set_b (core->config, "scr.echo", false);
-	r_config_set_b (core->config, "scr.flush", true);
-	r_config_set_b (core->config, "scr.null", false);
-	r_config_set_b (core->config, "scr.pipecolor", false);
-	r_config_set_b (core->config, "scr.utf8", false);
-	r_config_set_i (core->config, "scr.limit", 16768);
+	size_t i;
+	for (i = 0; i < R2MCP_SETTINGS_COUNT; i++) {
+		r2_setting_apply (core, &r2_settings_table[i]);
+	}
+}
+
+// Put back the settings changed by the last command. The config nodes of
+// the session core are looked up once, so checking a key that did not
+// change is a pointer read, without lookups nor change callbacks.
+static void r2_settings_restore(R2McpSession *ss) {
+	size_t i;
+	for (i = 0; i < R2MCP_SETTINGS_COUNT; i++) {
+		const RConfigNode *node = ss->settings[i];
+		if (node && node->i_value != r2_settings_table[i].value) {
+			r2_setting_apply (ss->core, &r2_settings_table[i]);
+		}
+	}
+}
+
+// Look up the config nodes of a new session core, and restore the
+// settings that loading the file or the cache may have changed
+static void r2_settings_bind(R2McpSession *ss) {
+	size_t i;
+	for (i = 0; i < R2MCP_SETTINGS_COUNT; i++) {
+		ss->settings[i] = r_config_node_get (ss->core->config, r2_settings_table[i].key);
+	}
+	r2_settings_restore (ss);
+}
+
+// Per-request scratch memory. Strings only needed while a request is
+// handled (command lines, their filtered copies, response envelopes) are
+// bumped from the arena of the thread, which is reset wholesale once the
+// response is written. The first chunk stays around for the next request.
+#define R2MCP_ARENA_CHUNK (64 * 1024)
+
+typedef struct r2mcp_arena_chunk_t {
+	struct r2mcp_arena_chunk_t *next; // older chunk
+	size_t size;
+	size_t used;
+	char data[];
+} R2McpArenaChunk;
+
+static R_TH_LOCAL R2McpArenaChunk *arena_head = NULL;
+
+#define R2MCP_ARENA_ALIGN(x) (((x) + 15) & ~(size_t)15)
+
+static void *arena_alloc(size_t len) {
+	len = R2MCP_ARENA_ALIGN (len);
+	R2McpArenaChunk *c = arena_head;
+	if (!c || c->used + len > c->size) {
+		const size_t size = R_MAX (len, R2MCP_ARENA_CHUNK);
+		c = malloc (sizeof (R2McpArenaChunk) + size);
+		if (!c) {
+			return NULL;
+		}
+		c->next = arena_head;
+		c->size = size;
+		c->used = 0;
+		arena_head = c;
+	}
+	void *p = c->data + c->used;
+	c->used += len;
+	return p;
+}
+
+static char *arena_strdup(const char *s) {
+	const size_t len = strlen (s);
+	char *o = arena_alloc (len + 1);
+	if (o) {
+		memcpy (o, s, len + 1);
+	}
+	return o;
+}
+
+// Formatted in place when it fits the current chunk, the common case
+static char *arena_newf(const char *fmt, ...) {
+	va_list ap, ap2;
+	va_start (ap, fmt);
+	va_copy (ap2, ap);
+	R2McpArenaChunk *c = arena_head;
+	const size_t room = c ? c->size - c->used : 0;
+	const int len = vsnprintf (room ? c->data + c->used : NULL, room, fmt, ap);
+	va_end (ap);
+	char *o = NULL;
+	if (len >= 0 && (size_t)len < room) {
+		o = c->data + c->used;
+		c->used += R2MCP_ARENA_ALIGN ((size_t)len + 1);
+	} else if (len >= 0 && (o = arena_alloc ((size_t)len + 1))) {
+		vsnprintf (o, (size_t)len + 1, fmt, ap2);
+	}
+	va_end (ap2);
+	return o;
+}
+
+// Drop everything allocated since the last reset, keeping the oldest
+// chunk unless a big allocation made it
+static void arena_reset(void) {
+	R2McpArenaChunk *c = arena_head;
+	while (c && c->next) {
+		R2McpArenaChunk *next = c->next;
+		free (c);
+		c = next;
+	}
+	if (c && c->size > R2MCP_ARENA_CHUNK) {
+		free (c);
+		c = NULL;
+	}
+	if (c) {
+		c->used = 0;
+	}
+	arena_head = c;
+}
+
+// Called by the threads handling requests before they exit
+static void arena_fini(void) {
+	arena_reset ();
+	free (arena_head);
+	arena_head = NULL;
 }
 
 static char *r2_cmd_filter(const char *cmd, bool *changed) {
-	char *res = r_str_trim_dup (cmd);
+	char *res = arena_strdup (cmd);
+	r_str_trim (res);
 	char fchars[] = "|>`";
 	*changed = false;
 	if (*res == '!') {
@@ -156,42 +817,58 @@ static char *r2_cmd_filter(const char *cmd, bool *changed) {
 	return res;
 }
 
-static char *r2_cmd(const char *cmd) {
-	if (!r_core || !file_opened) {
-		return strdup ("Use the openFile method before calling any other method");
-	}
+static char *r2_cmd(R2McpSession *ss, const char *cmd) {
 	bool changed = false;
 	char *filteredCommand = r2_cmd_filter (cmd, &changed);
 	if (changed) {
-		r2mcp_log ("command injection prevented");
+		r2mcp_log (R2MCP_LOGLVL_WARNING, "command injection prevented");
 	}
-	char *res = r_core_cmd_str (r_core, filteredCommand);
-	free (filteredCommand);
-	r2_settings (r_core);
+	const ut64 start = r_time_now_mono ();
+	char *res = r_core_cmd_str (ss->core, filteredCommand);
+	stats_phase (R2MCP_PHASE_COMMAND, start);
+	r2_settings_restore (ss);
 	return res;
 }
 
-ReadBuffer *read_buffer_new(void) {
-	ReadBuffer *buf = R_NEW (ReadBuffer);
+static ReadBuffer *read_buffer_new(void) {
+	ReadBuffer *buf = R_NEW0 (ReadBuffer);
 	buf->data = malloc (BUFFER_SIZE);
-	buf->size = 0;
 	buf->capacity = BUFFER_SIZE;
 	return buf;
 }
 
-static void read_buffer_append(ReadBuffer *buf, const char *data, size_t len) {
-	if (buf->size + len > buf->capacity) {
-		size_t new_capacity = buf->capacity * 2;
-		char *new_data = realloc (buf->data, new_capacity);
-		if (!new_data) {
-			R_LOG_ERROR ("Failed to resize buffer");
-			return;
+// Make room for at least len more bytes (plus the NUL terminator) at the end
+// of the buffer. Consumed bytes are only dropped here, so the tail is moved
+// at most once per refill instead of once per message.
+static bool read_buffer_reserve(ReadBuffer *buf, size_t len) {
+	if (buf->size + len + 1 <= buf->capacity) {
+		return true;
+	}
+	if (buf->rpos > 0) {
+		size_t remaining = buf->size - buf->rpos;
+		memmove (buf->data, buf->data + buf->rpos, remaining);
+		buf->scan -= buf->rpos;
+		if (buf->depth > 0) {
+			buf->start -= buf->rpos;
 		}
-		buf->data = new_data;
-		buf->capacity = new_capacity;
+		buf->size = remaining;
+		buf->rpos = 0;
+		if (buf->size + len + 1 <= buf->capacity) {
+			return true;
+		}
+	}
+	size_t new_capacity = buf->capacity;
+	while (buf->size + len + 1 > new_capacity) {
+		new_capacity *= 2;
 	}
-	memcpy (buf->data + buf->size, data, len);
-	buf->size += len;
+	char *new_data = realloc (buf->data, new_capacity);
+	if (!new_data) {
+		R_LOG_ERROR ("Failed to resize buffer");
+		return false;
+	}
+	buf->data = new_data;
+	buf->capacity = new_capacity;
+	return true;
 }
 
 static void read_buffer_free(ReadBuffer *buf) {
@@ -203,148 +880,1017 @@ static void read_buffer_free(ReadBuffer *buf) {
 
 static char *handle_initialize(RJson *params);
 static char *handle_list_tools(RJson *params);
-static char *handle_call_tool(RJson *params);
-static char *format_string(const char *format, ...);
-static char *format_string(const char *format, ...) {
-	char buffer[4096];
-	va_list args;
-	va_start (args, format);
-	vsnprintf (buffer, sizeof (buffer), format, args);
-	va_end (args);
-	return strdup (buffer);
-}
+static char *handle_call_tool(RJson *params, R2McpSession *ss);
+static char *create_success_response(const char *result, const char *id);
+static void send_notification(R2McpClient *client, const char *msg);
+static R2McpClient *client_ref(R2McpClient *c);
+static void client_unref(R2McpClient *c);
+static void pj_kid(PJ *pj, const char *key, const char *id);
+static bool progress_log_cb(void *user, int type, const char *origin, const char *msg);
+
+// Tool registry flags
+#define R2MCP_TOOL_SESSION  1 // works on the file opened in a session
+#define R2MCP_TOOL_READONLY 2 // result only depends on the analysis, so it is memoized
+#define R2MCP_TOOL_MUTATES  4 // changes the analysis of the session
+#define R2MCP_TOOL_WAITS    8 // waits with its own timeout, no deadline applies
+#define R2MCP_TOOL_SHARD   16 // used by the shard coordinator, left out of tools/list
+
+// Rough price of a tool call, for scheduling and accounting
+typedef enum {
+	R2MCP_COST_CHEAP,  // metadata lookups
+	R2MCP_COST_NORMAL, // listings and short disassemblies
+	R2MCP_COST_HEAVY,  // analysis, decompilation and whole file scans
+	R2MCP_COST_COUNT
+} R2McpToolCost;
+
+struct r2mcp_tool_t;
+
+// Everything a tool handler gets to work with
+typedef struct {
+	const struct r2mcp_tool_t *tool;
+	R2McpSession *ss; // NULL for the tools not flagged with R2MCP_TOOL_SESSION
+	RJson *params;
+	RJson *args;
+} R2McpToolCall;
 
-static bool init_r2(void) {
-	r_core = r_core_new ();
-	if (!r_core) {
-		R_LOG_ERROR ("Failed to initialize radare2 core");
-		return false;
+typedef struct r2mcp_tool_t {
+	const char *name;
+	const char *description;
+	const char *schema;
+	char *(*fn)(R2McpToolCall *tc);
+	const char *cmd;  // fixed command run by tool_cmd
+	const char *jcmd; // command giving the same data as JSON, for format:json
+	int flags;
+	R2McpToolCost cost;
+} R2McpTool;
+
+static const R2McpTool *tool_find(const char *name);
+static char *tool_server_stats(R2McpToolCall *tc);
+static char *stats_prometheus(void);
+static char *tool_invoke(R2McpSession *ss, const char *name, RJson *params);
+
+// On-disk analysis cache. The analysis state of every analyzed binary is
+// saved as an r2 script named after a sample of the file contents and the
+// analysis level, and edits done later are appended to it, so opening the
+// same binary again only needs to run the script. The script starts with
+// the hash of the whole file, only checked when a script is found.
+static char *cache_dir = NULL;
+
+// R2MCP_CACHE_DIR selects the directory, empty disables the cache
+static void cache_init(void) {
+	char *dir = r_sys_getenv ("R2MCP_CACHE_DIR");
+	if (!dir) {
+		dir = r_file_home (".cache/r2mcp");
+	}
+	if (R_STR_ISEMPTY (dir) || !r_sys_mkdirp (dir)) {
+		R_FREE (dir);
 	}
+	cache_dir = dir;
+}
 
-	r2_settings (r_core);
+#define R2MCP_CACHE_SAMPLE 4096
+#define R2MCP_CACHE_DIGEST "# r2mcp digest "
 
-	R_LOG_INFO ("Radare2 core initialized");
-	return true;
+static ut64 cache_hash_update(ut64 h, const ut8 *buf, ssize_t n) {
+	ssize_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		ut64 w;
+		memcpy (&w, buf + i, sizeof (w));
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	for (; i < n; i++) {
+		h = (h ^ buf[i]) * 0x100000001b3ULL;
+	}
+	return h;
 }
 
-static void cleanup_r2(void) {
-	if (r_core) {
-		r_core_free (r_core);
-		r_core = NULL;
-		file_opened = false;
-		memset (current_file, 0, sizeof (current_file));
+// Key of a file from its size and its first and last pages, cheap enough
+// for every open. Only used to tell cached analyses apart.
+static char *cache_file_key(const char *path) {
+	int fd = open (path, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
 	}
+	struct stat st;
+	ut8 buf[R2MCP_CACHE_SAMPLE];
+	ut64 h = 0xcbf29ce484222325ULL;
+	ssize_t n = -1;
+	if (!fstat (fd, &st) && (n = pread (fd, buf, sizeof (buf), 0)) >= 0) {
+		h = cache_hash_update (h, buf, n);
+		if (st.st_size > (off_t)sizeof (buf)) {
+			const off_t tail = R_MAX (st.st_size - (off_t)sizeof (buf), (off_t)sizeof (buf));
+			n = pread (fd, buf, sizeof (buf), tail);
+			h = cache_hash_update (h, buf, n);
+		}
+	}
+	close (fd);
+	return n < 0 ? NULL : r_str_newf ("%016" PFMT64x "-%" PFMT64x, h, (ut64)st.st_size);
 }
 
-static bool r2_open_file(const char *filepath) {
-	R_LOG_INFO ("Attempting to open file: %s\n", filepath);
-
-	if (!r_core && !init_r2 ()) {
-		R_LOG_ERROR ("Failed to initialize r2 core\n");
-		return false;
+// Fast non-cryptographic hash of the whole file contents, telling apart
+// the files whose key is the same
+static char *cache_file_hash(const char *path) {
+	const size_t bufsz = 1024 * 1024;
+	int fd = open (path, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
 	}
-
-	if (file_opened) {
-		R_LOG_INFO ("Closing previously opened file: %s", current_file);
-		r_core_cmd0 (r_core, "o-*");
-		file_opened = false;
-		memset (current_file, 0, sizeof (current_file));
+	ut8 *buf = malloc (bufsz);
+	ut64 h = 0xcbf29ce484222325ULL;
+	ut64 size = 0;
+	ssize_t n = -1;
+	while (buf && (n = read (fd, buf, bufsz)) > 0) {
+		h = cache_hash_update (h, buf, n);
+		size += n;
 	}
+	close (fd);
+	free (buf);
+	return n < 0 ? NULL : r_str_newf ("%016" PFMT64x "-%" PFMT64x, h, size);
+}
 
-	r_core_cmd0 (r_core, "e bin.relocs.apply=true");
-	r_core_cmd0 (r_core, "e bin.cache=true");
+static char *cache_path(const char *hash, int level) {
+	return r_str_newf ("%s/%s-%d.r2", cache_dir, hash, level);
+}
 
-	char *cmd = r_str_newf ("'o %s", filepath);
-	R_LOG_INFO ("Running r2 command: %s", cmd);
-	char *result = r_core_cmd_str (r_core, cmd);
-	free (cmd);
-	bool success = (result && strlen (result) > 0);
-	free (result);
+// Whether the script was saved for a file with the same contents
+static bool cache_match(const char *script, const char *digest) {
+	char *data = r_file_slurp (script, NULL);
+	const bool match = data && digest && r_str_startswith (data, R2MCP_CACHE_DIGEST)
+		&& r_str_startswith (data + strlen (R2MCP_CACHE_DIGEST), digest);
+	free (data);
+	return match;
+}
 
-	if (!success) {
-		R_LOG_INFO ("Trying alternative method to open file");
-		RIODesc *fd = r_core_file_open (r_core, filepath, R_PERM_R, 0);
-		if (fd) {
-			r_core_bin_load (r_core, filepath, 0);
-			R_LOG_INFO ("File opened using r_core_file_open");
-			success = true;
-		} else {
-			R_LOG_ERROR ("Failed to open file: %s", filepath);
-			return false;
+// Load the deepest cached analysis of the file into the core, the whole
+// file is only hashed when a script is found for its key
+static int cache_load(RCore *core, const char *key, const char *filepath, char **file) {
+	char *digest = NULL;
+	int level;
+	for (level = 4; level >= 0; level--) {
+		char *path = cache_path (key, level);
+		if (r_file_exists (path)) {
+			if (!digest) {
+				digest = cache_file_hash (filepath);
+			}
+			if (cache_match (path, digest)) {
+				R_LOG_INFO ("Loading cached analysis from %s", path);
+				r_core_cmd_file (core, path);
+				*file = path;
+				free (digest);
+				return level;
+			}
+			R_LOG_INFO ("Ignoring %s, saved for another file", path);
 		}
+		free (path);
 	}
+	free (digest);
+	return -1;
+}
 
-	R_LOG_INFO ("Loading binary information");
-	r_core_cmd0 (r_core, "ob");
+// Save functions, names, prototypes, comments and xrefs of the core,
+// after the digest of the file they belong to
+static char *cache_save(RCore *core, const char *key, const char *filepath, int level) {
+	if (!cache_dir || !key) {
+		return NULL;
+	}
+	char *path = cache_path (key, level);
+	char *digest = cache_file_hash (filepath);
+	const int opts = R_CORE_PRJ_FLAGS | R_CORE_PRJ_META | R_CORE_PRJ_XREFS
+		| R_CORE_PRJ_FCNS | R_CORE_PRJ_ANAL_HINTS | R_CORE_PRJ_ANAL_TYPES;
+	char *data = NULL;
+	if (digest && r_core_project_save_script (core, path, opts)
+			&& (data = r_file_slurp (path, NULL))) {
+		char *script = r_str_newf (R2MCP_CACHE_DIGEST "%s\n%s", digest, data);
+		if (!r_file_dump (path, (const ut8 *)script, -1, false)) {
+			R_FREE (data);
+		}
+		free (script);
+	}
+	if (!data) {
+		R_LOG_WARN ("Cannot save the analysis cache in %s", path);
+		r_file_rm (path);
+		R_FREE (path);
+	}
+	free (data);
+	free (digest);
+	return path;
+}
+
+// Append an edit to the cached analysis so reloading the file keeps it
+static void cache_append(const char *file, const char *cmd) {
+	if (file) {
+		char *line = r_str_newf ("%s\n", cmd);
+		// the script is line based, an edit must stay on a single line
+		char *nl = strchr (line, '\n');
+		while (nl && nl[1]) {
+			*nl = ' ';
+			nl = strchr (nl, '\n');
+		}
+		r_file_dump (file, (const ut8 *)line, -1, true);
+		free (line);
+	}
+}
 
-	strncpy (current_file, filepath, sizeof (current_file) - 1);
-	file_opened = true;
-	R_LOG_INFO ("File opened successfully: %s", filepath);
+static void session_cache_save(R2McpSession *ss, int level) {
+	char *file = cache_save (ss->core, ss->hash, ss->path, level);
+	if (file) {
+		free (ss->cache_file);
+		ss->cache_file = file;
+		ss->cache_level = level;
+	}
+}
 
-	return true;
+// Whether the cores share one RCons, as on the radare2 builds where it is
+// a singleton. Unknown until a second core is created, and taken as shared
+// meanwhile: concurrent commands would mix their output and a break would
+// interrupt the commands of every core.
+typedef enum {
+	R2MCP_CONS_UNKNOWN,
+	R2MCP_CONS_SHARED,
+	R2MCP_CONS_OWN,
+} R2McpConsMode;
+
+static RCons *cons_first = NULL;
+static R2McpConsMode cons_mode = R2MCP_CONS_UNKNOWN;
+static pthread_mutex_t cons_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool r2_cons_own(void) {
+	pthread_mutex_lock (&cons_lock);
+	const bool own = cons_mode == R2MCP_CONS_OWN;
+	pthread_mutex_unlock (&cons_lock);
+	return own;
 }
 
-static bool r2_analyze(int level) {
-	if (!r_core || !file_opened) {
+static bool r2_cons_shared(void) {
+	pthread_mutex_lock (&cons_lock);
+	const bool shared = cons_mode == R2MCP_CONS_SHARED;
+	pthread_mutex_unlock (&cons_lock);
+	return shared;
+}
+
+// Held while running radare2 commands when the cores may share an RCons,
+// so the tool calls on different sessions run one after the other there
+// while the reader thread keeps handling pings and cancellations. Returns
+// whether it was taken, for r2_cons_gate_leave. Never wait for another
+// thread running commands while holding it.
+static pthread_mutex_t cons_gate = PTHREAD_MUTEX_INITIALIZER;
+
+static bool r2_cons_gate_enter(void) {
+	// a coordinator has no cores, its shards run the commands
+	if (shards.count || r2_cons_own ()) {
 		return false;
 	}
-	const char *cmd = "aa";
-	switch (level) {
-	case 1: cmd = "aac"; break;
-	case 2: cmd = "aaa"; break;
-	case 3: cmd = "aaaa"; break;
-	case 4: cmd = "aaaaa"; break;
-	}
-	r_core_cmd0 (r_core, cmd);
+	pthread_mutex_lock (&cons_gate);
 	return true;
 }
 
-static void signal_handler(int signum) {
-	const char msg[] = "\nInterrupt received, shutting down...\n";
-	write (STDERR_FILENO, msg, sizeof (msg) - 1);
+static void r2_cons_gate_leave(bool held) {
+	if (held) {
+		pthread_mutex_unlock (&cons_gate);
+	}
+}
 
-	running = 0;
+static RCore *r2_core_new(void) {
+	RCore *core = r_core_new ();
+	if (!core) {
+		R_LOG_ERROR ("Failed to initialize radare2 core");
+		return NULL;
+	}
+	r2_settings (core);
+	pthread_mutex_lock (&cons_lock);
+	if (!cons_first) {
+		cons_first = core->cons;
+	} else if (cons_mode != R2MCP_CONS_SHARED) {
+		// a freed RCons reused at the same address only errs on the safe side
+		cons_mode = core->cons == cons_first ? R2MCP_CONS_SHARED : R2MCP_CONS_OWN;
+	}
+	pthread_mutex_unlock (&cons_lock);
+	return core;
+}
 
-	signal (signum, SIG_DFL);
+static bool init_r2(void) {
+	pool.sessions = r_list_new ();
+	pool.jobs = r_list_new ();
+	pool.active = r_list_new ();
+	pool.next_id = 1;
+	pool.id_step = 1;
+	pool.max_sessions = R2MCP_MAX_SESSIONS;
+	char *max = r_sys_getenv ("R2MCP_MAX_SESSIONS");
+	if (R_STR_ISNOTEMPTY (max) && atoi (max) > 0) {
+		pool.max_sessions = atoi (max);
+	}
+	free (max);
+	r_log_add_callback (progress_log_cb, NULL);
+	cache_init ();
+	budget_init ();
+	// cores are created by openFile, so initialize, tools/list and ping
+	// answer without waiting for radare2 to load its plugins
+	return true;
 }
 
-static bool check_client_capability(const char *capability) {
-	if (!server_state.client_capabilities) {
-		return false;
+static void analysis_free(R2McpAnalysis *an) {
+	if (an) {
+		free (an->progress.token);
+		free (an->progress.pass);
+		client_unref (an->progress.client);
+		r_core_free (an->core);
+		free (an);
 	}
-	RJson *cap = (RJson *)r_json_get (server_state.client_capabilities, capability);
-	return cap != NULL;
 }
 
-static bool check_server_capability(const char *capability) {
-	if (!strcmp (capability, "logging")) {
-		return server_state.capabilities.logging;
+static void session_free(R2McpSession *ss) {
+	if (ss) {
+		analysis_free (ss->analysis);
+		free (ss->hash);
+		free (ss->cache_file);
+		free (ss->settings);
+		r_list_free (ss->edits);
+		ht_pp_free (ss->memo);
+		ht_up_free (ss->decomp);
+		r_list_free (ss->dirty);
+		index_free (ss->index);
+		r_core_free (ss->core);
+		free (ss->path);
+		free (ss);
 	}
-	if (!strcmp (capability, "tools")) {
-		return server_state.capabilities.tools;
+}
+
+static void session_unref_locked(R2McpSession *ss) {
+	if (ss && --ss->refs == 0) {
+		session_free (ss);
 	}
-	return false;
 }
 
-static bool assert_capability_for_method(const char *method, char **error) {
-	if (!strcmp (method, "sampling/createMessage")) {
-		if (!check_client_capability ("sampling")) {
-			*error = strdup ("Client does not support sampling");
-			return false;
-		}
-	} else if (!strcmp (method, "roots/list")) {
-		if (!check_client_capability ("roots")) {
-			*error = strdup ("Client does not support listing roots");
-			return false;
+static void cleanup_r2(void) {
+	R2McpSession *ss;
+	RListIter *iter;
+	// interrupt the background analyses and wait for them to finish
+	pthread_mutex_lock (&pool.lock);
+	r_list_foreach (pool.sessions, iter, ss) {
+		R2McpAnalysis *an = ss->analysis;
+		if (an && an->state == R2MCP_ANALYSIS_RUNNING) {
+			an->cancel = true;
+			if (an->progress.core) {
+				r_cons_context_break (an->progress.core->cons->context);
+			}
 		}
 	}
-	return true;
+	while (pool.analyses > 0) {
+		pthread_cond_wait (&pool.cond, &pool.lock);
+	}
+	pthread_mutex_unlock (&pool.lock);
+	while ((ss = r_list_pop_head (pool.sessions))) {
+		session_unref_locked (ss);
+	}
+	r_list_free (pool.sessions);
+	pool.sessions = NULL;
+	r_list_free (pool.jobs);
+	pool.jobs = NULL;
+	r_list_free (pool.active);
+	pool.active = NULL;
+	r_core_free (pool.spare);
+	pool.spare = NULL;
+	R_FREE (cache_dir);
 }
 
-static bool assert_request_handler_capability(const char *method, char **error) {
-	if (!strcmp (method, "sampling/createMessage")) {
-		if (!check_server_capability ("sampling")) {
-			*error = strdup ("Server does not support sampling");
+// Mark the session as the most recently used one
+static void session_touch_locked(R2McpSession *ss) {
+	if (r_list_first (pool.sessions) != ss) {
+		r_list_delete_data (pool.sessions, ss);
+		r_list_prepend (pool.sessions, ss);
+	}
+}
+
+static R2McpSession *session_find_locked(ut32 id) {
+	RListIter *iter;
+	R2McpSession *ss;
+	r_list_foreach (pool.sessions, iter, ss) {
+		if (ss->id == id) {
+			return ss;
+		}
+	}
+	return NULL;
+}
+
+static R2McpSession *session_find_path_locked(const char *path) {
+	RListIter *iter;
+	R2McpSession *ss;
+	r_list_foreach (pool.sessions, iter, ss) {
+		if (!strcmp (ss->path, path)) {
+			return ss;
+		}
+	}
+	return NULL;
+}
+
+// Drop the session from the pool, the core is freed once no job uses it
+static void session_close(R2McpSession *ss) {
+	pthread_mutex_lock (&pool.lock);
+	if (r_list_delete_data (pool.sessions, ss)) {
+		session_unref_locked (ss);
+	}
+	pthread_mutex_unlock (&pool.lock);
+}
+
+// Evict the least recently used idle sessions until there is room for one more
+static void session_evict_locked(void) {
+	RListIter *iter = pool.sessions->tail;
+	while (iter && r_list_length (pool.sessions) >= pool.max_sessions) {
+		R2McpSession *ss = iter->data;
+		RListIter *prev = iter->p;
+		if (ss->refs == 1) {
+			R_LOG_INFO ("Evicting session %u: %s", ss->id, ss->path);
+			r_list_delete (pool.sessions, iter);
+			session_unref_locked (ss);
+		}
+		iter = prev;
+	}
+}
+
+// Take a reference to the session with the given id, or to the last used
+// one when id is 0
+static R2McpSession *session_ref_locked(ut32 id) {
+	R2McpSession *ss = id ? session_find_locked (id) : r_list_first (pool.sessions);
+	if (ss) {
+		if (id) {
+			session_touch_locked (ss);
+		}
+		ss->refs++;
+	}
+	return ss;
+}
+
+// Resolve the session a tools/call works on and take a reference to it.
+// openFile and listSessions do not need one. Returns false when the
+// requested session does not exist.
+static bool session_acquire_locked(RJson *params, R2McpSession **out) {
+	const R2McpTool *tool = tool_find (r_json_get_str (params, "name"));
+	*out = NULL;
+	// the sessions of a coordinator live in its shards
+	if (!tool || !(tool->flags & R2MCP_TOOL_SESSION) || shards.count) {
+		return true;
+	}
+	const RJson *tool_args = r_json_get (params, "arguments");
+	const ut32 session_id = (ut32)r_json_get_num (tool_args, "session");
+	*out = session_ref_locked (session_id);
+	return *out || !session_id;
+}
+
+// Same as the workers do, wait for the session core to be free and claim it
+static bool session_acquire(RJson *params, R2McpSession **out) {
+	pthread_mutex_lock (&pool.lock);
+	bool res = session_acquire_locked (params, out);
+	R2McpSession *ss = *out;
+	if (ss) {
+		prefetch_yield_locked ();
+		while (ss->busy) {
+			pthread_cond_wait (&pool.cond, &pool.lock);
+		}
+		ss->busy = true;
+	}
+	pthread_mutex_unlock (&pool.lock);
+	return res;
+}
+
+// Reference and claim the session with the given id, NULL if there is none
+static R2McpSession *session_claim(ut32 id) {
+	pthread_mutex_lock (&pool.lock);
+	R2McpSession *ss = session_ref_locked (id);
+	if (ss) {
+		prefetch_yield_locked ();
+		while (ss->busy) {
+			pthread_cond_wait (&pool.cond, &pool.lock);
+		}
+		ss->busy = true;
+	}
+	pthread_mutex_unlock (&pool.lock);
+	return ss;
+}
+
+static void session_release(R2McpSession *ss) {
+	if (ss) {
+		pthread_mutex_lock (&pool.lock);
+		ss->busy = false;
+		session_unref_locked (ss);
+		pthread_cond_broadcast (&pool.cond);
+		pthread_mutex_unlock (&pool.lock);
+	}
+}
+
+static const char *r2_open_mode_name(R2McpOpenMode mode) {
+	switch (mode) {
+	case R2MCP_OPEN_MMAP: return "mmap";
+	case R2MCP_OPEN_BUFFERED: return "buffered";
+	default: return "auto";
+	}
+}
+
+// Returns -1 for unknown mode names
+static int r2_open_mode_from_name(const char *name) {
+	if (R_STR_ISEMPTY (name) || !strcmp (name, "auto")) {
+		return R2MCP_OPEN_AUTO;
+	}
+	if (!strcmp (name, "mmap")) {
+		return R2MCP_OPEN_MMAP;
+	}
+	if (!strcmp (name, "buffered")) {
+		return R2MCP_OPEN_BUFFERED;
+	}
+	return -1;
+}
+
+// Map the file read-only. Nothing is read up front, RSS follows the pages
+// actually used and all the sessions on the file share the page cache.
+static bool r2_open_core_mmap(RCore *core, const char *filepath) {
+	r_config_set_b (core->config, "bin.relocs.apply", true);
+	// bin.cache would copy the whole file to patch the relocations
+	r_config_set_b (core->config, "bin.cache", false);
+	char *uri = r_str_newf ("mmap://%s", filepath);
+	RIODesc *fd = r_core_file_open (core, uri, R_PERM_R, 0);
+	const bool ok = fd && r_core_bin_load (core, uri, 0);
+	free (uri);
+	if (!ok) {
+		R_LOG_ERROR ("Failed to map file: %s", filepath);
+		return false;
+	}
+	r_core_cmd0 (core, "ob");
+	return true;
+}
+
+// Open the file in the core, the mode is resolved and updated in place
+static bool r2_open_core(RCore *core, const char *filepath, R2McpOpenMode *mode) {
+	if (*mode == R2MCP_OPEN_AUTO) {
+		// only local files can be mapped, anything else goes through its own io plugin
+		const bool local = !strstr (filepath, "://") && r_file_is_regular (filepath);
+		if (local && r2_open_core_mmap (core, filepath)) {
+			*mode = R2MCP_OPEN_MMAP;
+			return true;
+		}
+		*mode = R2MCP_OPEN_BUFFERED;
+	} else if (*mode == R2MCP_OPEN_MMAP) {
+		return r2_open_core_mmap (core, filepath);
+	}
+	r_core_cmd0 (core, "e bin.relocs.apply=true");
+	r_core_cmd0 (core, "e bin.cache=true");
+
+	char *cmd = r_str_newf ("'o %s", filepath);
+	R_LOG_INFO ("Running r2 command: %s", cmd);
+	char *result = r_core_cmd_str (core, cmd);
+	free (cmd);
+	bool success = (result && strlen (result) > 0);
+	free (result);
+
+	if (!success) {
+		R_LOG_INFO ("Trying alternative method to open file");
+		RIODesc *fd = r_core_file_open (core, filepath, R_PERM_R, 0);
+		if (fd) {
+			r_core_bin_load (core, filepath, 0);
+			R_LOG_INFO ("File opened using r_core_file_open");
+		} else {
+			R_LOG_ERROR ("Failed to open file: %s", filepath);
+			return false;
+		}
+	}
+
+	R_LOG_INFO ("Loading binary information");
+	r_core_cmd0 (core, "ob");
+	return true;
+}
+
+// Bytes held by the analysis of a session, estimated from what its core
+// holds. The process RSS tells nothing about one session when several run
+// at once and does not go down when a core is freed, this does once the
+// core is replaced or reanalyzed. The buffered backend keeps the whole file
+// in memory, mmap only shares the page cache.
+#define R2MCP_MEM_FUNCTION 512
+#define R2MCP_MEM_BLOCK    192
+#define R2MCP_MEM_XREF     64
+#define R2MCP_MEM_FLAG     160
+
+static void session_measure(R2McpSession *ss) {
+	RCore *core = ss->core;
+	ut64 n = 0;
+	RListIter *iter;
+	RAnalFunction *fcn;
+	r_list_foreach (core->anal->fcns, iter, fcn) {
+		n += R2MCP_MEM_FUNCTION + (ut64)r_list_length (fcn->bbs) * R2MCP_MEM_BLOCK;
+	}
+	n += (ut64)r_anal_xrefs_count (core->anal) * R2MCP_MEM_XREF;
+	n += (ut64)r_flag_count (core->flags, NULL) * R2MCP_MEM_FLAG;
+	if (ss->open_mode == R2MCP_OPEN_BUFFERED) {
+		n += r_io_size (core->io);
+	}
+	ss->mem = n;
+}
+
+// Open the file in a new session, or return the session that already has
+// it loaded (and analyzed) so it does not need to be analyzed again.
+// Returns the session id, or 0 on failure. cached is set to the analysis
+// level restored from the cache, -1 if none.
+static ut32 r2_open_file(const char *filepath, R2McpOpenMode mode, bool *reused, int *cached) {
+	R_LOG_INFO ("Attempting to open file: %s\n", filepath);
+	*reused = false;
+	*cached = -1;
+
+	pthread_mutex_lock (&pool.lock);
+	R2McpSession *ss = session_find_path_locked (filepath);
+	if (ss) {
+		R_LOG_INFO ("Reusing session %u for %s", ss->id, filepath);
+		session_touch_locked (ss);
+		*reused = true;
+		*cached = ss->cache_level;
+		const ut32 id = ss->id;
+		pthread_mutex_unlock (&pool.lock);
+		return id;
+	}
+	RCore *core = pool.spare;
+	pool.spare = NULL;
+	pthread_mutex_unlock (&pool.lock);
+
+	// loading happens outside of the lock, other sessions keep working
+	if (!core) {
+		core = r2_core_new ();
+	}
+	if (!core) {
+		R_LOG_ERROR ("Failed to initialize r2 core\n");
+		return 0;
+	}
+	if (!r2_open_core (core, filepath, &mode)) {
+		r_core_free (core);
+		return 0;
+	}
+
+	ss = R_NEW0 (R2McpSession);
+	ss->core = core;
+	ss->path = strdup (filepath);
+	ss->open_mode = mode;
+	ss->refs = 1;
+	ss->cache_level = -1;
+	if (cache_dir) {
+		ss->hash = cache_file_key (filepath);
+		if (ss->hash) {
+			ss->cache_level = cache_load (core, ss->hash, filepath, &ss->cache_file);
+		}
+	}
+	ss->level = ss->cache_level;
+	*cached = ss->cache_level;
+	session_measure (ss);
+	ss->settings = R_NEWS0 (RConfigNode *, R2MCP_SETTINGS_COUNT);
+	ss->edits = r_list_newf (free);
+	r2_settings_bind (ss);
+	pthread_mutex_lock (&pool.lock);
+	session_evict_locked ();
+	const ut32 id = ss->id = pool.next_id;
+	pool.next_id += pool.id_step;
+	r_list_prepend (pool.sessions, ss);
+	pthread_mutex_unlock (&pool.lock);
+	R_LOG_INFO ("File opened successfully: %s (session %u)", filepath, id);
+
+	return id;
+}
+
+// Levels are the number of extra 'a' after aa, also the cache file names
+#define R2MCP_LEVEL_MAX 4
+#define R2MCP_LEVEL_ERROR "Invalid level, use 0 to 4"
+
+static bool r2_analysis_level_valid(int level) {
+	return level >= 0 && level <= R2MCP_LEVEL_MAX;
+}
+
+static const char *r2_analysis_cmd(int level) {
+	switch (level) {
+	case 1: return "aac";
+	case 2: return "aaa";
+	case 3: return "aaaa";
+	case 4: return "aaaaa";
+	}
+	return "aa";
+}
+
+static R_TH_LOCAL R2McpProgress *progress_current = NULL;
+// Client of the request being handled on this thread
+static R_TH_LOCAL R2McpClient *client_current = NULL;
+// Job run by this worker thread, NULL for inline requests
+static R_TH_LOCAL R2McpJob *job_current = NULL;
+// Set on the prefetcher thread, its calls are not accounted as requests
+static R_TH_LOCAL bool prefetch_self = false;
+
+static char *progress_message(R2McpProgress *p) {
+	PJ *pj = pj_new ();
+	pj_o (pj);
+	pj_ks (pj, "jsonrpc", "2.0");
+	pj_ks (pj, "method", "notifications/progress");
+	pj_k (pj, "params");
+	pj_o (pj);
+	pj_kid (pj, "progressToken", p->token);
+	pj_ki (pj, "progress", p->step);
+	char *msg = r_str_newf ("%s (%d functions)", p->pass ? p->pass : "analyzing", p->functions);
+	pj_ks (pj, "message", msg);
+	free (msg);
+	pj_end (pj);
+	pj_end (pj);
+	return pj_drain (pj);
+}
+
+static void progress_notify(R2McpProgress *p) {
+	char *s = progress_message (p);
+	send_notification (p->client, s);
+	free (s);
+}
+
+// Registered once with r_log_add_callback, radare2 logs a line for every
+// analysis pass (aa, aac, aar, aaft...) from the thread running it
+static bool progress_log_cb(void *user, int type, const char *origin, const char *msg) {
+	(void)user;
+	(void)type;
+	(void)origin;
+	R2McpProgress *p = progress_current;
+	if (!p || R_STR_ISEMPTY (msg)) {
+		return false;
+	}
+	char *pass = r_str_trim_dup (msg);
+	pthread_mutex_lock (&pool.lock);
+	free (p->pass);
+	p->pass = pass;
+	p->functions = r_list_length (p->core->anal->fcns);
+	p->step++;
+	pthread_mutex_unlock (&pool.lock);
+	if (p->token) {
+		progress_notify (p);
+	}
+	return false;
+}
+
+static bool r2_analyze(R2McpSession *ss, int level, const char *token) {
+	R2McpProgress progress = { .core = ss->core, .client = client_current, .token = (char *)token };
+	ss->generation++;
+	decomp_clear (ss);
+	dirty_clear (ss);
+	progress_current = &progress;
+	r_core_cmd0 (ss->core, r2_analysis_cmd (level));
+	progress_current = NULL;
+	session_measure (ss);
+	free (progress.pass);
+	return true;
+}
+
+// Run a command changing the session core (names, comments, types, config).
+// It is also recorded, to be replayed on the core of a background analysis
+// when it replaces the current one. Persistent edits are written to the
+// cached analysis too, config changes never are.
+static void r2_mutate(R2McpSession *ss, const char *cmd, bool persist) {
+	r_core_cmd0 (ss->core, cmd);
+	ss->generation++;
+	if (persist) {
+		cache_append (ss->cache_file, cmd);
+	}
+	// only the thread holding the core adds to the list
+	r_list_append (ss->edits, strdup (cmd));
+}
+
+static void *analysis_thread(void *user) {
+	R2McpAnalysis *an = user;
+	R2McpSession *ss = an->ss;
+	pthread_mutex_lock (&pool.lock);
+	RCore *core = an->core;
+	an->core = NULL;
+	char *script = ss->cache_file ? strdup (ss->cache_file) : NULL;
+	pthread_mutex_unlock (&pool.lock);
+	R2McpOpenMode mode = ss->open_mode;
+	bool ok = core && r2_open_core (core, ss->path, &mode);
+	if (ok) {
+		// the new analysis builds on the cached one and the edits saved
+		// with it, like the session core did when it was opened
+		if (script) {
+			r_core_cmd_file (core, script);
+		}
+		pthread_mutex_lock (&pool.lock);
+		an->progress.core = core;
+		pthread_mutex_unlock (&pool.lock);
+		if (!an->cancel) {
+			progress_current = &an->progress;
+			r_core_cmd0 (core, r2_analysis_cmd (an->level));
+			progress_current = NULL;
+		}
+	}
+	free (script);
+	char *cache_file = NULL;
+
+	pthread_mutex_lock (&pool.lock);
+	an->progress.core = NULL;
+	R2McpAnalysisState state = R2MCP_ANALYSIS_DONE;
+	if (!ok) {
+		state = R2MCP_ANALYSIS_FAILED;
+	} else if (an->cancel) {
+		state = R2MCP_ANALYSIS_CANCELLED;
+	} else {
+		// take the session core like a job does, then swap it
+		prefetch_yield_locked ();
+		while (ss->busy) {
+			pthread_cond_wait (&pool.cond, &pool.lock);
+		}
+		ss->busy = true;
+		RCore *old = ss->core;
+		ss->core = core;
+		ss->generation++;
+		ss->level = an->level;
+		decomp_clear (ss);
+		dirty_clear (ss);
+		core = old;
+		// every edit of the session, also the ones made while analyzing.
+		// Nothing else adds to them while the core is claimed, so they are
+		// replayed, and the cache saved with them, without holding the lock
+		pthread_mutex_unlock (&pool.lock);
+		RListIter *iter;
+		const char *cmd;
+		r_list_foreach (ss->edits, iter, cmd) {
+			r_core_cmd0 (ss->core, cmd);
+		}
+		r2_settings_bind (ss);
+		cache_file = cache_save (ss->core, ss->hash, ss->path, an->level);
+		session_measure (ss);
+		pthread_mutex_lock (&pool.lock);
+		ss->busy = false;
+		if (cache_file) {
+			free (ss->cache_file);
+			ss->cache_file = cache_file;
+			ss->cache_level = an->level;
+			cache_file = NULL;
+		}
+		an->progress.functions = r_list_length (ss->core->anal->fcns);
+		prefetch_request_locked (ss);
+	}
+	// the last notification is built before the state is published, a new
+	// analysis may free this one right after
+	char *msg = NULL;
+	R2McpClient *client = NULL;
+	if (an->progress.token) {
+		an->progress.step++;
+		free (an->progress.pass);
+		an->progress.pass = strdup (state == R2MCP_ANALYSIS_DONE ? "analysis finished" : "analysis stopped");
+		msg = progress_message (&an->progress);
+		client = client_ref (an->progress.client);
+	}
+	an->state = state;
+	an->finished = r_time_now_mono ();
+	pthread_cond_broadcast (&pool.cond);
+	pthread_mutex_unlock (&pool.lock);
+	free (cache_file);
+	// either the previous session core or the discarded analysis one
+	r_core_free (core);
+	if (msg) {
+		send_notification (client, msg);
+		free (msg);
+	}
+	client_unref (client);
+	pthread_mutex_lock (&pool.lock);
+	pool.analyses--;
+	session_unref_locked (ss);
+	pthread_cond_broadcast (&pool.cond);
+	pthread_mutex_unlock (&pool.lock);
+	return NULL;
+}
+
+// Returns NULL once the analysis thread runs, the reason otherwise. The
+// core is created first to learn whether it has an RCons of its own, on a
+// shared one the analysis would break and mix with the session commands
+static const char *r2_analyze_background(R2McpSession *ss, int level, const char *token) {
+	RCore *core = r2_cons_shared () ? NULL : r2_core_new ();
+	if (!r2_cons_own ()) {
+		r_core_free (core);
+		return "Background analysis needs a radare2 giving every core its own RCons, analyze without background instead";
+	}
+	pthread_mutex_lock (&pool.lock);
+	if (ss->analysis && ss->analysis->state == R2MCP_ANALYSIS_RUNNING) {
+		pthread_mutex_unlock (&pool.lock);
+		r_core_free (core);
+		return "An analysis is already running in the background, use analysisStatus";
+	}
+	analysis_free (ss->analysis);
+	R2McpAnalysis *an = R_NEW0 (R2McpAnalysis);
+	an->ss = ss;
+	an->level = level;
+	an->state = R2MCP_ANALYSIS_RUNNING;
+	an->started = r_time_now_mono ();
+	an->core = core;
+	an->progress.token = token ? strdup (token) : NULL;
+	an->progress.client = client_ref (client_current);
+	ss->analysis = an;
+	ss->refs++;
+	pool.analyses++;
+	pthread_t th;
+	const bool started = !pthread_create (&th, NULL, analysis_thread, an);
+	if (started) {
+		pthread_detach (th);
+	} else {
+		an->state = R2MCP_ANALYSIS_FAILED;
+		an->finished = r_time_now_mono ();
+		ss->refs--;
+		pool.analyses--;
+	}
+	pthread_mutex_unlock (&pool.lock);
+	return started ? NULL : "Cannot start the background analysis";
+}
+
+static const char *r2_analysis_state_name(R2McpAnalysisState state) {
+	switch (state) {
+	case R2MCP_ANALYSIS_RUNNING: return "running";
+	case R2MCP_ANALYSIS_DONE: return "done";
+	case R2MCP_ANALYSIS_FAILED: return "failed";
+	case R2MCP_ANALYSIS_CANCELLED: return "cancelled";
+	}
+	return "unknown";
+}
+
+// Report the background analysis of the session, optionally waiting up to
+// timeout seconds for it to finish. The session core is released while
+// waiting so the finished analysis can be swapped in.
+static char *r2_analysis_status(R2McpSession *ss, bool wait, int timeout, bool cancel) {
+	pthread_mutex_lock (&pool.lock);
+	R2McpAnalysis *an = ss->analysis;
+	if (!an) {
+		pthread_mutex_unlock (&pool.lock);
+		return strdup ("No background analysis was started for this session");
+	}
+	if (cancel && an->state == R2MCP_ANALYSIS_RUNNING) {
+		an->cancel = true;
+		if (an->progress.core) {
+			r_cons_context_break (an->progress.core->cons->context);
+		}
+	}
+	if (wait && an->state == R2MCP_ANALYSIS_RUNNING) {
+		struct timespec ts;
+		clock_gettime (CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout;
+		const bool claimed = ss->busy;
+		ss->busy = false;
+		pthread_cond_broadcast (&pool.cond);
+		while (an->state == R2MCP_ANALYSIS_RUNNING) {
+			if (pthread_cond_timedwait (&pool.cond, &pool.lock, &ts) == ETIMEDOUT) {
+				break;
+			}
+		}
+		while (claimed && ss->busy) {
+			pthread_cond_wait (&pool.cond, &pool.lock);
+		}
+		ss->busy = claimed;
+	}
+	const ut64 end = an->state == R2MCP_ANALYSIS_RUNNING ? r_time_now_mono () : an->finished;
+	char *res = r_str_newf ("state: %s\nlevel: %d\npass: %s\nfunctions: %d\nelapsed: %.1fs",
+		r2_analysis_state_name (an->state), an->level,
+		an->progress.pass ? an->progress.pass : "-", an->progress.functions,
+		(end - an->started) / 1000000.0);
+	pthread_mutex_unlock (&pool.lock);
+	return res;
+}
+
+static void signal_handler(int signum) {
+	const char msg[] = "\nInterrupt received, shutting down...\n";
+	write (STDERR_FILENO, msg, sizeof (msg) - 1);
+
+	running = 0;
+
+	signal (signum, SIG_DFL);
+}
+
+static bool check_client_capability(const char *capability) {
+	if (!server_state.client_capabilities) {
+		return false;
+	}
+	RJson *cap = (RJson *)r_json_get (server_state.client_capabilities, capability);
+	return cap != NULL;
+}
+
+static bool check_server_capability(const char *capability) {
+	if (!strcmp (capability, "logging")) {
+		return server_state.capabilities.logging;
+	}
+	if (!strcmp (capability, "tools")) {
+		return server_state.capabilities.tools;
+	}
+	return false;
+}
+
+static bool assert_capability_for_method(const char *method, char **error) {
+	if (!strcmp (method, "sampling/createMessage")) {
+		if (!check_client_capability ("sampling")) {
+			*error = strdup ("Client does not support sampling");
+			return false;
+		}
+	} else if (!strcmp (method, "roots/list")) {
+		if (!check_client_capability ("roots")) {
+			*error = strdup ("Client does not support listing roots");
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool assert_request_handler_capability(const char *method, char **error) {
+	if (!strcmp (method, "sampling/createMessage")) {
+		if (!check_server_capability ("sampling")) {
+			*error = strdup ("Server does not support sampling");
 			return false;
 		}
 	} else if (!strcmp (method, "logging/setLevel")) {
@@ -366,14 +1912,63 @@ static bool assert_request_handler_capability(const char *method, char **error)
 	return true;
 }
 
+// Emit a request id or progress token kept as a string by json_id_tostring
+static void pj_kid(PJ *pj, const char *key, const char *id) {
+	if (id) {
+		// If id is a number string, treat it as a number
+		char *endptr;
+		long num_id = strtol (id, &endptr, 10);
+		if (*id != '\0' && *endptr == '\0') {
+			// It's a valid number
+			pj_kn (pj, key, num_id);
+		} else {
+			// It's a string
+			pj_ks (pj, key, id);
+		}
+	}
+}
+
+// The {"jsonrpc":"2.0","id":ID,"result": start of a success response, in
+// the request arena. Left open after the key, the result and the closing
+// brace follow. Ids are written like pj_kid does
+static char *response_prefix(const char *id) {
+	if (!id) {
+		return arena_strdup ("{\"jsonrpc\":\"2.0\",\"result\":");
+	}
+	char *end;
+	const long num = strtol (id, &end, 10);
+	if (*id && !*end) {
+		return arena_newf ("{\"jsonrpc\":\"2.0\",\"id\":%ld,\"result\":", num);
+	}
+	char *o = arena_alloc (json_escape (NULL, id) + 40);
+	if (o) {
+		char *p = o + sprintf (o, "{\"jsonrpc\":\"2.0\",\"id\":\"");
+		p += json_escape (p, id);
+		strcpy (p, "\",\"result\":");
+	}
+	return o;
+}
+
+// Request ids are kept as strings, numbers are printed in decimal
+static const char *json_id_tostring(const RJson *id_json, char *buf, size_t len) {
+	if (id_json) {
+		if (id_json->type == R_JSON_STRING) {
+			return id_json->str_value;
+		}
+		if (id_json->type == R_JSON_INTEGER) {
+			snprintf (buf, len, "%lld", (long long)id_json->num.u_value);
+			return buf;
+		}
+	}
+	return NULL;
+}
+
 // Helper function to create JSON-RPC error responses
 static char *create_error_response(int code, const char *message, const char *id, const char *uri) {
 	PJ *pj = pj_new ();
 	pj_o (pj);
 	pj_ks (pj, "jsonrpc", "2.0");
-	if (id) {
-		pj_ks (pj, "id", id);
-	}
+	pj_kid (pj, "id", id);
 	pj_k (pj, "error");
 	pj_o (pj);
 	pj_ki (pj, "code", code);
@@ -389,69 +1984,64 @@ static char *create_error_response(int code, const char *message, const char *id
 	return pj_drain (pj);
 }
 
-// Modified read_buffer functions to handle partial reads better
+// Return the next complete JSON-RPC message as a NUL-terminated view into
+// the buffer, or NULL if more data is needed. The view stays valid until the
+// next call to read_buffer_get_message or read_buffer_reserve, and it can be
+// modified in place (r_json_parse does that). Scan state is kept between
+// calls, so braces inside string values do not break the framing and bytes
+// are never classified twice.
 static char *read_buffer_get_message(ReadBuffer *buf) {
-	// Search for a complete JSON-RPC message
-	// We need to find a properly balanced set of braces {}
-	if (buf->size == 0) {
-		return NULL;
+	if (buf->term_set) {
+		buf->data[buf->term_pos] = buf->term_chr;
+		buf->term_set = false;
 	}
-
-	// Ensure the buffer is null-terminated for string operations
-	if (buf->size < buf->capacity) {
-		buf->data[buf->size] = '\0';
-	} else {
-		// Expand capacity if needed
-		buf->capacity += 1;
-		buf->data = realloc (buf->data, buf->capacity);
-		buf->data[buf->size] = '\0';
+	if (buf->rpos == buf->size) {
+		// everything consumed, rewind for free
+		buf->rpos = buf->scan = buf->size = 0;
+		return NULL;
 	}
-
-	// Look for a complete JSON message by counting braces
-	int brace_count = 0;
-	int start_pos = -1;
-	size_t i;
-
-	for (i = 0; i < buf->size; i++) {
-		char c = buf->data[i];
-
-		// Find the first opening brace if we haven't already
-		if (start_pos == -1 && c == '{') {
-			start_pos = i;
-			brace_count = 1;
+	char *data = buf->data;
+	const size_t size = buf->size;
+	size_t i = buf->scan;
+	for (; i < size; i++) {
+		const char c = data[i];
+		if (buf->depth == 0) {
+			// skip whitespace and garbage between messages
+			if (c == '{') {
+				buf->start = i;
+				buf->rpos = i;
+				buf->depth = 1;
+			} else {
+				buf->rpos = i + 1;
+			}
 			continue;
 		}
-
-		// Count braces within a JSON object
-		if (start_pos != -1) {
-			if (c == '{') {
-				brace_count++;
-			} else if (c == '}') {
-				brace_count--;
-
-				// If we've found a complete JSON object
-				if (brace_count == 0) {
-					// We have a complete message from start_pos to i (inclusive)
-					size_t msg_len = i - start_pos + 1;
-					char *msg = malloc (msg_len + 1);
-					memcpy (msg, buf->data + start_pos, msg_len);
-					msg[msg_len] = '\0';
-
-					// Move any remaining data to the beginning of the buffer
-					size_t remaining = buf->size - (i + 1);
-					if (remaining > 0) {
-						memmove (buf->data, buf->data + i + 1, remaining);
-					}
-					buf->size = remaining;
-
-					r2mcp_log ("Extracted complete JSON message");
-					return msg;
-				}
+		if (buf->in_string) {
+			if (buf->escape) {
+				buf->escape = false;
+			} else if (c == '\\') {
+				buf->escape = true;
+			} else if (c == '"') {
+				buf->in_string = false;
 			}
+			continue;
+		}
+		if (c == '"') {
+			buf->in_string = true;
+		} else if (c == '{') {
+			buf->depth++;
+		} else if (c == '}' && --buf->depth == 0) {
+			char *msg = data + buf->start;
+			const size_t end = i + 1;
+			buf->term_pos = end;
+			buf->term_chr = data[end];
+			buf->term_set = true;
+			data[end] = '\0';
+			buf->scan = buf->rpos = end;
+			return msg;
 		}
 	}
-
-	// If we get here, we don't have a complete message yet
+	buf->scan = i;
 	return NULL;
 }
 
@@ -469,61 +2059,779 @@ static void set_nonblocking_io(bool nonblocking) {
 	setvbuf (stdout, NULL, _IOLBF, 0);
 }
 
-// MCPO protocol-compliant direct mode loop
-static void direct_mode_loop(void) {
-	r2mcp_log ("Starting MCP direct mode (stdin/stdout)");
+// Where the messages answering a request go. The stdio client writes them
+// to stdout, HTTP clients queue them as server-sent events for the event
+// loop to write to their connection.
+typedef enum {
+	R2MCP_CLIENT_STDIO,
+	R2MCP_CLIENT_HTTP,   // connection whose request is still being read
+	R2MCP_CLIENT_POST,   // streamable HTTP POST, closed after its response
+	R2MCP_CLIENT_STREAM, // GET /sse stream, answers the POSTs to /messages
+} R2McpClientKind;
+
+struct r2mcp_client_t {
+	R2McpClientKind kind;
+	int fd;      // -1 once closed, messages for it are dropped
+	int refs;    // the client list and every job or analysis reporting to it
+	char *owner; // MCP session id, request ids are only unique within one
+	ReadBuffer *in;
+	RStrBuf *out; // bytes not written yet, from out_off on
+	size_t out_off;
+	int pending;    // requests of a POST still to be answered
+	bool head_sent; // the HTTP response headers are in out
+	bool done;      // the request was read, further input is ignored
+	bool closing;   // close once out is written
+	bool want_write;
+};
 
-	// Use consistent unbuffered mode for stdout
-	setvbuf (stdout, NULL, _IONBF, 0);
+// State of the HTTP transport. The lock protects the client list and the
+// refs and output fields of every client, which the workers write to.
+typedef struct {
+	int fd;      // listening socket
+	int poll;    // epoll or kqueue descriptor
+	int wake[2]; // pipe written when a client has new output
+	RList *clients;
+	ut32 next_owner;
+	pthread_mutex_t lock;
+} R2McpHttp;
+
+static R2McpHttp http = {
+	.fd = -1,
+	.poll = -1,
+	.wake = { -1, -1 },
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static R2McpClient stdio_client = {
+	.kind = R2MCP_CLIENT_STDIO,
+	.fd = STDOUT_FILENO,
+	.refs = 1
+};
+
+static R2McpClient *client_ref(R2McpClient *c) {
+	if (c) {
+		pthread_mutex_lock (&http.lock);
+		c->refs++;
+		pthread_mutex_unlock (&http.lock);
+	}
+	return c;
+}
+
+static void client_unref_locked(R2McpClient *c) {
+	if (c && --c->refs == 0) {
+		free (c->owner);
+		read_buffer_free (c->in);
+		r_strbuf_free (c->out);
+		free (c);
+	}
+}
+
+static void client_unref(R2McpClient *c) {
+	pthread_mutex_lock (&http.lock);
+	client_unref_locked (c);
+	pthread_mutex_unlock (&http.lock);
+}
+
+// MCPO protocol-compliant direct mode loop
+static void direct_mode_loop(void) {
+	r2mcp_log (R2MCP_LOGLVL_INFO, "Starting MCP direct mode (stdin/stdout)");
+
+	// Use consistent unbuffered mode for stdout
+	setvbuf (stdout, NULL, _IONBF, 0);
 
 	// Set to blocking I/O for simplicity
 	set_nonblocking_io (false);
 
 	ReadBuffer *buffer = read_buffer_new ();
-	char chunk[READ_CHUNK_SIZE];
 
 	while (running) {
-		// Read data from stdin
-		ssize_t bytes_read = read (STDIN_FILENO, chunk, sizeof (chunk) - 1);
+		// Read data from stdin straight into the framing buffer
+		if (!read_buffer_reserve (buffer, READ_CHUNK_SIZE)) {
+			break;
+		}
+		ssize_t bytes_read = read (STDIN_FILENO, buffer->data + buffer->size, READ_CHUNK_SIZE);
 
 		if (bytes_read > 0) {
-			// Append to our buffer
-			read_buffer_append (buffer, chunk, bytes_read);
+			buffer->size += bytes_read;
 
 			// Try to process any complete messages
 			char *msg;
 			while ((msg = read_buffer_get_message (buffer)) != NULL) {
-				r2mcp_log ("Complete message received:");
-				r2mcp_log (msg);
-				process_mcp_message (msg);
-				free (msg);
+				process_mcp_message (&stdio_client, msg);
 			}
 		} else if (bytes_read == 0) {
 			// EOF - stdin closed
-			r2mcp_log ("End of input stream - exiting");
+			r2mcp_log (R2MCP_LOGLVL_INFO, "End of input stream - exiting");
 			break;
 		} else {
 			// Error
 			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
-				r2mcp_log ("Read error");
+				r2mcp_log (R2MCP_LOGLVL_ERROR, "Read error");
 				break;
 			}
 		}
 	}
 
 	read_buffer_free (buffer);
-	r2mcp_log ("Direct mode loop terminated");
+	r2mcp_log (R2MCP_LOGLVL_INFO, "Direct mode loop terminated");
+}
+
+// Write all the pieces with as few syscalls as possible, going on after
+// short writes and waiting for the pipe to drain when it is non-blocking
+static bool write_iov(int fd, struct iovec *iov, int cnt) {
+	while (cnt > 0) {
+		ssize_t n = writev (fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+				poll (&pfd, 1, -1);
+				continue;
+			}
+			return false;
+		}
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
+// Append a message as the data of one event, every line of it needs its
+// own data field. The newline ending the message is left out.
+static void sse_append(RStrBuf *sb, const struct iovec *iov, int cnt) {
+	int i, last = cnt - 1;
+	while (last > 0 && !iov[last].iov_len) {
+		last--;
+	}
+	r_strbuf_append (sb, "event: message\ndata: ");
+	for (i = 0; i <= last; i++) {
+		const char *s = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+		if (i == last && len > 0 && s[len - 1] == '\n') {
+			len--;
+		}
+		const char *nl;
+		while ((nl = memchr (s, '\n', len))) {
+			r_strbuf_append_n (sb, s, nl - s);
+			r_strbuf_append (sb, "\ndata: ");
+			len -= nl - s + 1;
+			s = nl + 1;
+		}
+		r_strbuf_append_n (sb, s, len);
+	}
+	r_strbuf_append (sb, "\n\n");
+}
+
+static void http_stream_head_locked(R2McpClient *c) {
+	r_strbuf_append (c->out, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+		"Cache-Control: no-cache\r\nConnection: close\r\n");
+	if (c->kind == R2MCP_CLIENT_POST) {
+		r_strbuf_appendf (c->out, "Mcp-Session-Id: %s\r\n", c->owner);
+	}
+	r_strbuf_append (c->out, "\r\n");
+	c->head_sent = true;
+}
+
+static void http_wake_locked(void) {
+	const char b = 1;
+	if (http.wake[1] != -1 && write (http.wake[1], &b, 1) < 0) {
+		// a full pipe wakes the loop anyway
+	}
+}
+
+// Write a message for the client. A response ends the POST it answers,
+// notifications do not.
+static void client_send(R2McpClient *c, struct iovec *iov, int cnt, bool response) {
+	if (!c || c->kind == R2MCP_CLIENT_STDIO) {
+		pthread_mutex_lock (&stdout_lock);
+		write_iov (STDOUT_FILENO, iov, cnt);
+		pthread_mutex_unlock (&stdout_lock);
+		return;
+	}
+	pthread_mutex_lock (&http.lock);
+	if (c->fd != -1 && !c->closing) {
+		if (!c->head_sent) {
+			http_stream_head_locked (c);
+		}
+		sse_append (c->out, iov, cnt);
+		if (response && c->kind == R2MCP_CLIENT_POST && --c->pending <= 0) {
+			c->closing = true;
+		}
+		http_wake_locked ();
+	}
+	pthread_mutex_unlock (&http.lock);
+}
+
+static void message_send(R2McpClient *c, const char *msg, bool response) {
+	// Ensure the message ends with a newline
+	size_t len = strlen (msg);
+	r2mcp_log_payload (R2MCP_LOGLVL_DEBUG, ">>> ", msg, len);
+	bool has_newline = (len > 0 && msg[len - 1] == '\n');
+	struct iovec iov[2] = {
+		{ (void *)msg, len },
+		{ "\n", has_newline ? 0 : 1 },
+	};
+	const ut64 start = r_time_now_mono ();
+	client_send (c, iov, 2, response);
+	stats_phase (R2MCP_PHASE_SEND, start);
+	stats_add (&stats.bytes_out, len + iov[1].iov_len);
+}
+
+// Write a response or notification to stdout. Messages may come from
+// several threads and in any order, the lock keeps them from interleaving.
+static void send_message(R2McpClient *c, const char *response) {
+	message_send (c, response, true);
+}
+
+static void send_notification(R2McpClient *c, const char *msg) {
+	message_send (c, msg, false);
+}
+
+// Send a success response, writing the envelope around the result
+// instead of copying the result into it
+static void send_result(R2McpClient *c, const char *result, const char *id) {
+	char *prefix = response_prefix (id);
+	if (!result) {
+		result = "null";
+	}
+	const size_t rlen = strlen (result);
+	r2mcp_log_payload (R2MCP_LOGLVL_DEBUG, ">>> ", result, rlen);
+	struct iovec iov[3] = {
+		{ prefix, strlen (prefix) },
+		{ (void *)result, rlen },
+		{ "}\n", 2 },
+	};
+	const size_t len = iov[0].iov_len + rlen + 2;
+	const ut64 start = r_time_now_mono ();
+	client_send (c, iov, 3, true);
+	stats_phase (R2MCP_PHASE_SEND, start);
+	stats_add (&stats.bytes_out, len);
+}
+
+static void job_free(R2McpJob *job) {
+	r_json_free (job->request);
+	client_unref (job->client);
+	free (job->msg);
+	free (job->id);
+	free (job);
+}
+
+#define R2MCP_ERR_CANCELLED -32800
+
+static void job_respond(R2McpJob *job, char *result, bool cancelled) {
+	if (cancelled) {
+		char *response = create_error_response (R2MCP_ERR_CANCELLED, "Request cancelled", job->id, NULL);
+		send_message (job->client, response);
+		free (response);
+	} else {
+		send_result (job->client, result, job->id);
+	}
+	free (result);
+}
+
+// Request ids only identify a job together with the MCP session sending it
+static bool job_match(R2McpJob *job, const char *owner, const char *id) {
+	const char *o = job->client ? job->client->owner : NULL;
+	return job->id && !strcmp (job->id, id) && (o == owner || (o && owner && !strcmp (o, owner)));
+}
+
+// Cancel a tools/call request. Queued jobs are dropped right away, running
+// ones get their core interrupted through the radare2 break mechanism so
+// the command returns early, and answer with a cancelled error.
+static void job_cancel(const char *owner, const char *id) {
+	RListIter *iter;
+	R2McpJob *job, *dropped = NULL;
+	pthread_mutex_lock (&pool.lock);
+	r_list_foreach (pool.jobs, iter, job) {
+		if (job_match (job, owner, id)) {
+			r_list_delete (pool.jobs, iter);
+			session_unref_locked (job->ss);
+			dropped = job;
+			break;
+		}
+	}
+	if (!dropped) {
+		r_list_foreach (pool.active, iter, job) {
+			if (job_match (job, owner, id)) {
+				job->cancelled = true;
+				if (job->ss) {
+					// one waiting at the gate is skipped, a shared RCons
+					// would break the call running meanwhile
+					if (job->running) {
+						r_cons_context_break (job->ss->core->cons->context);
+					}
+				} else if (shards.count) {
+					shard_cancel (job);
+				}
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock (&pool.lock);
+	if (dropped) {
+		job_respond (dropped, NULL, true);
+		job_free (dropped);
+	}
+}
+
+// Jobs are taken in arrival order, skipping the ones whose session is busy.
+// None while the prefetcher finishes a call on a shared RCons
+static R2McpJob *job_next_locked(void) {
+	RListIter *iter;
+	R2McpJob *job;
+	if (pool.prefetching && !r2_cons_own ()) {
+		return NULL;
+	}
+	r_list_foreach (pool.jobs, iter, job) {
+		if (!job->ss || !job->ss->busy) {
+			r_list_delete (pool.jobs, iter);
+			return job;
+		}
+	}
+	return NULL;
+}
+
+static void *worker_thread(void *user) {
+	(void)user;
+	pthread_mutex_lock (&pool.lock);
+	for (;;) {
+		R2McpJob *job;
+		while (!(job = job_next_locked ()) && (pool.running || r_list_length (pool.jobs) > 0)) {
+			pthread_cond_wait (&pool.cond, &pool.lock);
+		}
+		if (!job) {
+			break;
+		}
+		if (job->ss) {
+			job->ss->busy = true;
+		}
+		r_list_append (pool.active, job);
+		pthread_mutex_unlock (&pool.lock);
+		RJson *params = (RJson *)r_json_get (job->request, "params");
+		client_current = job->client;
+		job_current = job;
+		const bool gate = r2_cons_gate_enter ();
+		pthread_mutex_lock (&pool.lock);
+		job->running = !job->cancelled;
+		pthread_mutex_unlock (&pool.lock);
+		char *result = job->running ? handle_call_tool (params, job->ss) : NULL;
+		r2_cons_gate_leave (gate);
+		job_current = NULL;
+		client_current = NULL;
+		pthread_mutex_lock (&pool.lock);
+		job->running = false;
+		r_list_delete_data (pool.active, job);
+		const bool cancelled = job->cancelled;
+		if (job->ss) {
+			if (cancelled) {
+				// clear the break so the next command on this core runs normally
+				job->ss->core->cons->context->breaked = false;
+			}
+			job->ss->busy = false;
+			session_unref_locked (job->ss);
+			job->ss = NULL;
+			// jobs queued behind this session can run now
+			pthread_cond_broadcast (&pool.cond);
+		}
+		pthread_mutex_unlock (&pool.lock);
+		job_respond (job, result, cancelled);
+		job_free (job);
+		arena_reset ();
+		pthread_mutex_lock (&pool.lock);
+	}
+	pthread_mutex_unlock (&pool.lock);
+	arena_fini ();
+	return NULL;
+}
+
+// Idle-time prefetching. After openFile and analyze clients nearly always
+// ask for the headers, imports, entrypoints and functions, then decompile
+// main and the entrypoints, so those results are computed while nothing
+// else runs and left in the session memo. Any request interrupts the call
+// being prefetched, which is retried once the server is idle again.
+#define R2MCP_PREFETCH_FUNCTIONS 8
+
+typedef struct {
+	ut32 session;
+	ut64 generation; // of the session when requested, stale once it changes
+	RList *calls;    // tools/call params as JSON, NULL until planned
+} R2McpPrefetch;
+
+static void prefetch_free(R2McpPrefetch *pf) {
+	if (pf) {
+		r_list_free (pf->calls);
+		free (pf);
+	}
+}
+
+static R2McpPrefetch *prefetch_find_locked(ut32 session) {
+	RListIter *iter;
+	R2McpPrefetch *pf;
+	r_list_foreach (pool.prefetch, iter, pf) {
+		if (pf->session == session) {
+			return pf;
+		}
+	}
+	return NULL;
+}
+
+// Plan the prefetch of a session, replacing the one it had
+static void prefetch_request_locked(R2McpSession *ss) {
+	if (!pool.prefetch) {
+		return;
+	}
+	R2McpPrefetch *pf = prefetch_find_locked (ss->id);
+	if (pf) {
+		r_list_delete_data (pool.prefetch, pf);
+		prefetch_free (pf);
+	}
+	pf = R_NEW0 (R2McpPrefetch);
+	pf->session = ss->id;
+	pf->generation = ss->generation;
+	r_list_append (pool.prefetch, pf);
+	pthread_cond_broadcast (&pool.cond);
+}
+
+static void prefetch_request(ut32 id) {
+	pthread_mutex_lock (&pool.lock);
+	R2McpSession *ss = session_find_locked (id);
+	if (ss) {
+		prefetch_request_locked (ss);
+	}
+	pthread_mutex_unlock (&pool.lock);
+}
+
+// Interrupt the command being prefetched, a request wants the server. No
+// other command runs while it does on a shared RCons, so the break only
+// reaches the prefetcher, which clears it before waking anyone
+static void prefetch_interrupt_locked(void) {
+	if (pool.prefetching) {
+		pool.prefetch_yield = true;
+		r_cons_context_break (pool.prefetching->core->cons->context);
+	}
+}
+
+// Same, and with a shared RCons wait for the interrupted call to end
+// before running anything on another core
+static void prefetch_yield_locked(void) {
+	prefetch_interrupt_locked ();
+	if (pool.prefetching && !r2_cons_own ()) {
+		pool.prefetch_waiters++;
+		while (pool.prefetching) {
+			pthread_cond_wait (&pool.cond, &pool.lock);
+		}
+		pool.prefetch_waiters--;
+	}
+}
+
+static void prefetch_add(RList *calls, const char *tool, const char *address) {
+	char *call = address
+		? r_str_newf ("{\"name\":\"%s\",\"arguments\":{\"address\":\"%s\"}}", tool, address)
+		: r_str_newf ("{\"name\":\"%s\",\"arguments\":{}}", tool);
+	r_list_append (calls, call);
+}
+
+typedef struct {
+	ut64 addr;
+	size_t xrefs;
+} R2McpPrefetchFunction;
+
+static int prefetch_function_cmp(const void *a, const void *b) {
+	const R2McpPrefetchFunction *fa = a;
+	const R2McpPrefetchFunction *fb = b;
+	return (fa->xrefs < fb->xrefs) - (fa->xrefs > fb->xrefs);
+}
+
+// The metadata tools come first, then main and entry0 disassembled and
+// decompiled, then the most referenced functions by the address that
+// listFunctions shows. Runs with the session core claimed.
+static RList *prefetch_plan(R2McpSession *ss) {
+	static const char *entries[] = { "main", "entry0" };
+	RList *calls = r_list_newf (free);
+	prefetch_add (calls, "showHeaders", NULL);
+	prefetch_add (calls, "listImports", NULL);
+	prefetch_add (calls, "listEntrypoints", NULL);
+	prefetch_add (calls, "listFunctions", NULL);
+	RAnal *anal = ss->core->anal;
+	ut64 skip[2] = { UT64_MAX, UT64_MAX };
+	size_t i;
+	for (i = 0; i < 2; i++) {
+		RAnalFunction *fcn = r_anal_get_function_byname (anal, entries[i]);
+		if (fcn) {
+			skip[i] = fcn->addr;
+			prefetch_add (calls, "disassembleFunction", entries[i]);
+			prefetch_add (calls, "decompileFunction", entries[i]);
+		}
+	}
+	const size_t count = r_list_length (anal->fcns);
+	if (count == 0) {
+		return calls;
+	}
+	R2McpPrefetchFunction *fcns = R_NEWS0 (R2McpPrefetchFunction, count);
+	RListIter *iter;
+	RAnalFunction *fcn;
+	size_t n = 0;
+	r_list_foreach (anal->fcns, iter, fcn) {
+		if (fcn->addr == skip[0] || fcn->addr == skip[1]) {
+			continue;
+		}
+		RVecAnalRef *xrefs = r_anal_xrefs_get (anal, fcn->addr);
+		fcns[n].addr = fcn->addr;
+		fcns[n].xrefs = xrefs ? RVecAnalRef_length (xrefs) : 0;
+		RVecAnalRef_free (xrefs);
+		n++;
+	}
+	qsort (fcns, n, sizeof (fcns[0]), prefetch_function_cmp);
+	for (i = 0; i < n && i < R2MCP_PREFETCH_FUNCTIONS; i++) {
+		char address[32];
+		snprintf (address, sizeof (address), "0x%08" PFMT64x, fcns[i].addr);
+		prefetch_add (calls, "decompileFunction", address);
+	}
+	free (fcns);
+	return calls;
+}
+
+// No request queued or running and no core claimed, the inline path
+// claims the session before running a tool
+static bool prefetch_idle_locked(void) {
+	if (pool.prefetch_waiters > 0 || r_list_length (pool.jobs) > 0 || r_list_length (pool.active) > 0) {
+		return false;
+	}
+	RListIter *iter;
+	R2McpSession *ss;
+	r_list_foreach (pool.sessions, iter, ss) {
+		if (ss->busy) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// First plan still worth running, the stale ones are dropped
+static R2McpPrefetch *prefetch_next_locked(R2McpSession **out) {
+	R2McpPrefetch *pf;
+	while ((pf = r_list_first (pool.prefetch))) {
+		R2McpSession *ss = session_find_locked (pf->session);
+		if (ss && ss->generation == pf->generation && (!pf->calls || !r_list_empty (pf->calls))) {
+			*out = ss;
+			return pf;
+		}
+		r_list_pop_head (pool.prefetch);
+		prefetch_free (pf);
+	}
+	return NULL;
+}
+
+// Run one call through tool_invoke, which leaves the result in the memo
+// unless the command was interrupted
+static void prefetch_run(R2McpSession *ss, const char *call) {
+	char *json = strdup (call);
+	RJson *params = r_json_parse (json);
+	const char *name = r_json_get_str (params, "name");
+	const R2McpTool *tool = tool_find (name);
+	if (tool && (tool->flags & R2MCP_TOOL_READONLY)) {
+		char *res = tool_invoke (ss, name, params);
+		if (res && r_str_startswith (res, "{\"content\"")) {
+			stats_add (&stats.prefetched, 1);
+		}
+		free (res);
+	}
+	r_json_free (params);
+	free (json);
+}
+
+// The session is claimed like a worker does, one call at a time, so the
+// plan gets checked again against the pool state between calls
+static void *prefetch_thread(void *user) {
+	(void)user;
+	prefetch_self = true;
+	pthread_mutex_lock (&pool.lock);
+	while (pool.running) {
+		R2McpSession *ss = NULL;
+		R2McpPrefetch *pf = prefetch_idle_locked () ? prefetch_next_locked (&ss) : NULL;
+		if (!pf) {
+			pthread_cond_wait (&pool.cond, &pool.lock);
+			continue;
+		}
+		// the plan is ours while running, a newer request replaces it
+		r_list_delete_data (pool.prefetch, pf);
+		ss->busy = true;
+		ss->refs++;
+		pool.prefetching = ss;
+		pthread_mutex_unlock (&pool.lock);
+		if (!pf->calls) {
+			pf->calls = prefetch_plan (ss);
+		}
+		char *call = r_list_pop_head (pf->calls);
+		if (call) {
+			const bool gate = r2_cons_gate_enter ();
+			prefetch_run (ss, call);
+			r2_cons_gate_leave (gate);
+		}
+		pthread_mutex_lock (&pool.lock);
+		pool.prefetching = NULL;
+		// the break was ours, retry the interrupted call later
+		RConsContext *ctx = ss->core->cons->context;
+		if (ctx->breaked) {
+			ctx->breaked = false;
+			if (call && pool.prefetch_yield) {
+				r_list_prepend (pf->calls, call);
+				call = NULL;
+			}
+		}
+		pool.prefetch_yield = false;
+		free (call);
+		arena_reset ();
+		if (!pool.running || prefetch_find_locked (pf->session) || r_list_empty (pf->calls)) {
+			prefetch_free (pf);
+		} else {
+			r_list_prepend (pool.prefetch, pf);
+		}
+		ss->busy = false;
+		session_unref_locked (ss);
+		pthread_cond_broadcast (&pool.cond);
+	}
+	pthread_mutex_unlock (&pool.lock);
+	arena_fini ();
+	return NULL;
+}
+
+// Enabled unless R2MCP_PREFETCH=0
+static void prefetch_start(void) {
+	char *env = r_sys_getenv ("R2MCP_PREFETCH");
+	const bool enabled = R_STR_ISEMPTY (env) || atoi (env) != 0;
+	free (env);
+	if (!enabled) {
+		return;
+	}
+	pool.prefetch = r_list_new ();
+	if (pthread_create (&pool.prefetcher, NULL, prefetch_thread, NULL)) {
+		R_LOG_WARN ("Cannot create prefetch thread");
+		r_list_free (pool.prefetch);
+		pool.prefetch = NULL;
+	}
+}
+
+static void prefetch_stop(void) {
+	if (!pool.prefetch) {
+		return;
+	}
+	pthread_join (pool.prefetcher, NULL);
+	pthread_mutex_lock (&pool.lock);
+	R2McpPrefetch *pf;
+	while ((pf = r_list_pop_head (pool.prefetch))) {
+		prefetch_free (pf);
+	}
+	r_list_free (pool.prefetch);
+	pool.prefetch = NULL;
+	pthread_mutex_unlock (&pool.lock);
+}
+
+// Number of workers comes from R2MCP_WORKERS, at least one so the reader
+// threads never run tools and see the cancellations meanwhile
+static void workers_start(int min) {
+	int n = R2MCP_WORKERS;
+	char *env = r_sys_getenv ("R2MCP_WORKERS");
+	if (R_STR_ISNOTEMPTY (env)) {
+		n = atoi (env);
+	}
+	free (env);
+	n = R_MAX (n, min);
+	pool.running = true;
+	watchdog_start ();
+	prefetch_start ();
+	pool.workers = R_NEWS0 (pthread_t, R_MAX (n, 1));
+	for (pool.nworkers = 0; pool.nworkers < n; pool.nworkers++) {
+		if (pthread_create (&pool.workers[pool.nworkers], NULL, worker_thread, NULL)) {
+			R_LOG_WARN ("Cannot create worker thread");
+			break;
+		}
+	}
+	if (!pool.nworkers) {
+		R_LOG_WARN ("No worker threads, tools run on the reader and cannot be cancelled");
+	}
+}
+
+// Let the workers finish the queued jobs and wait for them
+static void workers_stop(void) {
+	pthread_mutex_lock (&pool.lock);
+	pool.running = false;
+	prefetch_interrupt_locked ();
+	pthread_cond_broadcast (&pool.cond);
+	pthread_mutex_unlock (&pool.lock);
+	int i;
+	for (i = 0; i < pool.nworkers; i++) {
+		pthread_join (pool.workers[i], NULL);
+	}
+	pool.nworkers = 0;
+	R_FREE (pool.workers);
+	prefetch_stop ();
+	watchdog_stop ();
+}
+
+// Queue a tools/call request for the workers. Takes ownership of msg and
+// request on success. Requests that fail early (unknown session, missing
+// capability) are left to the inline path to build the error response.
+static bool dispatch_tool_call(R2McpClient *client, char *msg, RJson *request, const char *method, RJson *params, const char *id) {
+	if (strcmp (method, "tools/call") && strcmp (method, "tool/call")) {
+		return false;
+	}
+	char *error = NULL;
+	if (!assert_request_handler_capability (method, &error)) {
+		free (error);
+		return false;
+	}
+	R2McpSession *ss = NULL;
+	pthread_mutex_lock (&pool.lock);
+	if (!session_acquire_locked (params, &ss)) {
+		pthread_mutex_unlock (&pool.lock);
+		return false;
+	}
+	R2McpJob *job = R_NEW0 (R2McpJob);
+	job->msg = msg;
+	job->request = request;
+	job->id = id ? strdup (id) : NULL;
+	job->client = client_ref (client);
+	job->ss = ss;
+	r_list_append (pool.jobs, job);
+	prefetch_interrupt_locked ();
+	pthread_cond_signal (&pool.cond);
+	pthread_mutex_unlock (&pool.lock);
+	return true;
 }
 
-// Modified process_mcp_message to handle the protocol correctly
-static void process_mcp_message(const char *msg) {
-	r2mcp_log ("<<<");
-	r2mcp_log (msg);
+// Handle one framed message from the client. msg is a view into the read
+// buffer and gets parsed in place, so it must not be used after this call.
+// Returns true if a response was sent or will be sent by a worker.
+static bool process_mcp_message(R2McpClient *client, char *msg) {
+	r2mcp_log_payload (R2MCP_LOGLVL_DEBUG, "<<< ", msg, strlen (msg));
+
+	// Tool calls may run on a worker, keep a copy of those for the job.
+	// A message missed by this check is just handled inline.
+	char *copy = NULL;
+	if (pool.nworkers > 0 && (strstr (msg, "\"tools/call\"") || strstr (msg, "\"tool/call\""))) {
+		copy = strdup (msg);
+		msg = copy;
+	}
 
-	RJson *request = r_json_parse ((char *)msg);
+	stats_add (&stats.messages, 1);
+	stats_add (&stats.bytes_in, strlen (msg));
+	const ut64 start = r_time_now_mono ();
+	RJson *request = r_json_parse (msg);
+	stats_phase (R2MCP_PHASE_PARSE, start);
 	if (!request) {
 		R_LOG_ERROR ("Invalid JSON");
-		return;
+		free (copy);
+		return false;
 	}
 
 	const char *method = r_json_get_str (request, "method");
@@ -533,109 +2841,855 @@ static void process_mcp_message(const char *msg) {
 	if (!method) {
 		R_LOG_ERROR ("Invalid JSON-RPC message: missing method");
 		r_json_free (request);
-		return;
+		free (copy);
+		return false;
 	}
 
+	bool responded = false;
 	// Proper handling of notifications vs requests
 	if (id_json) {
 		// This is a request that requires a response
-		const char *id = NULL;
 		char id_buf[32] = { 0 };
+		const char *id = json_id_tostring (id_json, id_buf, sizeof (id_buf));
 
-		if (id_json->type == R_JSON_STRING) {
-			id = id_json->str_value;
-		} else if (id_json->type == R_JSON_INTEGER) {
-			snprintf (id_buf, sizeof (id_buf), "%lld", (long long)id_json->num.u_value);
-			id = id_buf;
+		if (copy && dispatch_tool_call (client, copy, request, method, params, id)) {
+			// the job owns the message and the parsed request now
+			arena_reset ();
+			return true;
 		}
-
+		client_current = client;
 		char *response = handle_mcp_request (method, params, id);
+		client_current = NULL;
 		if (response) {
-			r2mcp_log (">>>");
-			r2mcp_log (response);
-
-			// Ensure the response ends with a newline
-			size_t resp_len = strlen (response);
-			bool has_newline = (resp_len > 0 && response[resp_len - 1] == '\n');
-
-			if (!has_newline) {
-				write (STDOUT_FILENO, response, resp_len);
-				write (STDOUT_FILENO, "\n", 1);
-			} else {
-				write (STDOUT_FILENO, response, resp_len);
-			}
-
-			fsync (STDOUT_FILENO);
+			send_message (client, response);
 			free (response);
+			responded = true;
 		}
 	} else {
 		// This is a notification, don't send a response
 		// Just handle it internally
 		if (!strcmp (method, "notifications/cancelled")) {
-			r2mcp_log ("Received cancelled notification");
+			r2mcp_log (R2MCP_LOGLVL_INFO, "Received cancelled notification");
+			char id_buf[32] = { 0 };
+			const char *id = json_id_tostring (r_json_get (params, "requestId"), id_buf, sizeof (id_buf));
+			if (id) {
+				job_cancel (client->owner, id);
+			}
 		} else if (!strcmp (method, "notifications/initialized")) {
-			r2mcp_log ("Received initialized notification");
+			r2mcp_log (R2MCP_LOGLVL_INFO, "Received initialized notification");
 		} else {
-			r2mcp_log ("Received unknown notification");
+			r2mcp_log (R2MCP_LOGLVL_WARNING, "Received unknown notification");
 		}
 	}
 
 	r_json_free (request);
+	free (copy);
+	// the response is written, nothing of this request is needed anymore
+	arena_reset ();
+	return responded;
 }
 
-// Main function with proper initialization
-int main(int argc, char **argv) {
-	(void)argc;
-	(void)argv;
-
-	// Print to stderr immediately to confirm we're starting
-	fprintf (stderr, "r2mcp starting\n");
-
-	// Enable logging
-	r2mcp_log ("r2mcp starting");
+// HTTP transport, serving the streamable HTTP endpoint at /mcp and the
+// older HTTP+SSE one (GET /sse, then POST /messages?sessionId=) from one
+// event loop. Requests are read and answered on the loop thread while tool
+// calls go to the workers, which queue their responses on the client.
+// Every connection carries a single request.
+#define R2MCP_HTTP_HEAD_MAX (16 * 1024)
+#define R2MCP_HTTP_BODY_MAX (64 * 1024 * 1024)
+#define R2MCP_HTTP_EVENTS   64
 
-	// Set up signal handlers
-	struct sigaction sa = { 0 };
-	sa.sa_flags = 0;
-	sa.sa_handler = signal_handler;
-	sigemptyset (&sa.sa_mask);
+typedef struct {
+	void *ptr;
+	bool in;
+} R2McpEvent;
 
-	sigaction (SIGINT, &sa, NULL);
-	sigaction (SIGTERM, &sa, NULL);
-	sigaction (SIGHUP, &sa, NULL);
-	signal (SIGPIPE, SIG_IGN);
+static int poller_new(void) {
+#if __linux__
+	return epoll_create1 (EPOLL_CLOEXEC);
+#else
+	return kqueue ();
+#endif
+}
 
-	// Initialize r2
-	if (!init_r2 ()) {
-		R_LOG_ERROR ("Failed to initialize radare2");
-		r2mcp_log ("Failed to initialize radare2");
-		return 1;
+// Watch fd for input, and for room to write while out is set
+static void poller_watch(int fd, void *ptr, bool add, bool out) {
+#if __linux__
+	struct epoll_event ev = { .events = EPOLLIN | (out ? EPOLLOUT : 0), .data.ptr = ptr };
+	epoll_ctl (http.poll, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+#else
+	struct kevent ev[2];
+	int n = 0;
+	if (add) {
+		EV_SET (&ev[n++], fd, EVFILT_READ, EV_ADD, 0, 0, ptr);
 	}
-
-	// Always use direct mode with mcpo
-	is_direct_mode = true;
-	direct_mode_loop ();
-
-	cleanup_r2 ();
-	return 0;
+	if (out || !add) {
+		EV_SET (&ev[n++], fd, EVFILT_WRITE, out ? EV_ADD : EV_DELETE, 0, 0, ptr);
+	}
+	kevent (http.poll, ev, n, NULL, 0, NULL);
+#endif
 }
 
-// Properly handle the "initialize" method
-// Fixed handle_initialize function with properly structured capabilities
-static char *handle_initialize(RJson *params) {
-#if 0
-	if (server_state.client_capabilities) {
-		r_json_free (server_state.client_capabilities);
+static int poller_wait(R2McpEvent *events, int timeout) {
+	int i, n;
+#if __linux__
+	struct epoll_event ev[R2MCP_HTTP_EVENTS];
+	n = epoll_wait (http.poll, ev, R2MCP_HTTP_EVENTS, timeout);
+	for (i = 0; i < n; i++) {
+		events[i].ptr = ev[i].data.ptr;
+		events[i].in = ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR);
 	}
-	if (server_state.client_info) {
-		r_json_free (server_state.client_info);
+#else
+	struct kevent ev[R2MCP_HTTP_EVENTS];
+	struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000 };
+	n = kevent (http.poll, NULL, 0, ev, R2MCP_HTTP_EVENTS, &ts);
+	for (i = 0; i < n; i++) {
+		events[i].ptr = ev[i].udata;
+		events[i].in = ev[i].filter == EVFILT_READ;
 	}
 #endif
+	return n;
+}
 
-	server_state.client_capabilities = r_json_get (params, "capabilities");
-	server_state.client_info = r_json_get (params, "clientInfo");
+static void fd_nonblock(int fd) {
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL, 0) | O_NONBLOCK);
+	fcntl (fd, F_SETFD, FD_CLOEXEC);
+}
 
-	// Create a proper initialize response
+static bool http_listen(const char *host, int port) {
+	char service[16];
+	snprintf (service, sizeof (service), "%d", port);
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+	struct addrinfo *res, *ai;
+	if (getaddrinfo (host, service, &hints, &res)) {
+		R_LOG_ERROR ("Cannot resolve %s", host);
+		return false;
+	}
+	for (ai = res; ai && http.fd == -1; ai = ai->ai_next) {
+		int fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
+		const int one = 1;
+		setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+		if (!bind (fd, ai->ai_addr, ai->ai_addrlen) && !listen (fd, 128)) {
+			http.fd = fd;
+		} else {
+			close (fd);
+		}
+	}
+	freeaddrinfo (res);
+	if (http.fd == -1) {
+		R_LOG_ERROR ("Cannot listen on %s:%d", host, port);
+		return false;
+	}
+	fd_nonblock (http.fd);
+	return true;
+}
+
+static void http_accept(void) {
+	int fd;
+	while ((fd = accept (http.fd, NULL, NULL)) != -1) {
+		fd_nonblock (fd);
+		R2McpClient *c = R_NEW0 (R2McpClient);
+		c->kind = R2MCP_CLIENT_HTTP;
+		c->fd = fd;
+		c->refs = 1; // the client list
+		c->in = read_buffer_new ();
+		c->out = r_strbuf_new ("");
+		pthread_mutex_lock (&http.lock);
+		r_list_append (http.clients, c);
+		pthread_mutex_unlock (&http.lock);
+		poller_watch (fd, c, true, false);
+	}
+}
+
+static void client_close_locked(R2McpClient *c) {
+	if (c->fd != -1) {
+		close (c->fd);
+		c->fd = -1;
+	}
+}
+
+// Answer with a whole response and close the connection after it
+static void http_reply_locked(R2McpClient *c, const char *status, const char *body) {
+	if (!body) {
+		body = "";
+	}
+	r_strbuf_appendf (c->out, "HTTP/1.1 %s\r\nContent-Type: text/plain\r\n"
+		"Content-Length: %d\r\nConnection: close\r\n\r\n%s", status, (int)strlen (body), body);
+	c->head_sent = true;
+	c->done = true;
+	c->closing = true;
+}
+
+static void http_reply(R2McpClient *c, const char *status, const char *body) {
+	pthread_mutex_lock (&http.lock);
+	http_reply_locked (c, status, body);
+	pthread_mutex_unlock (&http.lock);
+}
+
+// MCP session ids, only made on the loop thread
+static char *http_session_id(void) {
+	ut8 rnd[8] = { 0 };
+	int fd = open ("/dev/urandom", O_RDONLY);
+	if (fd != -1) {
+		if (read (fd, rnd, sizeof (rnd)) < 0) {
+			R_LOG_WARN ("Cannot read /dev/urandom");
+		}
+		close (fd);
+	}
+	char *hex = r_hex_bin2strdup (rnd, sizeof (rnd));
+	char *id = r_str_newf ("%x-%s", ++http.next_owner, hex);
+	free (hex);
+	return id;
+}
+
+// Only pages served from this host may talk to the server, so a visited
+// site can not drive it through DNS rebinding. Other clients send no Origin.
+static bool http_origin_ok(const char *origin) {
+	static const char *local[] = { "localhost", "127.0.0.1", "[::1]" };
+	if (!origin) {
+		return true;
+	}
+	const char *host = strstr (origin, "://");
+	host = host ? host + 3 : origin;
+	size_t i;
+	for (i = 0; i < sizeof (local) / sizeof (local[0]); i++) {
+		const size_t n = strlen (local[i]);
+		if (!strncmp (host, local[i], n) && (!host[n] || host[n] == ':' || host[n] == '/')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Streamable HTTP: the response comes as an event stream on the same
+// connection, a POST carrying only a notification gets a 202
+static void http_post(R2McpClient *c, const char *session, char *body) {
+	c->kind = R2MCP_CLIENT_POST;
+	c->owner = session ? strdup (session) : http_session_id ();
+	c->pending = 1;
+	if (!process_mcp_message (c, body)) {
+		pthread_mutex_lock (&http.lock);
+		if (!c->head_sent) {
+			http_reply_locked (c, "202 Accepted", NULL);
+		}
+		c->closing = true;
+		pthread_mutex_unlock (&http.lock);
+	}
+}
+
+// HTTP+SSE: the stream tells where to POST, and gets the responses
+static void http_stream_open(R2McpClient *c) {
+	c->kind = R2MCP_CLIENT_STREAM;
+	c->owner = http_session_id ();
+	pthread_mutex_lock (&http.lock);
+	http_stream_head_locked (c);
+	r_strbuf_appendf (c->out, "event: endpoint\ndata: /messages?sessionId=%s\n\n", c->owner);
+	pthread_mutex_unlock (&http.lock);
+}
+
+static void http_stream_post(R2McpClient *c, const char *query, char *body) {
+	const char *sid = query ? strstr (query, "sessionId=") : NULL;
+	R2McpClient *stream = NULL;
+	if (sid) {
+		sid += strlen ("sessionId=");
+		const size_t len = strcspn (sid, "&");
+		RListIter *iter;
+		R2McpClient *s;
+		// the list only changes on this thread
+		r_list_foreach (http.clients, iter, s) {
+			if (s->kind == R2MCP_CLIENT_STREAM && s->fd != -1 && strlen (s->owner) == len && !strncmp (s->owner, sid, len)) {
+				stream = s;
+				break;
+			}
+		}
+	}
+	if (!stream) {
+		http_reply (c, "404 Not Found", "Unknown session\n");
+		return;
+	}
+	http_reply (c, "202 Accepted", NULL);
+	process_mcp_message (stream, body);
+}
+
+static void http_request(R2McpClient *c, const char *method, char *path, const char *origin, const char *session, char *body) {
+	char *query = strchr (path, '?');
+	if (query) {
+		*query++ = 0;
+	}
+	if (!http_origin_ok (origin)) {
+		http_reply (c, "403 Forbidden", "Origin not allowed\n");
+	} else if (!strcmp (path, "/mcp") || !strcmp (path, "/")) {
+		if (!strcmp (method, "POST")) {
+			http_post (c, session, body);
+		} else if (!strcmp (method, "DELETE")) {
+			http_reply (c, "200 OK", NULL);
+		} else {
+			// there is no stream for server initiated messages
+			http_reply (c, "405 Method Not Allowed", NULL);
+		}
+	} else if (!strcmp (path, "/sse") && !strcmp (method, "GET")) {
+		http_stream_open (c);
+	} else if (!strcmp (path, "/metrics") && !strcmp (method, "GET")) {
+		char *metrics = stats_prometheus ();
+		http_reply (c, "200 OK", metrics);
+		free (metrics);
+	} else if (!strcmp (path, "/messages") && !strcmp (method, "POST")) {
+		http_stream_post (c, query, body);
+	} else {
+		http_reply (c, "404 Not Found", NULL);
+	}
+}
+
+// Handle the request once its headers and body are in
+static void http_input(R2McpClient *c) {
+	ReadBuffer *in = c->in;
+	char *head = in->data;
+	char *end = strstr (head, "\r\n\r\n");
+	if (!end) {
+		if (in->size > R2MCP_HTTP_HEAD_MAX) {
+			http_reply (c, "431 Request Header Fields Too Large", NULL);
+		}
+		return;
+	}
+	char *body = end + 4;
+	if (r_str_casestr (head, "\r\nTransfer-Encoding:")) {
+		http_reply (c, "411 Length Required", NULL);
+		return;
+	}
+	const char *cl = r_str_casestr (head, "\r\nContent-Length:");
+	const size_t need = (cl && cl < end) ? strtoul (cl + strlen ("\r\nContent-Length:"), NULL, 10) : 0;
+	if (need > R2MCP_HTTP_BODY_MAX) {
+		http_reply (c, "413 Content Too Large", NULL);
+		return;
+	}
+	if (in->size - (body - head) < need) {
+		return;
+	}
+	body[need] = 0;
+	*end = 0;
+	c->done = true;
+	// request line, then the headers used here
+	char *line = strstr (head, "\r\n");
+	if (line) {
+		*line = 0;
+		line += 2;
+	}
+	char *path = strchr (head, ' ');
+	if (!path) {
+		http_reply (c, "400 Bad Request", NULL);
+		return;
+	}
+	*path++ = 0;
+	char *sp = strchr (path, ' ');
+	if (sp) {
+		*sp = 0;
+	}
+	const char *origin = NULL;
+	const char *session = NULL;
+	while (line) {
+		char *next = strstr (line, "\r\n");
+		if (next) {
+			*next = 0;
+			next += 2;
+		}
+		char *value = strchr (line, ':');
+		if (value) {
+			*value++ = 0;
+			while (*value == ' ' || *value == '\t') {
+				value++;
+			}
+			if (!strcasecmp (line, "Origin")) {
+				origin = value;
+			} else if (!strcasecmp (line, "Mcp-Session-Id") && *value) {
+				session = value;
+			}
+		}
+		line = next;
+	}
+	http_request (c, head, path, origin, session, body);
+}
+
+static void http_read(R2McpClient *c) {
+	for (;;) {
+		char junk[4096];
+		ssize_t n;
+		if (c->done) {
+			n = read (c->fd, junk, sizeof (junk));
+		} else if (read_buffer_reserve (c->in, READ_CHUNK_SIZE)) {
+			n = read (c->fd, c->in->data + c->in->size, READ_CHUNK_SIZE);
+		} else {
+			n = 0;
+		}
+		if (n > 0) {
+			if (!c->done) {
+				c->in->size += n;
+				c->in->data[c->in->size] = 0;
+			}
+			continue;
+		}
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			// the peer went away, whatever is still running for it is dropped
+			pthread_mutex_lock (&http.lock);
+			client_close_locked (c);
+			pthread_mutex_unlock (&http.lock);
+			return;
+		}
+		break;
+	}
+	if (!c->done && c->in->size > 0) {
+		http_input (c);
+	}
+}
+
+// Write out what the client has pending, waiting for room in the socket
+// when it is full
+static void http_flush_locked(R2McpClient *c) {
+	const size_t len = r_strbuf_length (c->out);
+	const char *buf = r_strbuf_get (c->out);
+	while (c->out_off < len) {
+		ssize_t n = write (c->fd, buf + c->out_off, len - c->out_off);
+		if (n > 0) {
+			c->out_off += n;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else {
+			client_close_locked (c);
+			return;
+		}
+	}
+	const bool full = c->out_off < len;
+	if (!full && len > 0) {
+		r_strbuf_set (c->out, "");
+		c->out_off = 0;
+	}
+	if (full != c->want_write) {
+		c->want_write = full;
+		poller_watch (c->fd, c, false, full);
+	}
+	if (!full && c->closing) {
+		client_close_locked (c);
+	}
+}
+
+// Closed clients are only dropped here, after the whole batch of events
+static void http_sweep(void) {
+	RListIter *iter, *tmp;
+	R2McpClient *c;
+	pthread_mutex_lock (&http.lock);
+	r_list_foreach_safe (http.clients, iter, tmp, c) {
+		if (c->fd != -1) {
+			http_flush_locked (c);
+		}
+		if (c->fd == -1) {
+			r_list_delete (http.clients, iter);
+			client_unref_locked (c);
+		}
+	}
+	pthread_mutex_unlock (&http.lock);
+}
+
+static bool http_mode_loop(const char *host, int port) {
+	if (!http_listen (host, port)) {
+		return false;
+	}
+	http.poll = poller_new ();
+	if (http.poll == -1 || pipe (http.wake)) {
+		R_LOG_ERROR ("Cannot create the event loop");
+		return false;
+	}
+	fd_nonblock (http.wake[0]);
+	fd_nonblock (http.wake[1]);
+	http.clients = r_list_new ();
+	poller_watch (http.fd, &http.fd, true, false);
+	poller_watch (http.wake[0], http.wake, true, false);
+	char *msg = r_str_newf ("Listening on http://%s:%d/mcp", host, port);
+	r2mcp_log (R2MCP_LOGLVL_INFO, msg);
+	fprintf (stderr, "%s\n", msg);
+	free (msg);
+
+	R2McpEvent events[R2MCP_HTTP_EVENTS];
+	while (running) {
+		const int n = poller_wait (events, 1000);
+		int i;
+		for (i = 0; i < n; i++) {
+			void *ptr = events[i].ptr;
+			if (ptr == &http.fd) {
+				http_accept ();
+			} else if (ptr == http.wake) {
+				char buf[256];
+				while (read (http.wake[0], buf, sizeof (buf)) > 0) {
+				}
+			} else if (events[i].in && ((R2McpClient *)ptr)->fd != -1) {
+				http_read (ptr);
+			}
+		}
+		http_sweep ();
+	}
+	r2mcp_log (R2MCP_LOGLVL_INFO, "HTTP loop terminated");
+	return true;
+}
+
+// Called once the workers are gone, analyses still running find their
+// clients closed
+static void http_fini(void) {
+	R2McpClient *c;
+	pthread_mutex_lock (&http.lock);
+	while (http.clients && (c = r_list_pop_head (http.clients))) {
+		client_close_locked (c);
+		client_unref_locked (c);
+	}
+	r_list_free (http.clients);
+	http.clients = NULL;
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (http.wake[i] != -1) {
+			close (http.wake[i]);
+			http.wake[i] = -1;
+		}
+	}
+	pthread_mutex_unlock (&http.lock);
+	if (http.poll != -1) {
+		close (http.poll);
+		http.poll = -1;
+	}
+	if (http.fd != -1) {
+		close (http.fd);
+		http.fd = -1;
+	}
+}
+
+// Warm server. The daemon creates a core once and keeps R2MCP_WARM
+// children forked from it waiting on a Unix socket, so they start with the
+// plugins loaded. A launcher (r2mcp -c) connects and passes its stdin and
+// stdout with SCM_RIGHTS, the child that accepted it serves the client on
+// them and exits when it goes away, and the daemon forks a new one.
+#define R2MCP_WARM 2
+
+static bool warm_send_fds(int sock, const int *fds, int n, const char *data) {
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE (2 * sizeof (int))];
+	} u;
+	memset (&u, 0, sizeof (u));
+	struct iovec iov = { (void *)data, strlen (data) + 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buf,
+		.msg_controllen = CMSG_SPACE (n * sizeof (int)),
+	};
+	struct cmsghdr *cm = CMSG_FIRSTHDR (&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN (n * sizeof (int));
+	memcpy (CMSG_DATA (cm), fds, n * sizeof (int));
+	return sendmsg (sock, &msg, 0) == (ssize_t)iov.iov_len;
+}
+
+static bool warm_recv_fds(int sock, int *fds, int n, char *data, size_t size) {
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE (2 * sizeof (int))];
+	} u;
+	struct iovec iov = { data, size - 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buf,
+		.msg_controllen = sizeof (u.buf),
+	};
+	const ssize_t len = recvmsg (sock, &msg, 0);
+	if (len <= 0) {
+		return false;
+	}
+	data[len] = 0;
+	struct cmsghdr *cm = CMSG_FIRSTHDR (&msg);
+	if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN (n * sizeof (int))) {
+		return false;
+	}
+	memcpy (fds, CMSG_DATA (cm), n * sizeof (int));
+	return true;
+}
+
+static bool warm_address(struct sockaddr_un *sa, const char *path) {
+	memset (sa, 0, sizeof (*sa));
+	sa->sun_family = AF_UNIX;
+	if (strlen (path) >= sizeof (sa->sun_path)) {
+		R_LOG_ERROR ("Socket path too long: %s", path);
+		return false;
+	}
+	r_str_ncpy (sa->sun_path, path, sizeof (sa->sun_path));
+	return true;
+}
+
+// Launcher side: hand stdin, stdout and the working directory to a warm
+// child and wait for it to be done. Returns false if no daemon answers,
+// to serve the client from this process instead.
+static bool warm_connect(const char *path) {
+	struct sockaddr_un sa;
+	if (!warm_address (&sa, path)) {
+		return false;
+	}
+	int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || connect (fd, (struct sockaddr *)&sa, sizeof (sa))) {
+		R_LOG_WARN ("No warm server on %s, starting a new one", path);
+		if (fd != -1) {
+			close (fd);
+		}
+		return false;
+	}
+	char cwd[4096];
+	if (!getcwd (cwd, sizeof (cwd))) {
+		strcpy (cwd, "/");
+	}
+	const int fds[2] = { STDIN_FILENO, STDOUT_FILENO };
+	if (!warm_send_fds (fd, fds, 2, cwd)) {
+		close (fd);
+		return false;
+	}
+	// the child keeps the connection until it is done with the client
+	char b;
+	while (read (fd, &b, 1) < 0 && errno == EINTR) {
+	}
+	close (fd);
+	return true;
+}
+
+static int r2mcp_serve(const char *host, int port);
+
+// Child side: wait for a launcher and serve it on its own stdin and stdout
+static int warm_child(int lfd) {
+	int cfd;
+	while ((cfd = accept (lfd, NULL, NULL)) == -1 && errno == EINTR && running) {
+	}
+	close (lfd);
+	int fds[2];
+	char cwd[4096];
+	if (cfd == -1 || !warm_recv_fds (cfd, fds, 2, cwd, sizeof (cwd))) {
+		return 1;
+	}
+	if (chdir (cwd)) {
+		R_LOG_WARN ("Cannot change to %s", cwd);
+	}
+	dup2 (fds[0], STDIN_FILENO);
+	dup2 (fds[1], STDOUT_FILENO);
+	close (fds[0]);
+	close (fds[1]);
+	const int rc = r2mcp_serve (NULL, 0);
+	close (cfd);
+	return rc;
+}
+
+static int warm_daemon(const char *path) {
+	struct sockaddr_un sa;
+	if (!warm_address (&sa, path)) {
+		return 1;
+	}
+	int n = R2MCP_WARM;
+	char *env = r_sys_getenv ("R2MCP_WARM");
+	if (R_STR_ISNOTEMPTY (env) && atoi (env) > 0) {
+		n = atoi (env);
+	}
+	free (env);
+	int lfd = socket (AF_UNIX, SOCK_STREAM, 0);
+	unlink (path);
+	const mode_t mask = umask (077);
+	const bool bound = lfd != -1 && !bind (lfd, (struct sockaddr *)&sa, sizeof (sa)) && !listen (lfd, 16);
+	umask (mask);
+	if (!bound) {
+		R_LOG_ERROR ("Cannot listen on %s", path);
+		return 1;
+	}
+	// the children inherit this core already initialized
+	pool.spare = r2_core_new ();
+	if (!pool.spare) {
+		return 1;
+	}
+	fprintf (stderr, "Warm server listening on %s with %d children\n", path, n);
+	pid_t *kids = R_NEWS0 (pid_t, n);
+	while (running) {
+		int i;
+		for (i = 0; i < n; i++) {
+			if (kids[i] > 0) {
+				continue;
+			}
+			kids[i] = fork ();
+			if (kids[i] == 0) {
+				free (kids);
+				_exit (warm_child (lfd));
+			}
+			if (kids[i] == -1) {
+				R_LOG_ERROR ("Cannot fork a warm child");
+				kids[i] = 0;
+			}
+		}
+		const pid_t pid = waitpid (-1, NULL, 0);
+		for (i = 0; i < n; i++) {
+			if (pid > 0 && kids[i] == pid) {
+				kids[i] = 0;
+			}
+		}
+		if (pid == -1 && errno == ECHILD) {
+			// every fork failed, do not spin
+			sleep (1);
+		}
+	}
+	int i;
+	for (i = 0; i < n; i++) {
+		if (kids[i] > 0) {
+			kill (kids[i], SIGTERM);
+			waitpid (kids[i], NULL, 0);
+		}
+	}
+	free (kids);
+	close (lfd);
+	unlink (path);
+	cleanup_r2 ();
+	return 0;
+}
+
+static void r2mcp_usage(FILE *fd) {
+	fprintf (fd, "Usage: r2mcp [-hH] [-p port] [-b address] [-d socket] [-c socket] [-s count]\n"
+		" -h          show this help\n"
+		" -H          serve MCP over HTTP instead of stdio, on port %d\n"
+		" -p port     port to listen on, implies -H\n"
+		" -b address  address to bind, implies -H (127.0.0.1)\n"
+		" -d socket   run the warm server daemon on this Unix socket\n"
+		" -c socket   serve stdio from a warm server, or locally if none is running\n"
+		" -s count    spread the sessions over count shard processes\n", PORT);
+}
+
+// Serve one transport until the client goes away or a signal arrives
+static int r2mcp_serve(const char *host, int port) {
+	const bool use_http = port > 0;
+	stats.started = r_time_now_mono ();
+	// Enable logging
+	r2mcp_log_init ();
+	r2mcp_log (R2MCP_LOGLVL_INFO, "r2mcp starting");
+
+	// Direct mode with mcpo unless an HTTP port was given
+	bool ok = true;
+	is_direct_mode = !use_http;
+	workers_start (1);
+	if (use_http) {
+		ok = http_mode_loop (host, port);
+	} else {
+		direct_mode_loop ();
+	}
+	workers_stop ();
+	http_fini ();
+	shards_stop ();
+
+	cleanup_r2 ();
+	arena_fini ();
+	r2mcp_log_fini ();
+	return ok ? 0 : 1;
+}
+
+// Main function with proper initialization
+int main(int argc, char **argv) {
+	const char *host = "127.0.0.1";
+	int port = 0;
+	RGetopt opt;
+	const char *daemon = NULL;
+	const char *warm = NULL;
+	int nshards = 1;
+	r_getopt_init (&opt, argc, (const char **)argv, "hHp:b:d:c:s:");
+	int c;
+	while ((c = r_getopt_next (&opt)) != -1) {
+		switch (c) {
+		case 'H':
+			port = port ? port : PORT;
+			break;
+		case 'p':
+			port = atoi (opt.arg);
+			if (port <= 0 || port > 65535) {
+				R_LOG_ERROR ("Invalid port %s", opt.arg);
+				return 1;
+			}
+			break;
+		case 'b':
+			host = opt.arg;
+			port = port ? port : PORT;
+			break;
+		case 'd':
+			daemon = opt.arg;
+			break;
+		case 'c':
+			warm = opt.arg;
+			break;
+		case 's':
+			nshards = atoi (opt.arg);
+			if (nshards < 1 || nshards > R2MCP_SHARDS_MAX) {
+				R_LOG_ERROR ("Invalid shard count %s", opt.arg);
+				return 1;
+			}
+			break;
+		case 'h':
+			r2mcp_usage (stdout);
+			return 0;
+		default:
+			r2mcp_usage (stderr);
+			return 1;
+		}
+	}
+	if (warm && !port && warm_connect (warm)) {
+		return 0;
+	}
+
+	// Print to stderr immediately to confirm we're starting
+	fprintf (stderr, "r2mcp starting\n");
+
+	// Set up signal handlers
+	struct sigaction sa = { 0 };
+	sa.sa_flags = 0;
+	sa.sa_handler = signal_handler;
+	sigemptyset (&sa.sa_mask);
+
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+	sigaction (SIGHUP, &sa, NULL);
+	signal (SIGPIPE, SIG_IGN);
+
+	// Initialize r2
+	if (!init_r2 ()) {
+		R_LOG_ERROR ("Failed to initialize radare2");
+		return 1;
+	}
+	// no threads may be running yet when the daemon forks its children
+	if (daemon) {
+		return warm_daemon (daemon);
+	}
+	// and the same goes for the shards
+	if (nshards > 1 && !shards_start (nshards)) {
+		return 1;
+	}
+	return r2mcp_serve (host, port);
+}
+
+// Properly handle the "initialize" method
+// Fixed handle_initialize function with properly structured capabilities
+static char *handle_initialize(RJson *params) {
+#if 0
+	if (server_state.client_capabilities) {
+		r_json_free (server_state.client_capabilities);
+	}
+	if (server_state.client_info) {
+		r_json_free (server_state.client_info);
+	}
+#endif
+
+	server_state.client_capabilities = r_json_get (params, "capabilities");
+	server_state.client_info = r_json_get (params, "clientInfo");
+
+	// Create a proper initialize response
 	PJ *pj = pj_new ();
 	pj_o (pj);
 	pj_ks (pj, "protocolVersion", LATEST_PROTOCOL_VERSION);
@@ -656,8 +3710,13 @@ static char *handle_initialize(RJson *params) {
 	pj_kb (pj, "listChanged", false);
 	pj_end (pj);
 
+	// Log level can be changed with logging/setLevel
+	pj_k (pj, "logging");
+	pj_o (pj);
+	pj_end (pj);
+
 	// For any capability we don't support, don't include it at all
-	// Don't add: prompts, roots, resources, notifications, logging, sampling
+	// Don't add: prompts, roots, resources, notifications, sampling
 
 	pj_end (pj); // End capabilities
 
@@ -672,619 +3731,4232 @@ static char *handle_initialize(RJson *params) {
 }
 
 // Create a proper success response
+// The result is copied once into a buffer of the exact size
 static char *create_success_response(const char *result, const char *id) {
-	PJ *pj = pj_new ();
-	pj_o (pj);
-	pj_ks (pj, "jsonrpc", "2.0");
+	char *prefix = response_prefix (id);
+	if (!result) {
+		result = "null";
+	}
+	const size_t plen = strlen (prefix);
+	const size_t rlen = strlen (result);
+	char *o = malloc (plen + rlen + 2);
+	memcpy (o, prefix, plen);
+	memcpy (o + plen, result, rlen);
+	memcpy (o + plen + rlen, "}", 2);
+	return o;
+}
 
-	if (id) {
-		// If id is a number string, treat it as a number
-		char *endptr;
-		long num_id = strtol (id, &endptr, 10);
-		if (*id != '\0' && *endptr == '\0') {
-			// It's a valid number
-			pj_kn (pj, "id", num_id);
+// Length of the UTF-8 sequence at p, 0 when it is not a valid one
+static int utf8_seq_len(const ut8 *p, ut64 avail) {
+	const ut8 c = p[0];
+	int n;
+	if (c >= 0xc2 && c <= 0xdf) {
+		n = 2;
+	} else if (c >= 0xe0 && c <= 0xef) {
+		n = 3;
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		n = 4;
+	} else {
+		return 0;
+	}
+	if ((ut64)n > avail) {
+		return 0;
+	}
+	// reject overlong forms, surrogates and code points past U+10FFFF
+	if ((c == 0xe0 && p[1] < 0xa0) || (c == 0xed && p[1] > 0x9f)
+		|| (c == 0xf0 && p[1] < 0x90) || (c == 0xf4 && p[1] > 0x8f)) {
+		return 0;
+	}
+	int i;
+	for (i = 1; i < n; i++) {
+		if ((p[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+	}
+	return n;
+}
+
+// Escape s as the contents of a JSON string into dst, or only measure it
+// when dst is NULL. Bytes that are not valid UTF-8 are written as \u00XX,
+// so the output is always valid JSON.
+static size_t json_escape(char *dst, const char *s) {
+	static const char hex[] = "0123456789abcdef";
+	const ut8 *p = (const ut8 *)s;
+	size_t n = 0;
+	while (*p) {
+		const ut8 c = *p;
+		if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+			if (dst) {
+				dst[n] = c;
+			}
+			n++;
+			p++;
+			continue;
+		}
+		char esc = 0;
+		switch (c) {
+		case '"': esc = '"'; break;
+		case '\\': esc = '\\'; break;
+		case '\n': esc = 'n'; break;
+		case '\r': esc = 'r'; break;
+		case '\t': esc = 't'; break;
+		case '\b': esc = 'b'; break;
+		case '\f': esc = 'f'; break;
+		}
+		if (esc) {
+			if (dst) {
+				dst[n] = '\\';
+				dst[n + 1] = esc;
+			}
+			n += 2;
+			p++;
+			continue;
+		}
+		// the NUL terminator stops the sequence check, no need for the length
+		const int len = c >= 0x80 ? utf8_seq_len (p, 4) : 0;
+		if (len) {
+			if (dst) {
+				memcpy (dst + n, p, len);
+			}
+			n += len;
+			p += len;
+			continue;
+		}
+		if (dst) {
+			memcpy (dst + n, "\\u00", 4);
+			dst[n + 4] = hex[c >> 4];
+			dst[n + 5] = hex[c & 15];
+		}
+		n += 6;
+		p++;
+	}
+	return n;
+}
+
+// Helper function to create a simple text tool result. The text is
+// measured first and escaped straight into a buffer of the final size.
+static char *create_tool_text_response(const char *text) {
+	static const char head[] = "{\"content\":[{\"type\":\"text\",\"text\":\"";
+	static const char tail[] = "\"}]}";
+	const size_t hlen = sizeof (head) - 1;
+	if (!text) {
+		text = "";
+	}
+	const size_t len = json_escape (NULL, text);
+	char *o = malloc (hlen + len + sizeof (tail));
+	memcpy (o, head, hlen);
+	json_escape (o + hlen, text);
+	memcpy (o + hlen + len, tail, sizeof (tail));
+	return o;
+}
+
+// Tool result for format:json calls. The JSON is spliced as is in
+// structuredContent, arrays wrapped in an items object, and the text
+// content only carries a short summary.
+static char *create_tool_json_response(const char *json, const char *summary) {
+	PJ *pj = pj_new ();
+	pj_o (pj);
+	pj_k (pj, "content");
+	pj_a (pj);
+	pj_o (pj);
+	pj_ks (pj, "type", "text");
+	pj_ks (pj, "text", summary);
+	pj_end (pj);
+	pj_end (pj);
+	pj_k (pj, "structuredContent");
+	if (*json == '[') {
+		pj_o (pj);
+		pj_k (pj, "items");
+		pj_raw (pj, json);
+		pj_end (pj);
+	} else {
+		pj_raw (pj, *json == '{' ? json : "{}");
+	}
+	pj_end (pj);
+	return pj_drain (pj);
+}
+
+// Result memoization for read-only tools. Results are kept per session,
+// keyed by the tool name and its normalized arguments, and dropped as a
+// whole when the session generation changes.
+#define R2MCP_MEMO_MAX (64 * 1024 * 1024)
+
+static ut64 memo_hits = 0;
+static ut64 memo_misses = 0;
+
+static int memo_arg_cmp(const void *a, const void *b) {
+	const RJson *ja = *(const RJson **)a;
+	const RJson *jb = *(const RJson **)b;
+	return strcmp (ja->key, jb->key);
+}
+
+// Build "tool("key"=value,...)" with the keys sorted and the session left
+// out, so the same call always maps to the same key. Keys and values are
+// written as JSON, so no two different arguments give the same key.
+static char *memo_key(const char *tool_name, const RJson *args) {
+	RStrBuf *sb = r_strbuf_new (tool_name);
+	r_strbuf_append (sb, "(");
+	if (args && args->type == R_JSON_OBJECT && args->children.count > 0) {
+		const RJson **items = R_NEWS0 (const RJson *, args->children.count);
+		size_t i, n = 0;
+		const RJson *js;
+		for (js = args->children.first; js; js = js->next) {
+			if (strcmp (js->key, "session")) {
+				items[n++] = js;
+			}
+		}
+		qsort (items, n, sizeof (items[0]), memo_arg_cmp);
+		for (i = 0; i < n; i++) {
+			js = items[i];
+			r_strbuf_append (sb, i ? "," : "");
+			json_write_str (sb, js->key);
+			r_strbuf_append (sb, "=");
+			json_write (sb, js);
+		}
+		free (items);
+	}
+	r_strbuf_append (sb, ")");
+	return r_strbuf_drain (sb);
+}
+
+static void memo_kv_free(HtPPKv *kv) {
+	free (kv->key);
+	free (kv->value);
+}
+
+static void memo_clear(R2McpSession *ss) {
+	ht_pp_free (ss->memo);
+	ss->memo = NULL;
+	ss->memo_bytes = 0;
+}
+
+static char *memo_get(R2McpSession *ss, const char *key) {
+	if (ss->memo && ss->memo_generation != ss->generation) {
+		memo_clear (ss);
+	}
+	const char *res = ss->memo ? ht_pp_find (ss->memo, key, NULL) : NULL;
+	if (res) {
+		ss->memo_hits++;
+		__atomic_fetch_add (&memo_hits, 1, __ATOMIC_RELAXED);
+		return strdup (res);
+	}
+	ss->memo_misses++;
+	__atomic_fetch_add (&memo_misses, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void memo_put(R2McpSession *ss, const char *key, const char *result) {
+	const size_t len = strlen (result);
+	if (ss->memo_bytes + len > R2MCP_MEMO_MAX) {
+		memo_clear (ss);
+		if (len > R2MCP_MEMO_MAX) {
+			return;
+		}
+	}
+	if (!ss->memo) {
+		ss->memo = ht_pp_new (NULL, memo_kv_free, NULL);
+		ss->memo_generation = ss->generation;
+	}
+	if (ht_pp_insert (ss->memo, key, strdup (result))) {
+		ss->memo_bytes += len;
+	}
+}
+
+// Decompiler output cache. Unlike the memo it survives edits: entries are
+// keyed by function address and checked against a snapshot of what the
+// output depends on, the decompiler, the function bytes, name, prototype
+// and the names of what it references. Renaming a function or changing its
+// prototype only invalidates it and its callers. Comments are not part of
+// the snapshot, setComment drops the function entry instead.
+#define R2MCP_DECOMP_MAX (64 * 1024 * 1024)
+#define R2MCP_DECOMP_JOBS 8
+
+typedef struct {
+	ut64 snapshot;
+	char *text;
+} R2McpDecomp;
+
+static void decomp_kv_free(HtUPKv *kv) {
+	R2McpDecomp *d = kv->value;
+	free (d->text);
+	free (d);
+}
+
+static void decomp_clear(R2McpSession *ss) {
+	ht_up_free (ss->decomp);
+	ss->decomp = NULL;
+	ss->decomp_bytes = 0;
+}
+
+static ut64 decomp_hash(ut64 h, const void *data, size_t len) {
+	const ut8 *p = data;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static ut64 decomp_hash_str(ut64 h, const char *s) {
+	return s ? decomp_hash (h, s, strlen (s) + 1) : decomp_hash (h, "", 1);
+}
+
+static ut64 decomp_snapshot(RCore *core, RAnalFunction *fcn) {
+	ut64 h = 0xcbf29ce484222325ULL;
+	h = decomp_hash_str (h, r_config_get (core->config, "cmd.pdc"));
+	h = decomp_hash_str (h, fcn->name);
+	char *sig = r_anal_function_get_signature (fcn);
+	h = decomp_hash_str (h, sig);
+	free (sig);
+	RListIter *iter;
+	RAnalBlock *bb;
+	r_list_foreach (fcn->bbs, iter, bb) {
+		h = decomp_hash (h, &bb->addr, sizeof (bb->addr));
+		ut8 *buf = bb->size > 0 && bb->size < R2MCP_DECOMP_MAX ? malloc (bb->size) : NULL;
+		if (buf && r_io_read_at (core->io, bb->addr, buf, bb->size)) {
+			h = decomp_hash (h, buf, bb->size);
+		}
+		free (buf);
+	}
+	RVecAnalRef *refs = r_anal_function_get_refs (fcn);
+	if (refs) {
+		RAnalRef *ref;
+		R_VEC_FOREACH (refs, ref) {
+			RAnalFunction *callee = r_anal_get_function_at (core->anal, ref->addr);
+			h = decomp_hash (h, &ref->addr, sizeof (ref->addr));
+			h = decomp_hash_str (h, callee ? callee->name : NULL);
+		}
+		RVecAnalRef_free (refs);
+	}
+	return h;
+}
+
+static char *decomp_get(R2McpSession *ss, ut64 addr, ut64 snapshot) {
+	R2McpDecomp *d = ss->decomp ? ht_up_find (ss->decomp, addr, NULL) : NULL;
+	if (d && d->snapshot == snapshot) {
+		ss->decomp_hits++;
+		return strdup (d->text);
+	}
+	ss->decomp_misses++;
+	return NULL;
+}
+
+static void decomp_put(R2McpSession *ss, ut64 addr, ut64 snapshot, const char *text) {
+	const size_t len = strlen (text);
+	if (len > R2MCP_DECOMP_MAX) {
+		return;
+	}
+	if (ss->decomp_bytes + len > R2MCP_DECOMP_MAX) {
+		decomp_clear (ss);
+	}
+	if (!ss->decomp) {
+		ss->decomp = ht_up_new (NULL, decomp_kv_free, NULL);
+	}
+	R2McpDecomp *old = ht_up_find (ss->decomp, addr, NULL);
+	if (old) {
+		ss->decomp_bytes -= strlen (old->text);
+	}
+	R2McpDecomp *d = R_NEW0 (R2McpDecomp);
+	d->snapshot = snapshot;
+	d->text = strdup (text);
+	ht_up_update (ss->decomp, addr, d);
+	ss->decomp_bytes += len;
+}
+
+// Drop the entry of the function containing addr
+static void decomp_forget(R2McpSession *ss, ut64 addr) {
+	RAnalFunction *fcn = ss->decomp ? r_anal_get_fcn_in (ss->core->anal, addr, 0) : NULL;
+	if (fcn && ht_up_find (ss->decomp, fcn->addr, NULL)) {
+		R2McpDecomp *d = ht_up_find (ss->decomp, fcn->addr, NULL);
+		ss->decomp_bytes -= strlen (d->text);
+		ht_up_delete (ss->decomp, fcn->addr);
+	}
+}
+
+static char *decomp_run(RCore *core, ut64 addr) {
+	char *cmd = arena_newf ("'@0x%08" PFMT64x "'pdc", addr);
+	char *text = r_core_cmd_str (core, cmd);
+	return text;
+}
+
+// Decompile the function containing address through the cache. Falls back
+// to running pdc uncached when there is no function there
+static char *decomp_function(R2McpSession *ss, const char *address) {
+	RCore *core = ss->core;
+	RAnalFunction *fcn = r_anal_get_fcn_in (core->anal, r_num_math (core->num, address), 0);
+	if (!fcn) {
+		char *cmd = arena_newf ("'@%s'pdc", address);
+		char *text = r2_cmd (ss, cmd);
+		return text;
+	}
+	const ut64 snapshot = decomp_snapshot (core, fcn);
+	char *text = decomp_get (ss, fcn->addr, snapshot);
+	if (!text) {
+		const ut64 start = r_time_now_mono ();
+		text = decomp_run (core, fcn->addr);
+		stats_phase (R2MCP_PHASE_COMMAND, start);
+		if (text && !core->cons->context->breaked) {
+			decomp_put (ss, fcn->addr, snapshot, text);
+		}
+	}
+	return text;
+}
+
+typedef struct {
+	const char *address;
+	RAnalFunction *fcn; // NULL when no function contains the address
+	ut64 snapshot;
+	char *text;
+	bool fresh; // decompiled by this call, to be cached
+} R2McpDecompItem;
+
+// One helper of decomp_parallel, with a core of its own loaded with the
+// file and the analysis of the session
+typedef struct {
+	R2McpSession *ss;
+	const char *script; // the session analysis, saved for the helpers
+	R2McpDecompItem *items;
+	size_t n;
+	int job;
+	int jobs;
+	RCore *core; // while decompiling, for the caller to break it
+	bool done;
+} R2McpDecompJob;
+
+static pthread_mutex_t decomp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Decompile every jobs-th miss, each one in an item no other helper writes
+static void *decomp_thread(void *user) {
+	R2McpDecompJob *dj = user;
+	R2McpSession *ss = dj->ss;
+	RConsContext *ctx = ss->core->cons->context;
+	RCore *core = r2_core_new ();
+	R2McpOpenMode mode = ss->open_mode;
+	if (core && r2_open_core (core, ss->path, &mode)) {
+		r_core_cmd_file (core, dj->script);
+		// the settings are edits too, and only live in the session
+		RListIter *iter;
+		const char *cmd;
+		r_list_foreach (ss->edits, iter, cmd) {
+			r_core_cmd0 (core, cmd);
+		}
+		pthread_mutex_lock (&decomp_lock);
+		dj->core = core;
+		pthread_mutex_unlock (&decomp_lock);
+		size_t i, miss = 0;
+		for (i = 0; i < dj->n && !ctx->breaked; i++) {
+			R2McpDecompItem *it = &dj->items[i];
+			if (!it->fcn || it->text || miss++ % dj->jobs != (size_t)dj->job) {
+				continue;
+			}
+			char *text = decomp_run (core, it->fcn->addr);
+			if (text && !core->cons->context->breaked) {
+				it->text = text;
+				it->fresh = true;
+			} else {
+				free (text);
+			}
+		}
+	}
+	pthread_mutex_lock (&decomp_lock);
+	dj->core = NULL;
+	dj->done = true;
+	pthread_mutex_unlock (&decomp_lock);
+	r_core_free (core);
+	arena_fini ();
+	return NULL;
+}
+
+// Decompile the misses in threads, each on a core of its own loaded from a
+// script of the claimed session core. Forking is not an option once
+// threads run, a child could inherit a lock held by one of them. Only
+// used when every core has its own RCons, and whatever the helpers leave
+// is decompiled by the caller in process.
+static void decomp_parallel(R2McpSession *ss, R2McpDecompItem *items, size_t n, int jobs) {
+	char *script = r_file_temp ("r2mcp");
+	const int opts = R_CORE_PRJ_FLAGS | R_CORE_PRJ_META | R_CORE_PRJ_XREFS
+		| R_CORE_PRJ_FCNS | R_CORE_PRJ_ANAL_HINTS | R_CORE_PRJ_ANAL_TYPES;
+	if (!script || !r_core_project_save_script (ss->core, script, opts)) {
+		free (script);
+		return;
+	}
+	RConsContext *ctx = ss->core->cons->context;
+	R2McpDecompJob djs[R2MCP_DECOMP_JOBS] = { { 0 } };
+	pthread_t th[R2MCP_DECOMP_JOBS];
+	bool started[R2MCP_DECOMP_JOBS] = { 0 };
+	int j, running = 0;
+	for (j = 0; j < jobs; j++) {
+		R2McpDecompJob *dj = &djs[j];
+		dj->ss = ss;
+		dj->script = script;
+		dj->items = items;
+		dj->n = n;
+		dj->job = j;
+		dj->jobs = jobs;
+		started[j] = !pthread_create (&th[j], NULL, decomp_thread, dj);
+		running += started[j];
+	}
+	// a break of the session core reaches the helpers too
+	bool broken = false;
+	while (running > 0 && !broken) {
+		r_sys_usleep (100000);
+		pthread_mutex_lock (&decomp_lock);
+		broken = ctx->breaked;
+		for (j = 0, running = 0; j < jobs; j++) {
+			if (broken && djs[j].core) {
+				r_cons_context_break (djs[j].core->cons->context);
+			}
+			running += started[j] && !djs[j].done;
+		}
+		pthread_mutex_unlock (&decomp_lock);
+	}
+	for (j = 0; j < jobs; j++) {
+		if (started[j]) {
+			pthread_join (th[j], NULL);
+		}
+	}
+	r_file_rm (script);
+	free (script);
+}
+
+// Functions touched since the last analysis, so analyze can rerun only
+// the passes depending on them instead of the whole level. Edited ones
+// come from the mutating tools, new code from disassembling executable
+// addresses outside any function.
+typedef struct {
+	ut64 addr;
+	bool code; // no function there yet, one is made first
+} R2McpDirty;
+
+static void dirty_clear(R2McpSession *ss) {
+	r_list_free (ss->dirty);
+	ss->dirty = NULL;
+}
+
+static void dirty_mark(R2McpSession *ss, ut64 addr, bool code) {
+	RListIter *iter;
+	R2McpDirty *d;
+	if (!ss->dirty) {
+		ss->dirty = r_list_newf (free);
+	}
+	r_list_foreach (ss->dirty, iter, d) {
+		if (d->addr == addr) {
+			return;
+		}
+	}
+	d = R_NEW0 (R2McpDirty);
+	d->addr = addr;
+	d->code = code;
+	r_list_append (ss->dirty, d);
+}
+
+// Mark the function containing the address an edit was made at
+static void dirty_mark_function(R2McpSession *ss, const char *address) {
+	RCore *core = ss->core;
+	RAnalFunction *fcn = r_anal_get_fcn_in (core->anal, r_num_math (core->num, address), 0);
+	if (fcn) {
+		dirty_mark (ss, fcn->addr, false);
+	}
+}
+
+static void dirty_mark_code(R2McpSession *ss, ut64 addr) {
+	RCore *core = ss->core;
+	if (ss->level < 0 || r_anal_get_fcn_in (core->anal, addr, 0)) {
+		return;
+	}
+	RIOMap *map = r_io_map_get_at (core->io, addr);
+	if (map && (map->perm & R_PERM_X)) {
+		dirty_mark (ss, addr, true);
+	}
+}
+
+static void dirty_add(HtUP *todo, RAnalFunction *fcn) {
+	if (fcn) {
+		ht_up_insert (todo, fcn->addr, fcn);
+	}
+}
+
+static bool dirty_count_cb(void *user, const ut64 addr, const void *v) {
+	(void)addr;
+	(void)v;
+	(*(int *)user)++;
+	return true;
+}
+
+static bool dirty_analyze_cb(void *user, const ut64 addr, const void *v) {
+	(void)v;
+	R2McpSession *ss = user;
+	RCore *core = ss->core;
+	if (core->cons->context->breaked) {
+		return false;
+	}
+	char *cmd = arena_newf ("'@0x%08" PFMT64x "'aar $FS", addr);
+	r_core_cmd0 (core, cmd);
+	cmd = arena_newf ("'@0x%08" PFMT64x "'afva", addr);
+	r_core_cmd0 (core, cmd);
+	cmd = arena_newf ("'@0x%08" PFMT64x "'aft", addr);
+	r_core_cmd0 (core, cmd);
+	decomp_forget (ss, addr);
+	return true;
+}
+
+// Rerun the xref, variable and type matching passes on the dirty functions
+// and their direct callers and callees. Returns how many were analyzed
+static int r2_analyze_dirty(R2McpSession *ss) {
+	RCore *core = ss->core;
+	RAnal *anal = core->anal;
+	HtUP *todo = ht_up_new0 ();
+	RListIter *iter;
+	R2McpDirty *d;
+	r_list_foreach (ss->dirty, iter, d) {
+		if (d->code) {
+			char *cmd = arena_newf ("'@0x%08" PFMT64x "'af", d->addr);
+			r_core_cmd0 (core, cmd);
+		}
+		RAnalFunction *fcn = r_anal_get_function_at (anal, d->addr);
+		if (!fcn) {
+			continue;
+		}
+		dirty_add (todo, fcn);
+		RAnalRef *ref;
+		RVecAnalRef *refs = r_anal_function_get_refs (fcn);
+		if (refs) {
+			R_VEC_FOREACH (refs, ref) {
+				if (R_ANAL_REF_TYPE_MASK (ref->type) == R_ANAL_REF_TYPE_CALL) {
+					dirty_add (todo, r_anal_get_function_at (anal, ref->addr));
+				}
+			}
+			RVecAnalRef_free (refs);
+		}
+		refs = r_anal_xrefs_get (anal, fcn->addr);
+		if (refs) {
+			R_VEC_FOREACH (refs, ref) {
+				if (R_ANAL_REF_TYPE_MASK (ref->type) == R_ANAL_REF_TYPE_CALL) {
+					dirty_add (todo, r_anal_get_fcn_in (anal, ref->at, 0));
+				}
+			}
+			RVecAnalRef_free (refs);
+		}
+	}
+	int count = 0;
+	ht_up_foreach (todo, dirty_count_cb, &count);
+	ht_up_foreach (todo, dirty_analyze_cb, ss);
+	ht_up_free (todo);
+	ss->generation++;
+	if (!core->cons->context->breaked) {
+		dirty_clear (ss);
+	}
+	return count;
+}
+
+// Lookup tables built from the analysis the first time they are needed
+// and rebuilt once the session generation changes. Xrefs are kept twice
+// in flat arrays, sorted by target and by source, for binary searches.
+// Every reference of the xref database is indexed, the call graph only
+// has the calls made from analyzed functions.
+typedef struct {
+	ut64 from;
+	ut64 to;
+	int type;
+} R2McpXref;
+
+// Call graph edge between two function starts
+typedef struct {
+	ut64 from;
+	ut64 to;
+} R2McpEdge;
+
+typedef struct r2mcp_index_t {
+	ut64 generation;
+	R2McpXref *by_to;   // sorted by target, then source
+	R2McpXref *by_from; // sorted by source, then target
+	size_t count;
+	R2McpEdge *calls;   // sorted by caller, then callee, without duplicates
+	size_t ncalls;
+	HtPU *names; // function and flag names => address
+} R2McpIndex;
+
+static void index_free(R2McpIndex *ix) {
+	if (ix) {
+		free (ix->by_to);
+		free (ix->by_from);
+		free (ix->calls);
+		ht_pu_free (ix->names);
+		free (ix);
+	}
+}
+
+static int index_cmp_to(const void *a, const void *b) {
+	const R2McpXref *xa = a;
+	const R2McpXref *xb = b;
+	if (xa->to != xb->to) {
+		return xa->to < xb->to ? -1 : 1;
+	}
+	return (xa->from > xb->from) - (xa->from < xb->from);
+}
+
+static int index_cmp_from(const void *a, const void *b) {
+	const R2McpXref *xa = a;
+	const R2McpXref *xb = b;
+	if (xa->from != xb->from) {
+		return xa->from < xb->from ? -1 : 1;
+	}
+	return (xa->to > xb->to) - (xa->to < xb->to);
+}
+
+static int index_cmp_edge(const void *a, const void *b) {
+	const R2McpEdge *ea = a;
+	const R2McpEdge *eb = b;
+	if (ea->from != eb->from) {
+		return ea->from < eb->from ? -1 : 1;
+	}
+	return (ea->to > eb->to) - (ea->to < eb->to);
+}
+
+static bool index_flag_cb(RFlagItem *fi, void *user) {
+	ht_pu_insert (user, fi->name, fi->offset);
+	return true;
+}
+
+static R2McpIndex *index_build(RCore *core) {
+	R2McpIndex *ix = R_NEW0 (R2McpIndex);
+	ix->names = ht_pu_new0 ();
+	size_t ccap = 0;
+	RListIter *iter;
+	RAnalFunction *fcn;
+	RAnalRef *ref;
+	// every reference axt and axf know about, also the ones from data and
+	// from code outside of the analyzed functions
+	RVecAnalRef *xrefs = r_anal_xrefs_list (core->anal, false);
+	if (xrefs) {
+		ix->by_to = R_NEWS (R2McpXref, R_MAX (RVecAnalRef_length (xrefs), 1));
+		R_VEC_FOREACH (xrefs, ref) {
+			R2McpXref *x = &ix->by_to[ix->count++];
+			x->from = ref->at;
+			x->to = ref->addr;
+			x->type = R_ANAL_REF_TYPE_MASK (ref->type);
+		}
+		RVecAnalRef_free (xrefs);
+	}
+	// the call graph is between functions, so it comes from their refs
+	r_list_foreach (core->anal->fcns, iter, fcn) {
+		// function names win over the flags at other addresses
+		ht_pu_insert (ix->names, fcn->name, fcn->addr);
+		RVecAnalRef *refs = r_anal_function_get_refs (fcn);
+		if (!refs) {
+			continue;
+		}
+		R_VEC_FOREACH (refs, ref) {
+			if (R_ANAL_REF_TYPE_MASK (ref->type) == R_ANAL_REF_TYPE_CALL) {
+				if (ix->ncalls == ccap) {
+					ccap = ccap ? ccap * 2 : 1024;
+					ix->calls = realloc (ix->calls, ccap * sizeof (R2McpEdge));
+				}
+				ix->calls[ix->ncalls].from = fcn->addr;
+				ix->calls[ix->ncalls].to = ref->addr;
+				ix->ncalls++;
+			}
+		}
+		RVecAnalRef_free (refs);
+	}
+	if (ix->ncalls > 0) {
+		qsort (ix->calls, ix->ncalls, sizeof (R2McpEdge), index_cmp_edge);
+		size_t i, n = 1;
+		for (i = 1; i < ix->ncalls; i++) {
+			if (index_cmp_edge (&ix->calls[i], &ix->calls[n - 1])) {
+				ix->calls[n++] = ix->calls[i];
+			}
+		}
+		ix->ncalls = n;
+	}
+	r_flag_foreach (core->flags, index_flag_cb, ix->names);
+	if (ix->count > 0) {
+		ix->by_from = R_NEWS (R2McpXref, ix->count);
+		memcpy (ix->by_from, ix->by_to, ix->count * sizeof (R2McpXref));
+		qsort (ix->by_to, ix->count, sizeof (R2McpXref), index_cmp_to);
+		qsort (ix->by_from, ix->count, sizeof (R2McpXref), index_cmp_from);
+	}
+	return ix;
+}
+
+// Index of the session matching its current analysis
+static R2McpIndex *index_get(R2McpSession *ss) {
+	if (!ss->index || ss->index->generation != ss->generation) {
+		index_free (ss->index);
+		ss->index = index_build (ss->core);
+		ss->index->generation = ss->generation;
+	}
+	return ss->index;
+}
+
+// Plain numbers and exact names are resolved without the radare2
+// expression parser, anything else still goes through it
+static ut64 index_resolve(R2McpSession *ss, R2McpIndex *ix, const char *address) {
+	char *end = NULL;
+	ut64 addr = 0;
+	if (r_str_startswith (address, "0x")) {
+		addr = strtoull (address + 2, &end, 16);
+	} else if (isdigit ((ut8)*address)) {
+		addr = strtoull (address, &end, 10);
+	}
+	if (end && end != address && !*end) {
+		return addr;
+	}
+	bool found = false;
+	addr = ix ? ht_pu_find (ix->names, address, &found) : 0;
+	return found ? addr : r_num_math (ss->core->num, address);
+}
+
+// First entry of a sorted array with key >= addr
+static size_t index_lower(const R2McpXref *xrefs, size_t count, ut64 addr, bool to) {
+	size_t lo = 0, hi = count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if ((to ? xrefs[mid].to : xrefs[mid].from) < addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static const char *index_fcn_name(RAnal *anal, ut64 addr) {
+	RAnalFunction *fcn = r_anal_get_fcn_in (anal, addr, 0);
+	return fcn ? fcn->name : "";
+}
+
+// Tool handlers. They run with the session core claimed, and the ones not
+// flagged with R2MCP_TOOL_SESSION get no session at all.
+
+static char *tool_open_file(R2McpToolCall *tc) {
+	const char *filepath = r_json_get_str (tc->args, "filePath");
+	if (!filepath) {
+		return create_error_response (-32602, "Missing required parameter: filePath", NULL, NULL);
+	}
+
+	const int mode = r2_open_mode_from_name (r_json_get_str (tc->args, "openMode"));
+	if (mode == -1) {
+		return create_error_response (-32602, "Invalid openMode, use auto, mmap or buffered", NULL, NULL);
+	}
+	if (shards.count) {
+		return shard_open_file (filepath, tc->params);
+	}
+
+	bool reused = false;
+	int cached = -1;
+	const ut32 id = r2_open_file (filepath, mode, &reused, &cached);
+	if (!id) {
+		return create_tool_text_response ("Failed to open file.");
+	}
+	if (!reused) {
+		prefetch_request (id);
+	}
+	char *text = r_str_newf ("%s\nsession: %u", reused ? "File already open, reusing its session." : "File opened successfully.", id);
+	if (cached != -1) {
+		text = r_str_appendf (text, "\nanalysis: level %d loaded from the cache", cached);
+	}
+	char *o = create_tool_text_response (text);
+	free (text);
+	return o;
+}
+
+static char *tool_list_sessions(R2McpToolCall *tc) {
+	(void)tc;
+	if (shards.count) {
+		return shard_list_sessions ();
+	}
+	RStrBuf *sb = r_strbuf_new ("");
+	RListIter *iter;
+	R2McpSession *s;
+	pthread_mutex_lock (&pool.lock);
+	r_list_foreach (pool.sessions, iter, s) {
+		r_strbuf_appendf (sb, "%u %s (%s)\n", s->id, s->path, r2_open_mode_name (s->open_mode));
+	}
+	pthread_mutex_unlock (&pool.lock);
+	char *res = r_strbuf_drain (sb);
+	char *o = create_tool_text_response (res);
+	free (res);
+	return o;
+}
+
+static char *tool_close_file(R2McpToolCall *tc) {
+	session_close (tc->ss);
+	return create_tool_text_response ("File closed successfully.");
+}
+
+// Whether the call asked for format:json
+static bool tool_json(R2McpToolCall *tc) {
+	const char *format = r_json_get_str (tc->args, "format");
+	return format && !strcmp (format, "json");
+}
+
+// Run the JSON flavour of a command and splice its output in the result
+static char *tool_json_cmd(R2McpToolCall *tc, const char *cmd) {
+	char *res = r2_cmd (tc->ss, cmd);
+	r_str_trim (res);
+	char *o = create_tool_json_response (res, "JSON result in structuredContent");
+	free (res);
+	return o;
+}
+
+// Tools running a fixed command listed in the registry
+static char *tool_cmd(R2McpToolCall *tc) {
+	if (tc->tool->jcmd && tool_json (tc)) {
+		return tool_json_cmd (tc, tc->tool->jcmd);
+	}
+	char *res = r2_cmd (tc->ss, tc->tool->cmd);
+	char *o = create_tool_text_response (res);
+	free (res);
+	return o;
+}
+
+static char *tool_list_methods(R2McpToolCall *tc) {
+	const char *classname = r_json_get_str (tc->args, "classname");
+	if (!classname) {
+		return create_tool_text_response ("Missing classname parameter");
+	}
+	char *cmd = r_str_newf ("'ic %s", classname);
+	char *res = r2_cmd (tc->ss, cmd);
+	free (cmd);
+	char *o = create_tool_text_response (res);
+	free (res);
+	return o;
+}
+
+// Result filtering shared by the listing tools. Patterns without regexp
+// operators are matched as plain substrings, and "^literal" as prefixes,
+// so most filters never reach the regexp engine.
+#define R2MCP_FILTER_PARALLEL (4 * 1024 * 1024) // scan bigger outputs in parallel
+#define R2MCP_FILTER_THREADS  8
+
+typedef enum {
+	R2MCP_FILTER_NONE,
+	R2MCP_FILTER_LITERAL,
+	R2MCP_FILTER_PREFIX,
+	R2MCP_FILTER_REGEX,
+} R2McpFilterMode;
+
+typedef struct {
+	R2McpFilterMode mode;
+	const char *pattern;
+	size_t len;
+	RRegex rx;
+} R2McpFilter;
+
+// Takes regexpFilter, as advertised by the schemas, or the older filter.
+// Returns false when the regexp does not compile
+static bool filter_init(R2McpFilter *f, const RJson *args) {
+	const char *pattern = r_json_get_str (args, "regexpFilter");
+	if (!pattern) {
+		pattern = r_json_get_str (args, "filter");
+	}
+	memset (f, 0, sizeof (*f));
+	if (R_STR_ISEMPTY (pattern)) {
+		return true;
+	}
+	const bool anchored = *pattern == '^';
+	if (!strpbrk (pattern + anchored, ".[]()*+?{}|^$\\")) {
+		f->mode = anchored ? R2MCP_FILTER_PREFIX : R2MCP_FILTER_LITERAL;
+		f->pattern = pattern + anchored;
+		f->len = strlen (f->pattern);
+		return true;
+	}
+	if (!r_regex_init (&f->rx, pattern, r_regex_flags ("e"))) {
+		R_LOG_ERROR ("Invalid regex: %s", pattern);
+		return false;
+	}
+	f->mode = R2MCP_FILTER_REGEX;
+	return true;
+}
+
+static void filter_fini(R2McpFilter *f) {
+	if (f->mode == R2MCP_FILTER_REGEX) {
+		r_regex_fini (&f->rx);
+	}
+	f->mode = R2MCP_FILTER_NONE;
+}
+
+static bool filter_match(const R2McpFilter *f, const char *s) {
+	switch (f->mode) {
+	case R2MCP_FILTER_NONE:
+		return true;
+	case R2MCP_FILTER_LITERAL:
+		return strstr (s, f->pattern);
+	case R2MCP_FILTER_PREFIX:
+		return !strncmp (s, f->pattern, f->len);
+	case R2MCP_FILTER_REGEX:
+		return !r_regex_exec (&f->rx, s, 0, 0, 0);
+	}
+	return false;
+}
+
+// Keep the matching lines of [start, end) packed at start, and return the
+// length kept. end is a line boundary, so lines are cut and restored in
+// place without touching the bytes of other chunks.
+static size_t filter_chunk(const R2McpFilter *f, char *start, char *end) {
+	char *w = start;
+	char *p = start;
+	while (p < end) {
+		char *eol = memchr (p, '\n', end - p);
+		char *next = eol ? eol + 1 : end;
+		if (eol) {
+			*eol = 0;
+		}
+		const bool keep = filter_match (f, p);
+		if (eol) {
+			*eol = '\n';
+		}
+		if (keep) {
+			if (w != p) {
+				memmove (w, p, next - p);
+			}
+			w += next - p;
+		}
+		p = next;
+	}
+	return w - start;
+}
+
+typedef struct {
+	const R2McpFilter *f;
+	char *start;
+	char *end;
+	size_t kept;
+} R2McpFilterChunk;
+
+static void *filter_thread(void *arg) {
+	R2McpFilterChunk *c = arg;
+	c->kept = filter_chunk (c->f, c->start, c->end);
+	return NULL;
+}
+
+// Filter the lines of a command output in place. Big outputs are cut in
+// line aligned chunks scanned in parallel and packed again afterwards.
+static char *filter_lines(const R2McpFilter *f, char *buf) {
+	if (!buf || f->mode == R2MCP_FILTER_NONE) {
+		return buf;
+	}
+	const size_t len = strlen (buf);
+	long n = 1;
+	if (len >= R2MCP_FILTER_PARALLEL) {
+		n = R_MAX (1, R_MIN (sysconf (_SC_NPROCESSORS_ONLN), R2MCP_FILTER_THREADS));
+	}
+	if (n == 1) {
+		buf[filter_chunk (f, buf, buf + len)] = 0;
+		return buf;
+	}
+	R2McpFilterChunk chunks[R2MCP_FILTER_THREADS];
+	pthread_t th[R2MCP_FILTER_THREADS];
+	char *end = buf + len;
+	char *p = buf;
+	long i;
+	for (i = 0; i < n; i++) {
+		char *e = (i == n - 1) ? end : buf + len * (i + 1) / n;
+		if (e < p) {
+			e = p;
+		}
+		char *nl = e < end ? memchr (e, '\n', end - e) : NULL;
+		e = (i == n - 1 || !nl) ? end : nl + 1;
+		chunks[i] = (R2McpFilterChunk){ f, p, e, 0 };
+		p = e;
+	}
+	bool started[R2MCP_FILTER_THREADS] = { 0 };
+	for (i = 1; i < n; i++) {
+		started[i] = !pthread_create (&th[i], NULL, filter_thread, &chunks[i]);
+	}
+	filter_thread (&chunks[0]);
+	char *w = buf + chunks[0].kept;
+	for (i = 1; i < n; i++) {
+		if (started[i]) {
+			pthread_join (th[i], NULL);
+		} else {
+			filter_thread (&chunks[i]);
+		}
+		memmove (w, chunks[i].start, chunks[i].kept);
+		w += chunks[i].kept;
+	}
+	*w = 0;
+	return buf;
+}
+
+// Tools running a fixed command whose output lines are filtered
+static char *tool_cmd_filter(R2McpToolCall *tc) {
+	R2McpFilter f;
+	if (!filter_init (&f, tc->args)) {
+		return create_tool_text_response ("Invalid regular expression");
+	}
+	char *res = r2_cmd (tc->ss, tc->tool->cmd);
+	const ut64 start = r_time_now_mono ();
+	res = filter_lines (&f, res);
+	stats_phase (R2MCP_PHASE_FILTER, start);
+	filter_fini (&f);
+	char *o = create_tool_text_response (res);
+	free (res);
+	return o;
+}
+
+// Paginated listings. Pages are built straight from the radare2 lists, so
+// the memory used by a call depends on the page size and not on the size
+// of the binary. The cursor is opaque to the client: an item index for the
+// lists and a file offset for the string scanner.
+#define R2MCP_PAGE_SIZE 500
+#define R2MCP_PAGE_MAX  5000
+
+typedef struct {
+	RStrBuf *sb;
+	ut64 skip;  // matching items before the page
+	int limit;  // items per page
+	int count;  // items in the page
+	bool more;  // a matching item was found past the page
+	R2McpFilter filter;
+	PJ *pj;     // items array for format:json, NULL for text
+} R2McpPage;
+
+static bool page_init(R2McpPage *pg, R2McpToolCall *tc) {
+	const char *cursor = r_json_get_str (tc->args, "cursor");
+	const int limit = r_json_get_num (tc->args, "limit");
+	memset (pg, 0, sizeof (*pg));
+	pg->skip = cursor ? r_num_get (NULL, cursor) : 0;
+	pg->limit = limit > 0 ? R_MIN (limit, R2MCP_PAGE_MAX) : R2MCP_PAGE_SIZE;
+	if (!filter_init (&pg->filter, tc->args)) {
+		return false;
+	}
+	pg->sb = r_strbuf_new ("");
+	if (tool_json (tc)) {
+		pg->pj = pj_new ();
+		pj_o (pg->pj);
+		pj_ka (pg->pj, "items");
+	}
+	return true;
+}
+
+// Tell what to do with the next item of the listing: 1 to add it to the
+// page, 0 to skip it and -1 to stop, because the page is already full
+static int page_take(R2McpPage *pg, const char *key) {
+	if (!filter_match (&pg->filter, key)) {
+		return 0;
+	}
+	if (pg->skip > 0) {
+		pg->skip--;
+		return 0;
+	}
+	if (pg->count == pg->limit) {
+		pg->more = true;
+		return -1;
+	}
+	pg->count++;
+	return 1;
+}
+
+static void page_footer(RStrBuf *sb, const char *next) {
+	r_strbuf_appendf (sb, "\n-- more results, call again with cursor \"%s\"", next);
+}
+
+// Build the tool response. next is the cursor of the following page, NULL
+// to continue after the last item taken
+static char *page_finish(R2McpPage *pg, R2McpToolCall *tc, const char *next) {
+	filter_fini (&pg->filter);
+	if (pg->more) {
+		char buf[32];
+		if (!next) {
+			const char *cursor = r_json_get_str (tc->args, "cursor");
+			const ut64 from = cursor ? r_num_get (NULL, cursor) : 0;
+			snprintf (buf, sizeof (buf), "%" PFMT64u, from + pg->count);
+			next = buf;
+		}
+		if (pg->pj) {
+			pj_end (pg->pj);
+			pj_ks (pg->pj, "nextCursor", next);
+		} else {
+			page_footer (pg->sb, next);
+		}
+	} else if (pg->pj) {
+		pj_end (pg->pj);
+	}
+	if (pg->pj) {
+		pj_end (pg->pj);
+		r_strbuf_appendf (pg->sb, "%d results in structuredContent", pg->count);
+		if (pg->more) {
+			page_footer (pg->sb, next);
+		}
+		char *o = create_tool_json_response (pj_string (pg->pj), r_strbuf_get (pg->sb));
+		pj_free (pg->pj);
+		r_strbuf_free (pg->sb);
+		return o;
+	}
+	char *text = r_strbuf_drain (pg->sb);
+	char *o = create_tool_text_response (text);
+	free (text);
+	return o;
+}
+
+static char *tool_list_functions(R2McpToolCall *tc) {
+	R2McpPage pg;
+	if (!page_init (&pg, tc)) {
+		return create_tool_text_response ("Invalid regular expression");
+	}
+	RListIter *iter;
+	RAnalFunction *fcn;
+	r_list_foreach (tc->ss->core->anal->fcns, iter, fcn) {
+		const int take = page_take (&pg, fcn->name);
+		if (take < 0) {
+			break;
+		}
+		if (take && pg.pj) {
+			pj_o (pg.pj);
+			pj_kn (pg.pj, "addr", fcn->addr);
+			pj_ks (pg.pj, "name", fcn->name);
+			pj_kn (pg.pj, "size", r_anal_function_linear_size (fcn));
+			pj_end (pg.pj);
+		} else if (take) {
+			r_strbuf_appendf (pg.sb, "0x%08" PFMT64x " %s\n", fcn->addr, fcn->name);
+		}
+	}
+	return page_finish (&pg, tc, NULL);
+}
+
+static char *tool_list_symbols(R2McpToolCall *tc) {
+	R2McpPage pg;
+	if (!page_init (&pg, tc)) {
+		return create_tool_text_response ("Invalid regular expression");
+	}
+	RListIter *iter;
+	RBinSymbol *sym;
+	RList *symbols = r_bin_get_symbols (tc->ss->core->bin);
+	r_list_foreach (symbols, iter, sym) {
+		const char *name = r_bin_name_tostring (sym->name);
+		// imports and the function markers have their own tools
+		if (!name || sym->is_imported || r_str_startswith (name, "imp.") || r_str_startswith (name, "func.")) {
+			continue;
+		}
+		const int take = page_take (&pg, name);
+		if (take < 0) {
+			break;
+		}
+		if (take && pg.pj) {
+			pj_o (pg.pj);
+			pj_kn (pg.pj, "addr", sym->vaddr);
+			pj_ks (pg.pj, "name", name);
+			pj_ks (pg.pj, "type", r_str_get (sym->type));
+			pj_ks (pg.pj, "bind", r_str_get (sym->bind));
+			pj_end (pg.pj);
+		} else if (take) {
+			r_strbuf_appendf (pg.sb, "0x%08" PFMT64x " %s\n", sym->vaddr, name);
+		}
+	}
+	return page_finish (&pg, tc, NULL);
+}
+
+static char *tool_list_imports(R2McpToolCall *tc) {
+	R2McpPage pg;
+	if (!page_init (&pg, tc)) {
+		return create_tool_text_response ("Invalid regular expression");
+	}
+	RListIter *iter;
+	RBinImport *imp;
+	RList *imports = r_bin_get_imports (tc->ss->core->bin);
+	r_list_foreach (imports, iter, imp) {
+		const char *name = r_bin_name_tostring (imp->name);
+		if (!name) {
+			continue;
+		}
+		const int take = page_take (&pg, name);
+		if (take < 0) {
+			break;
+		}
+		if (take && pg.pj) {
+			pj_o (pg.pj);
+			pj_ks (pg.pj, "name", name);
+			pj_ks (pg.pj, "libname", r_str_get (imp->libname));
+			pj_ks (pg.pj, "type", r_str_get (imp->type));
+			pj_end (pg.pj);
+		} else if (take) {
+			if (R_STR_ISNOTEMPTY (imp->libname)) {
+				r_strbuf_appendf (pg.sb, "%s %s\n", imp->libname, name);
+			} else {
+				r_strbuf_appendf (pg.sb, "%s\n", name);
+			}
+		}
+	}
+	return page_finish (&pg, tc, NULL);
+}
+
+static char *tool_list_strings(R2McpToolCall *tc) {
+	R2McpPage pg;
+	if (!page_init (&pg, tc)) {
+		return create_tool_text_response ("Invalid regular expression");
+	}
+	RListIter *iter;
+	RBinString *str;
+	RList *strings = r_bin_get_strings (tc->ss->core->bin);
+	r_list_foreach (strings, iter, str) {
+		const int take = page_take (&pg, str->string);
+		if (take < 0) {
+			break;
+		}
+		if (take && pg.pj) {
+			pj_o (pg.pj);
+			pj_kn (pg.pj, "addr", str->vaddr);
+			pj_kn (pg.pj, "paddr", str->paddr);
+			pj_ks (pg.pj, "string", str->string);
+			pj_end (pg.pj);
+		} else if (take) {
+			r_strbuf_appendf (pg.sb, "%s\n", str->string);
+		}
+	}
+	return page_finish (&pg, tc, NULL);
+}
+
+// String scanner behind listAllStrings. The file is mapped, or read one
+// window at a time through r_io when it can not be, and every window is
+// cut in chunks scanned in parallel. A chunk owns the strings starting in
+// it: it reads past its end to complete them, and starts a bit before its
+// start to skip the ones owned by the previous chunk. Results are merged
+// back in file order.
+#define R2MCP_SCAN_CHUNK   (4 * 1024 * 1024)
+#define R2MCP_SCAN_THREADS 8
+#define R2MCP_STRING_MAX   1024
+#define R2MCP_SCAN_OVERLAP (4 * R2MCP_STRING_MAX)
+
+#define R2MCP_ENC_ASCII 1
+#define R2MCP_ENC_UTF8  2
+#define R2MCP_ENC_WIDE  4 // UTF-16LE
+#define R2MCP_ENC_ALL   (R2MCP_ENC_ASCII | R2MCP_ENC_UTF8 | R2MCP_ENC_WIDE)
+
+typedef struct {
+	const ut8 *data; // file bytes from base on
+	ut64 base;
+	ut64 len;
+	int min;
+	int enc;
+	int limit;
+	const R2McpFilter *filter;
+} R2McpScan;
+
+typedef struct {
+	const R2McpScan *scan;
+	ut64 from;  // where the scan starts
+	ut64 start; // strings starting in [start, end) belong to the chunk
+	ut64 end;
+	RStrBuf *sb; // strings found, one per line
+	ut64 *offsets;
+	int count;
+} R2McpScanChunk;
+
+static inline bool scan_printable(ut8 c) {
+	return (c >= 0x20 && c < 0x7f) || c == '\t';
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+// Bit mask of the printable ASCII bytes among the 16 at p, with the bytes
+// using the high bit added when looking for UTF-8
+static inline int scan_mask16(const ut8 *p, bool high) {
+	const __m128i v = _mm_loadu_si128 ((const __m128i *)p);
+	// signed compares, so the bytes >= 0x80 are below 0x20
+	const __m128i lo = _mm_cmpgt_epi8 (v, _mm_set1_epi8 (0x1f));
+	const __m128i hi = _mm_cmplt_epi8 (v, _mm_set1_epi8 (0x7f));
+	const __m128i tab = _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\t'));
+	const int m = _mm_movemask_epi8 (_mm_or_si128 (_mm_and_si128 (lo, hi), tab));
+	return high ? m | _mm_movemask_epi8 (v) : m;
+}
+#endif
+
+// Skip to the next byte that can start a string
+static ut64 scan_skip(const R2McpScan *sc, ut64 at, ut64 end) {
+	const bool high = sc->enc & R2MCP_ENC_UTF8;
+#if defined(__SSE2__)
+	while (at + 16 <= end) {
+		const int m = scan_mask16 (sc->data + at - sc->base, high);
+		if (m) {
+			return at + __builtin_ctz (m);
+		}
+		at += 16;
+	}
+#endif
+	while (at < end) {
+		const ut8 c = sc->data[at - sc->base];
+		if (scan_printable (c) || (high && c >= 0x80)) {
+			break;
+		}
+		at++;
+	}
+	return at;
+}
+
+// Read the string at the given offset into str, returning where it ends
+// and its length in characters through chars
+static ut64 scan_run(const R2McpScan *sc, ut64 at, char *str, int *size, int *chars) {
+	const ut8 *d = sc->data - sc->base;
+	const ut64 end = sc->base + sc->len;
+	int n = 0;
+	int nc = 0;
+	if ((sc->enc & R2MCP_ENC_WIDE) && at + 3 < end && scan_printable (d[at]) && !d[at + 1]
+		&& scan_printable (d[at + 2]) && !d[at + 3]) {
+		while (at + 1 < end && scan_printable (d[at]) && !d[at + 1]) {
+			if (n < R2MCP_STRING_MAX) {
+				str[n++] = d[at];
+			}
+			nc++;
+			at += 2;
+		}
+	} else if (sc->enc & (R2MCP_ENC_ASCII | R2MCP_ENC_UTF8)) {
+		const bool utf8 = sc->enc & R2MCP_ENC_UTF8;
+		while (at < end) {
+#if defined(__SSE2__)
+			if (at + 16 <= end && n + 16 <= R2MCP_STRING_MAX && scan_mask16 (d + at, false) == 0xffff) {
+				memcpy (str + n, d + at, 16);
+				n += 16;
+				nc += 16;
+				at += 16;
+				continue;
+			}
+#endif
+			int len = scan_printable (d[at]) ? 1 : 0;
+			if (!len && utf8) {
+				len = utf8_seq_len (d + at, end - at);
+			}
+			if (!len) {
+				break;
+			}
+			if (n + len <= R2MCP_STRING_MAX) {
+				memcpy (str + n, d + at, len);
+				n += len;
+			}
+			nc++;
+			at += len;
+		}
+		if (!(sc->enc & R2MCP_ENC_ASCII) && n == nc) {
+			// only UTF-8 was asked for and this one is plain ASCII
+			nc = 0;
+		}
+	}
+	*size = n;
+	*chars = nc;
+	return at;
+}
+
+static void *scan_chunk(void *arg) {
+	R2McpScanChunk *c = arg;
+	const R2McpScan *sc = c->scan;
+	char str[R2MCP_STRING_MAX + 1];
+	ut64 at = c->from;
+	c->sb = r_strbuf_new ("");
+	c->offsets = R_NEWS (ut64, sc->limit + 1);
+	// one more than a page, to know whether there is a next one
+	while (c->count <= sc->limit) {
+		at = scan_skip (sc, at, c->end);
+		if (at >= c->end) {
+			break;
+		}
+		int size, chars;
+		const ut64 next = scan_run (sc, at, str, &size, &chars);
+		if (chars >= sc->min && at >= c->start) {
+			str[size] = 0;
+			if (filter_match (sc->filter, str)) {
+				c->offsets[c->count++] = at;
+				r_strbuf_appendf (c->sb, "%s\n", str);
+			}
+		}
+		at = next > at ? next : at + 1;
+	}
+	return NULL;
+}
+
+// Scan the window [start, end) of the data in parallel and move its
+// strings to the page. Returns false once the page is full, with the
+// offset of the first string left out in next
+static bool scan_window(const R2McpScan *sc, ut64 start, ut64 end, bool first, R2McpPage *pg, ut64 *next) {
+	R2McpScanChunk chunks[R2MCP_SCAN_THREADS];
+	pthread_t th[R2MCP_SCAN_THREADS];
+	bool started[R2MCP_SCAN_THREADS] = { 0 };
+	const ut64 span = end - start;
+	int n = (int)R_MIN ((ut64)R2MCP_SCAN_THREADS, (span + R2MCP_SCAN_CHUNK - 1) / R2MCP_SCAN_CHUNK);
+	n = R_MAX (n, 1);
+	int i;
+	for (i = 0; i < n; i++) {
+		R2McpScanChunk *c = &chunks[i];
+		memset (c, 0, sizeof (*c));
+		c->scan = sc;
+		c->start = start + span * i / n;
+		c->end = (i == n - 1) ? end : start + span * (i + 1) / n;
+		// the cursor of the first window is the start of a string
+		c->from = (i == 0 && first) ? c->start : R_MAX (sc->base, c->start - R_MIN (c->start, R2MCP_SCAN_OVERLAP));
+	}
+	for (i = 1; i < n; i++) {
+		started[i] = !pthread_create (&th[i], NULL, scan_chunk, &chunks[i]);
+	}
+	scan_chunk (&chunks[0]);
+	bool full = false;
+	for (i = 0; i < n; i++) {
+		R2McpScanChunk *c = &chunks[i];
+		if (i > 0) {
+			if (started[i]) {
+				pthread_join (th[i], NULL);
+			} else {
+				scan_chunk (c);
+			}
+		}
+		const char *s = r_strbuf_get (c->sb);
+		int k;
+		for (k = 0; k < c->count && !full; k++) {
+			const char *nl = strchr (s, '\n');
+			if (pg->count == pg->limit) {
+				pg->more = true;
+				*next = c->offsets[k];
+				full = true;
+				break;
+			}
+			if (pg->pj) {
+				char str[R2MCP_STRING_MAX + 1];
+				r_str_ncpy (str, s, R_MIN ((size_t)(nl - s + 1), sizeof (str)));
+				pj_o (pg->pj);
+				pj_kn (pg->pj, "paddr", c->offsets[k]);
+				pj_ks (pg->pj, "string", str);
+				pj_end (pg->pj);
+			} else {
+				r_strbuf_append_n (pg->sb, s, nl - s + 1);
+			}
+			pg->count++;
+			s = nl + 1;
+		}
+		r_strbuf_free (c->sb);
+		free (c->offsets);
+	}
+	return !full;
+}
+
+static int scan_encoding(const char *name) {
+	if (R_STR_ISEMPTY (name) || !strcmp (name, "all")) {
+		return R2MCP_ENC_ALL;
+	}
+	if (!strcmp (name, "ascii")) {
+		return R2MCP_ENC_ASCII;
+	}
+	// only the strings with multibyte characters, ascii has the rest
+	if (!strcmp (name, "utf8")) {
+		return R2MCP_ENC_UTF8;
+	}
+	if (!strcmp (name, "utf16le") || !strcmp (name, "wide")) {
+		return R2MCP_ENC_WIDE;
+	}
+	return 0;
+}
+
+static char *tool_list_all_strings(R2McpToolCall *tc) {
+	R2McpPage pg;
+	const int enc = scan_encoding (r_json_get_str (tc->args, "encoding"));
+	if (!enc) {
+		return create_tool_text_response ("Unknown encoding, use ascii, utf8, utf16le or all");
+	}
+	if (!page_init (&pg, tc)) {
+		return create_tool_text_response ("Invalid regular expression");
+	}
+	RCore *core = tc->ss->core;
+	// the cursor is a file offset here, nothing to skip
+	const ut64 from = pg.skip;
+	pg.skip = 0;
+	int min = r_json_get_num (tc->args, "minLength");
+	if (min < 1) {
+		min = r_config_get_i (core->config, "bin.str.min");
+	}
+	if (min < 1) {
+		min = 4;
+	}
+	R2McpScan sc = { .min = min, .enc = enc, .limit = pg.limit, .filter = &pg.filter };
+	const ut64 window = (ut64)R2MCP_SCAN_CHUNK * R2MCP_SCAN_THREADS;
+	ut64 next = 0;
+	RMmap *map = r_file_mmap (tc->ss->path, false, 0);
+	if (map && map->buf) {
+		sc.data = map->buf;
+		sc.len = map->len;
+		ut64 at;
+		for (at = from; at < sc.len; at += window) {
+			if (!scan_window (&sc, at, R_MIN (at + window, sc.len), at == from, &pg, &next)) {
+				break;
+			}
+		}
+	} else {
+		// not a local file, read the windows through r_io
+		const ut64 size = r_io_size (core->io);
+		ut8 *buf = malloc (R2MCP_SCAN_OVERLAP + window + R2MCP_SCAN_OVERLAP);
+		ut64 at;
+		for (at = from; buf && at < size; at += window) {
+			sc.base = at - R_MIN (at, (ut64)R2MCP_SCAN_OVERLAP);
+			sc.len = R_MIN (size, at + window + R2MCP_SCAN_OVERLAP) - sc.base;
+			if (r_io_pread_at (core->io, sc.base, buf, (int)sc.len) < 1) {
+				break;
+			}
+			sc.data = buf;
+			if (!scan_window (&sc, at, R_MIN (at + window, size), at == from, &pg, &next)) {
+				break;
+			}
+		}
+		free (buf);
+	}
+	r_file_mmap_free (map);
+	char cursor[32];
+	snprintf (cursor, sizeof (cursor), "0x%" PFMT64x, next);
+	return page_finish (&pg, tc, cursor);
+}
+
+#if 0
+static char *tool_run_command(R2McpToolCall *tc) {
+	const char *command = r_json_get_str (tc->args, "command");
+	if (!command) {
+		return create_error_response (-32602, "Missing required parameter: command", NULL, NULL);
+	}
+
+	char *result = r2_cmd (tc->ss, command);
+	char *response = create_tool_text_response (result);
+	free (result);
+	return response;
+}
+#endif
+
+// The edits are run and persisted as commands, so only a resolved address
+// and validated text from the client reach them
+static bool r2_edit_address(R2McpSession *ss, const char *address, ut64 *addr) {
+	*addr = r_num_math (ss->core->num, address);
+	return *addr || *address == '0';
+}
+
+// Types, names, pointers, arrays and argument lists, nothing the radare2
+// shell gives a meaning to
+static bool r2_edit_prototype_valid(const char *prototype) {
+	const char *p;
+	for (p = prototype; *p; p++) {
+		if (!isalnum ((ut8)*p) && !strchr (" _*(),[].:", *p)) {
+			return false;
+		}
+	}
+	return p != prototype;
+}
+
+static char *tool_set_comment(R2McpToolCall *tc) {
+	const char *address = r_json_get_str (tc->args, "address");
+	const char *message = r_json_get_str (tc->args, "message");
+	if (!address || !message) {
+		return create_error_response (-32602, "Missing required parameters: address and message", NULL, NULL);
+	}
+
+	ut64 addr;
+	if (!r2_edit_address (tc->ss, address, &addr)) {
+		return create_error_response (-32602, "Invalid address", NULL, NULL);
+	}
+	// the comment is free text, radare2 decodes it back
+	char *b64 = r_base64_encode_dyn ((const ut8 *)message, (int)strlen (message));
+	char *cmd = arena_newf ("'@0x%" PFMT64x "'CC base64:%s", addr, r_str_get (b64));
+	free (b64);
+	r2_mutate (tc->ss, cmd, true);
+	decomp_forget (tc->ss, addr);
+	return strdup ("ok");
+}
+
+static char *tool_set_function_prototype(R2McpToolCall *tc) {
+	const char *address = r_json_get_str (tc->args, "address");
+	const char *prototype = r_json_get_str (tc->args, "prototype");
+	if (!address || !prototype) {
+		return create_error_response (-32602, "Missing required parameters: address and prototype", NULL, NULL);
+	}
+	ut64 addr;
+	if (!r2_edit_address (tc->ss, address, &addr)) {
+		return create_error_response (-32602, "Invalid address", NULL, NULL);
+	}
+	if (!r2_edit_prototype_valid (prototype)) {
+		return create_error_response (-32602, "Invalid prototype", NULL, NULL);
+	}
+	char *cmd = arena_newf ("'@0x%" PFMT64x "'afs %s", addr, prototype);
+	r2_mutate (tc->ss, cmd, true);
+	dirty_mark_function (tc->ss, address);
+	return strdup ("ok");
+}
+
+static char *tool_get_function_prototype(R2McpToolCall *tc) {
+	const char *address = r_json_get_str (tc->args, "address");
+	if (!address) {
+		return create_error_response (-32602, "Missing required parameters: address", NULL, NULL);
+	}
+	char *s = arena_newf ("'@%s'afs", address);
+	char *res = r2_cmd (tc->ss, s);
+	return res;
+}
+
+static char *tool_analyze(R2McpToolCall *tc) {
+	R2McpSession *ss = tc->ss;
+	const int level = r_json_get_num (tc->args, "level");
+	const bool full = r_json_get_num (tc->args, "full");
+	// before any cache lookup, out of range levels would match or name one
+	if (!r2_analysis_level_valid (level)) {
+		return create_error_response (-32602, R2MCP_LEVEL_ERROR, NULL, NULL);
+	}
+	char token_buf[32];
+	const RJson *meta = r_json_get (tc->params, "_meta");
+	const char *token = meta ? json_id_tostring (r_json_get (meta, "progressToken"), token_buf, sizeof (token_buf)) : NULL;
+	pthread_mutex_lock (&pool.lock);
+	const bool running = ss->analysis && ss->analysis->state == R2MCP_ANALYSIS_RUNNING;
+	pthread_mutex_unlock (&pool.lock);
+	if (running) {
+		return create_tool_text_response ("An analysis is already running in the background, use analysisStatus");
+	}
+	if (!full && level <= ss->level && !r_list_empty (ss->dirty)) {
+		const int edited = r_list_length (ss->dirty);
+		const int count = r2_analyze_dirty (ss);
+		session_measure (ss);
+		if (!ss->core->cons->context->breaked && ss->cache_level >= 0) {
+			session_cache_save (ss, ss->cache_level);
+		}
+		char *text = r_str_newf ("Incremental analysis of %d functions, the %d edited since the last analysis "
+			"and their callers and callees.\nUse full to rerun the whole level %d analysis.", count, edited, level);
+		char *response = create_tool_text_response (text);
+		free (text);
+		return response;
+	}
+	// full reruns the analysis even when the cache already has that level
+	if (!full && level <= ss->cache_level) {
+		char *text = r_str_newf ("Analysis with level %d loaded from the cache.", ss->cache_level);
+		char *response = create_tool_text_response (text);
+		free (text);
+		return response;
+	}
+	if (r_json_get_num (tc->args, "background")) {
+		const char *error = r2_analyze_background (ss, level, token);
+		if (error) {
+			return create_error_response (-32603, error, NULL, NULL);
+		}
+		char *text = r_str_newf ("Analysis with level %d started in the background.\n"
+			"Use analysisStatus to follow it, the other tools keep working meanwhile.", level);
+		char *response = create_tool_text_response (text);
+		free (text);
+		return response;
+	}
+	r2_analyze (ss, level, token);
+	if (!ss->core->cons->context->breaked) {
+		ss->level = R_MAX (ss->level, level);
+		// an interrupted analysis is not worth caching
+		session_cache_save (ss, level);
+		pthread_mutex_lock (&pool.lock);
+		prefetch_request_locked (ss);
+		pthread_mutex_unlock (&pool.lock);
+	}
+	char *result = r2_cmd (ss, "aflc");
+	char *text = r_str_newf ("Analysis completed with level %d.\n\nfound %d functions", level, atoi (result));
+	char *response = create_tool_text_response (text);
+	free (result);
+	free (text);
+	return response;
+}
+
+static char *tool_cache_stats(R2McpToolCall *tc) {
+	R2McpSession *ss = tc->ss;
+	const ut64 total = ss->memo_hits + ss->memo_misses;
+	char *res = r_str_newf ("session: %u\nhits: %" PFMT64u "\nmisses: %" PFMT64u "\nhit_rate: %.1f%%\n"
+		"entries_bytes: %zu\ngeneration: %" PFMT64u "\n"
+		"total_hits: %" PFMT64u "\ntotal_misses: %" PFMT64u "\n"
+		"decompiled_hits: %" PFMT64u "\ndecompiled_misses: %" PFMT64u "\ndecompiled_bytes: %zu",
+		ss->id, ss->memo_hits, ss->memo_misses, total ? 100.0 * ss->memo_hits / total : 0.0,
+		ss->memo_bytes, ss->generation, memo_hits, memo_misses,
+		ss->decomp_hits, ss->decomp_misses, ss->decomp_bytes);
+	char *response = create_tool_text_response (res);
+	free (res);
+	return response;
+}
+
+static char *tool_analysis_status(R2McpToolCall *tc) {
+	const bool wait = r_json_get_num (tc->args, "wait");
+	const bool cancel = r_json_get_num (tc->args, "cancel");
+	int timeout = r_json_get_num (tc->args, "timeout");
+	if (timeout <= 0) {
+		timeout = 30;
+	}
+	char *res = r2_analysis_status (tc->ss, wait, timeout, cancel);
+	char *response = create_tool_text_response (res);
+	free (res);
+	return response;
+}
+
+// Analyses split by the shard coordinator: shardRanges cuts the code of
+// the file in parts, shardAnalyze runs on one part in each shard, and the
+// shard owning the session adds what the others found with shardMerge
+typedef struct {
+	ut64 from;
+	ut64 to;
+} R2McpRange;
+
+static int shard_range_cmp(const void *a, const void *b) {
+	const R2McpRange *ra = a;
+	const R2McpRange *rb = b;
+	return ra->from < rb->from ? -1 : ra->from > rb->from;
+}
+
+// One "part from to" line per range, parts of about the same size that may
+// span several sections
+static char *tool_shard_ranges(R2McpToolCall *tc) {
+	RCore *core = tc->ss->core;
+	const int parts = R_MAX ((int)r_json_get_num (tc->args, "parts"), 1);
+	RList *sections = r_bin_get_sections (core->bin);
+	R2McpRange *ranges = R_NEWS0 (R2McpRange, r_list_length (sections) + 1);
+	size_t n = 0;
+	int pass;
+	// the executable sections, or the segments when there are none
+	for (pass = 0; pass < 2 && !n; pass++) {
+		RListIter *iter;
+		RBinSection *sec;
+		r_list_foreach (sections, iter, sec) {
+			if ((sec->perm & R_PERM_X) && sec->vsize && sec->is_segment == (pass == 1)) {
+				ranges[n].from = sec->vaddr;
+				ranges[n].to = sec->vaddr + sec->vsize;
+				n++;
+			}
+		}
+	}
+	qsort (ranges, n, sizeof (R2McpRange), shard_range_cmp);
+	size_t i, m = 0;
+	ut64 total = 0;
+	for (i = 0; i < n; i++) {
+		if (m && ranges[i].from <= ranges[m - 1].to) {
+			ranges[m - 1].to = R_MAX (ranges[m - 1].to, ranges[i].to);
+		} else {
+			ranges[m++] = ranges[i];
+		}
+	}
+	for (i = 0; i < m; i++) {
+		total += ranges[i].to - ranges[i].from;
+	}
+	if (!total) {
+		free (ranges);
+		return create_error_response (-32000, "No executable sections to split", NULL, NULL);
+	}
+	const ut64 quota = total / parts + 1;
+	RStrBuf *sb = r_strbuf_new ("");
+	ut64 left = quota;
+	int part = 0;
+	for (i = 0; i < m; i++) {
+		ut64 at = ranges[i].from;
+		while (at < ranges[i].to) {
+			const ut64 size = R_MIN (ranges[i].to - at, left);
+			r_strbuf_appendf (sb, "%d 0x%" PFMT64x " 0x%" PFMT64x "\n", part, at, at + size);
+			at += size;
+			left -= size;
+			if (!left) {
+				part++;
+				left = quota;
+			}
+		}
+	}
+	free (ranges);
+	char *text = r_strbuf_drain (sb);
+	char *o = create_tool_text_response (text);
+	free (text);
+	return o;
+}
+
+static bool shard_range_has(const R2McpRange *ranges, size_t n, ut64 addr) {
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (addr >= ranges[i].from && addr < ranges[i].to) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Analyze the "from-to,..." ranges only and print the functions starting
+// in them ("f addr name") and the references they make ("x from to type")
+static char *tool_shard_analyze(R2McpToolCall *tc) {
+	R2McpSession *ss = tc->ss;
+	RCore *core = ss->core;
+	const char *spec = r_json_get_str (tc->args, "ranges");
+	if (!spec) {
+		return create_error_response (-32602, "Missing required parameter: ranges", NULL, NULL);
+	}
+	const int level = (int)r_json_get_num (tc->args, "level");
+	if (!r2_analysis_level_valid (level)) {
+		return create_error_response (-32602, R2MCP_LEVEL_ERROR, NULL, NULL);
+	}
+	R2McpRange *ranges = NULL;
+	size_t n = 0;
+	while (*spec) {
+		char *end;
+		const ut64 from = strtoull (spec, &end, 0);
+		if (*end != '-') {
+			break;
+		}
+		const ut64 to = strtoull (end + 1, &end, 0);
+		R2McpRange *r = realloc (ranges, (n + 1) * sizeof (R2McpRange));
+		if (!r) {
+			break;
+		}
+		ranges = r;
+		ranges[n].from = from;
+		ranges[n].to = to;
+		n++;
+		spec = *end == ',' ? end + 1 : "";
+	}
+	// one pass over the span of all the ranges, so the symbols are not
+	// analyzed again for each of them. The shard ranges of a part are
+	// consecutive, and only what starts in them is listed. anal.in is
+	// restored after
+	ut64 lo = UT64_MAX, hi = 0;
+	size_t i;
+	for (i = 0; i < n; i++) {
+		lo = R_MIN (lo, ranges[i].from);
+		hi = R_MAX (hi, ranges[i].to);
+	}
+	RConfig *cfg = core->config;
+	const char *in = r_config_get (cfg, "anal.in");
+	char *saved = strdup (in ? in : "io.maps.x");
+	const ut64 from = r_config_get_i (cfg, "anal.from");
+	const ut64 to = r_config_get_i (cfg, "anal.to");
+	r_config_set (cfg, "anal.in", "range");
+	if (n > 0) {
+		r_config_set_i (cfg, "anal.from", lo);
+		r_config_set_i (cfg, "anal.to", hi);
+		r2_analyze (ss, level, NULL);
+	}
+	r_config_set (cfg, "anal.in", saved);
+	r_config_set_i (cfg, "anal.from", from);
+	r_config_set_i (cfg, "anal.to", to);
+	free (saved);
+	RStrBuf *sb = r_strbuf_new ("");
+	RListIter *iter;
+	RAnalFunction *fcn;
+	r_list_foreach (core->anal->fcns, iter, fcn) {
+		if (!shard_range_has (ranges, n, fcn->addr)) {
+			continue;
+		}
+		r_strbuf_appendf (sb, "f 0x%" PFMT64x " %s\n", fcn->addr, fcn->name);
+		RAnalRef *ref;
+		RVecAnalRef *refs = r_anal_function_get_refs (fcn);
+		if (refs) {
+			R_VEC_FOREACH (refs, ref) {
+				r_strbuf_appendf (sb, "x 0x%" PFMT64x " 0x%" PFMT64x " %d\n", ref->at, ref->addr, (int)ref->type);
+			}
+			RVecAnalRef_free (refs);
+		}
+	}
+	free (ranges);
+	char *text = r_strbuf_drain (sb);
+	char *o = create_tool_text_response (text);
+	free (text);
+	return o;
+}
+
+// Add the functions and references the other shards listed with
+// shardAnalyze, the session then counts as analyzed at level
+static char *tool_shard_merge(R2McpToolCall *tc) {
+	R2McpSession *ss = tc->ss;
+	RCore *core = ss->core;
+	RAnal *anal = core->anal;
+	const int level = (int)r_json_get_num (tc->args, "level");
+	const int parts = (int)r_json_get_num (tc->args, "parts");
+	const char *data = r_json_get_str (tc->args, "data");
+	if (!r2_analysis_level_valid (level)) {
+		return create_error_response (-32602, R2MCP_LEVEL_ERROR, NULL, NULL);
+	}
+	ss->generation++;
+	decomp_clear (ss);
+	dirty_clear (ss);
+	char *copy = strdup (data ? data : "");
+	char *line = copy;
+	while (line && *line && !core->cons->context->breaked) {
+		char *nl = strchr (line, '\n');
+		if (nl) {
+			*nl = 0;
+		}
+		char *end;
+		if (r_str_startswith (line, "f ")) {
+			const ut64 addr = strtoull (line + 2, &end, 0);
+			RAnalFunction *fcn = r_anal_get_function_at (anal, addr);
+			if (!fcn) {
+				char *cmd = arena_newf ("'@0x%08" PFMT64x "'af", addr);
+				r_core_cmd0 (core, cmd);
+				fcn = r_anal_get_function_at (anal, addr);
+			}
+			// names given by the analysis, not the fcn.ADDR placeholders
+			const char *name = *end == ' ' ? end + 1 : "";
+			if (fcn && *name && !r_str_startswith (name, "fcn.") && strcmp (fcn->name, name)) {
+				r_anal_function_rename (fcn, name);
+			}
+		} else if (r_str_startswith (line, "x ")) {
+			const ut64 from = strtoull (line + 2, &end, 0);
+			const ut64 to = strtoull (end, &end, 0);
+			r_anal_xrefs_set (anal, from, to, (int)strtol (end, NULL, 10));
+		}
+		line = nl ? nl + 1 : NULL;
+	}
+	free (copy);
+	session_measure (ss);
+	if (!core->cons->context->breaked) {
+		ss->level = R_MAX (ss->level, level);
+		session_cache_save (ss, level);
+		pthread_mutex_lock (&pool.lock);
+		prefetch_request_locked (ss);
+		pthread_mutex_unlock (&pool.lock);
+	}
+	char *text = r_str_newf ("Analysis completed with level %d, split in %d parts.\n\nfound %d functions",
+		level, parts, r_list_length (anal->fcns));
+	char *o = create_tool_text_response (text);
+	free (text);
+	return o;
+}
+
+// Disassembly pages are numInstructions long, the cursor is the address
+// following the last instruction shown
+static char *tool_disassemble(R2McpToolCall *tc) {
+	const char *address = r_json_get_str (tc->args, "cursor");
+	if (!address) {
+		address = r_json_get_str (tc->args, "address");
+	}
+	if (!address) {
+		return create_error_response (-32602, "Missing required parameter: address", NULL, NULL);
+	}
+
+	// Use const_cast pattern
+	RJson *num_instr_json = (RJson *)r_json_get (tc->args, "numInstructions");
+	int num_instructions = 10;
+	if (num_instr_json && num_instr_json->type == R_JSON_INTEGER) {
+		num_instructions = R_MAX (1, R_MIN ((int)num_instr_json->num.u_value, R2MCP_PAGE_MAX));
+	}
+
+	RCore *core = tc->ss->core;
+	const bool json = tool_json (tc);
+	const ut64 addr = r_num_math (core->num, address);
+	if (!r_json_get_str (tc->args, "cursor")) {
+		dirty_mark_code (tc->ss, addr);
+	}
+	char *cmd = arena_newf ("'@0x%" PFMT64x "'pd%s %d", addr, json ? "j" : "", num_instructions);
+	char *disasm = r2_cmd (tc->ss, cmd);
+	ut64 next = addr;
+	int i;
+	for (i = 0; i < num_instructions; i++) {
+		RAnalOp *op = r_core_anal_op (core, next, R_ANAL_OP_MASK_BASIC);
+		next += (op && op->size > 0) ? op->size : 1;
+		r_anal_op_free (op);
+	}
+	char buf[32];
+	snprintf (buf, sizeof (buf), "0x%" PFMT64x, next);
+	if (json) {
+		r_str_trim (disasm);
+		PJ *pj = pj_new ();
+		pj_o (pj);
+		pj_k (pj, "items");
+		pj_raw (pj, *disasm == '[' ? disasm : "[]");
+		pj_ks (pj, "nextCursor", buf);
+		pj_end (pj);
+		char *text = r_str_newf ("%d instructions in structuredContent, next at %s", num_instructions, buf);
+		char *response = create_tool_json_response (pj_string (pj), text);
+		pj_free (pj);
+		free (text);
+		free (disasm);
+		return response;
+	}
+	RStrBuf *sb = r_strbuf_new (disasm);
+	page_footer (sb, buf);
+	char *text = r_strbuf_drain (sb);
+	char *response = create_tool_text_response (text);
+	free (disasm);
+	free (text);
+	return response;
+}
+
+static char *tool_use_decompiler(R2McpToolCall *tc) {
+	R2McpSession *ss = tc->ss;
+	const char *deco = r_json_get_str (tc->args, "useDecompiler");
+	if (!deco) {
+		return create_error_response (-32602, "Missing required parameter: address", NULL, NULL);
+	}
+	char *decompilersAvailable = r_core_cmd_str (ss->core, "e cmd.pdc=?");
+	const char *response = "ok";
+	if (strstr (deco, "ghidra")) {
+		if (strstr (decompilersAvailable, "pdg")) {
+			r2_mutate (ss, "-e cmd.pdc=pdg", false);
+		} else {
+			response = "This decompiler is not available";
+		}
+	} else if (strstr (deco, "decai")) {
+		if (strstr (decompilersAvailable, "decai")) {
+			r2_mutate (ss, "-e cmd.pdc=decai -d", false);
+		} else {
+			response = "This decompiler is not available";
+		}
+	} else if (strstr (deco, "r2dec")) {
+		if (strstr (decompilersAvailable, "pdd")) {
+			r2_mutate (ss, "-e cmd.pdc=pdd", false);
+		} else {
+			response = "This decompiler is not available";
+		}
+	} else {
+		response = "Unknown decompiler";
+	}
+	free (decompilersAvailable);
+	return create_tool_text_response (response);
+}
+
+// Tools running a fixed command at the given address
+// Once the session index is built, names are resolved through it so
+// radare2 only parses a plain number
+static const char *tool_at(R2McpToolCall *tc, const char *address, char *buf, size_t len) {
+	R2McpIndex *ix = tc->ss->index;
+	if (ix && ix->generation == tc->ss->generation) {
+		bool found = false;
+		const ut64 addr = ht_pu_find (ix->names, address, &found);
+		if (found) {
+			snprintf (buf, len, "0x%08" PFMT64x, addr);
+			return buf;
+		}
+	}
+	return address;
+}
+
+static char *tool_cmd_at(R2McpToolCall *tc) {
+	const char *address = r_json_get_str (tc->args, "address");
+	if (!address) {
+		return create_error_response (-32602, "Missing required parameter: address", NULL, NULL);
+	}
+	char buf[32];
+	address = tool_at (tc, address, buf, sizeof (buf));
+	if (tc->tool->jcmd && tool_json (tc)) {
+		char *cmd = arena_newf ("'@%s'%s", address, tc->tool->jcmd);
+		char *response = tool_json_cmd (tc, cmd);
+		return response;
+	}
+	char *cmd = arena_newf ("'@%s'%s", address, tc->tool->cmd);
+	char *disasm = r2_cmd (tc->ss, cmd);
+	char *response = create_tool_text_response (disasm);
+	free (disasm);
+	return response;
+}
+
+// Shared by xrefsTo and xrefsFrom, answered from the session index for
+// one address or a whole list of them
+static char *tool_xrefs(R2McpToolCall *tc, bool to) {
+	const RJson *list = r_json_get (tc->args, "addresses");
+	const char *address = r_json_get_str (tc->args, "address");
+	if (!address && (!list || list->type != R_JSON_ARRAY || !list->children.count)) {
+		return create_error_response (-32602, "Missing required parameter: address or addresses", NULL, NULL);
+	}
+	R2McpSession *ss = tc->ss;
+	RAnal *anal = ss->core->anal;
+	R2McpIndex *ix = index_get (ss);
+	const R2McpXref *xrefs = to ? ix->by_to : ix->by_from;
+	const bool json = tool_json (tc);
+	PJ *pj = json ? pj_new () : NULL;
+	RStrBuf *sb = json ? NULL : r_strbuf_new ("");
+	size_t matches = 0;
+	if (pj) {
+		pj_o (pj);
+	}
+	const RJson *js = list && list->type == R_JSON_ARRAY ? list->children.first : NULL;
+	for (; address || js; js = js ? js->next : NULL) {
+		const char *at = address ? address : js->type == R_JSON_STRING ? js->str_value : NULL;
+		address = NULL;
+		if (!at) {
+			continue;
+		}
+		const ut64 addr = index_resolve (ss, ix, at);
+		char key[32];
+		snprintf (key, sizeof (key), "0x%08" PFMT64x, addr);
+		if (pj) {
+			pj_ka (pj, key);
+		} else {
+			const char *name = index_fcn_name (anal, addr);
+			r_strbuf_appendf (sb, "%s%s%s:\n", key, *name ? " " : "", name);
+		}
+		// references from a function are the ones made by its instructions
+		RAnalFunction *fcn = to ? NULL : r_anal_get_function_at (anal, addr);
+		const ut64 end = fcn ? r_anal_function_max_addr (fcn) : addr + 1;
+		size_t i = index_lower (xrefs, ix->count, fcn ? r_anal_function_min_addr (fcn) : addr, to);
+		size_t found = 0;
+		for (; i < ix->count && (to ? xrefs[i].to == addr : xrefs[i].from < end); i++) {
+			const R2McpXref *x = &xrefs[i];
+			if (fcn && !r_anal_function_contains (fcn, x->from)) {
+				continue;
+			}
+			const ut64 other = to ? x->from : x->to;
+			found++;
+			const char *type = r_anal_ref_type_tostring (x->type);
+			const char *name = index_fcn_name (anal, other);
+			if (pj) {
+				pj_o (pj);
+				pj_kn (pj, to ? "from" : "to", other);
+				pj_ks (pj, "type", type);
+				pj_ks (pj, "fcn", name);
+				pj_end (pj);
+			} else {
+				r_strbuf_appendf (sb, "  0x%08" PFMT64x " %s %s\n", other, type, name);
+			}
+		}
+		matches += found;
+		if (pj) {
+			pj_end (pj);
+		} else if (!found) {
+			r_strbuf_append (sb, "  none\n");
+		}
+	}
+	if (pj) {
+		pj_end (pj);
+		char *text = r_str_newf ("%zu references in structuredContent, keyed by address", matches);
+		char *response = create_tool_json_response (pj_string (pj), text);
+		free (text);
+		pj_free (pj);
+		return response;
+	}
+	char *text = r_strbuf_drain (sb);
+	char *response = create_tool_text_response (text);
+	free (text);
+	return response;
+}
+
+static char *tool_xrefs_to(R2McpToolCall *tc) {
+	return tool_xrefs (tc, true);
+}
+
+static char *tool_xrefs_from(R2McpToolCall *tc) {
+	return tool_xrefs (tc, false);
+}
+
+// Call graph export, from the edges of the session index: the whole graph
+// or the part reachable from root within depth calls. The compact format
+// is, for every edge sorted by caller, a varint of the caller minus the
+// previous caller and a zigzag varint of the callee minus the caller. It
+// is base64 encoded in chunks, or written raw to a file.
+#define R2MCP_GRAPH_CHUNK 50000
+#define R2MCP_GRAPH_ENCODING "varint(caller - previous caller) zigzag-varint(callee - caller) per edge, sorted by caller, the first caller of a chunk is relative to 0"
+
+// First edge leaving addr, or the one following its position
+static size_t graph_lower(const R2McpEdge *edges, size_t count, ut64 addr) {
+	size_t lo = 0, hi = count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (edges[mid].from < addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Edges reachable from root breadth first, down to depth calls or all of
+// them when depth is 0. Sorted like the index edges
+static R2McpEdge *graph_subgraph(R2McpIndex *ix, ut64 root, int depth, size_t *count) {
+	HtUP *seen = ht_up_new0 ();
+	size_t qcap = 64, qlen = 0, head = 0, ecap = 0, n = 0;
+	ut64 *queue = R_NEWS (ut64, qcap);
+	int *levels = R_NEWS (int, qcap);
+	R2McpEdge *edges = NULL;
+	queue[qlen] = root;
+	levels[qlen++] = 0;
+	ht_up_insert (seen, root, (void *)1);
+	while (head < qlen) {
+		const ut64 node = queue[head];
+		const int level = levels[head++];
+		if (depth > 0 && level >= depth) {
+			continue;
+		}
+		size_t i = graph_lower (ix->calls, ix->ncalls, node);
+		for (; i < ix->ncalls && ix->calls[i].from == node; i++) {
+			if (n == ecap) {
+				ecap = ecap ? ecap * 2 : 256;
+				edges = realloc (edges, ecap * sizeof (R2McpEdge));
+			}
+			edges[n++] = ix->calls[i];
+			const ut64 to = ix->calls[i].to;
+			if (!ht_up_insert (seen, to, (void *)1)) {
+				continue;
+			}
+			if (qlen == qcap) {
+				qcap *= 2;
+				queue = realloc (queue, qcap * sizeof (ut64));
+				levels = realloc (levels, qcap * sizeof (int));
+			}
+			queue[qlen] = to;
+			levels[qlen++] = level + 1;
+		}
+	}
+	ht_up_free (seen);
+	free (queue);
+	free (levels);
+	if (n > 0) {
+		qsort (edges, n, sizeof (R2McpEdge), index_cmp_edge);
+	}
+	*count = n;
+	return edges;
+}
+
+static size_t graph_varint(ut8 *out, ut64 v) {
+	size_t n = 0;
+	while (v >= 0x80) {
+		out[n++] = (ut8)(v | 0x80);
+		v >>= 7;
+	}
+	out[n++] = (ut8)v;
+	return n;
+}
+
+// out needs room for 20 bytes per edge
+static size_t graph_encode(const R2McpEdge *edges, size_t count, ut8 *out) {
+	size_t i, len = 0;
+	ut64 prev = 0;
+	for (i = 0; i < count; i++) {
+		const st64 d = (st64)(edges[i].to - edges[i].from);
+		len += graph_varint (out + len, edges[i].from - prev);
+		len += graph_varint (out + len, ((ut64)d << 1) ^ (ut64)(d >> 63));
+		prev = edges[i].from;
+	}
+	return len;
+}
+
+static char *graph_compact(R2McpToolCall *tc, const R2McpEdge *edges, size_t count, const char *file) {
+	size_t start = 0, n = count;
+	if (!file) {
+		const char *cursor = r_json_get_str (tc->args, "cursor");
+		const int limit = r_json_get_num (tc->args, "limit");
+		start = cursor ? R_MIN ((size_t)r_num_get (NULL, cursor), count) : 0;
+		n = R_MIN (count - start, (size_t)(limit > 0 ? R_MIN (limit, R2MCP_GRAPH_CHUNK) : R2MCP_GRAPH_CHUNK));
+	}
+	ut8 *buf = malloc (n * 20 + 1);
+	if (!buf) {
+		return create_tool_text_response ("Not enough memory to encode the call graph");
+	}
+	const size_t len = graph_encode (edges + start, n, buf);
+	RStrBuf *sb = r_strbuf_new ("");
+	if (file) {
+		if (r_file_dump (file, buf, (int)len, false)) {
+			r_strbuf_appendf (sb, "%zu edges written to %s, %zu bytes\nencoding: %s", n, file, len, R2MCP_GRAPH_ENCODING);
+		} else {
+			r_strbuf_appendf (sb, "Cannot write %s", file);
+		}
+	} else {
+		char *b64 = r_base64_encode_dyn (buf, (int)len);
+		r_strbuf_appendf (sb, "edges: %zu of %zu, from %zu\nencoding: %s\ndata: %s", n, count, start, R2MCP_GRAPH_ENCODING, r_str_get (b64));
+		free (b64);
+		if (start + n < count) {
+			char next[32];
+			snprintf (next, sizeof (next), "%zu", start + n);
+			page_footer (sb, next);
+		}
+	}
+	free (buf);
+	char *text = r_strbuf_drain (sb);
+	char *response = create_tool_text_response (text);
+	free (text);
+	return response;
+}
+
+static char *graph_page(R2McpToolCall *tc, RAnal *anal, const R2McpEdge *edges, size_t count) {
+	R2McpPage pg;
+	if (!page_init (&pg, tc)) {
+		return create_tool_text_response ("Invalid regular expression");
+	}
+	size_t i;
+	for (i = 0; i < count; i++) {
+		const char *from = index_fcn_name (anal, edges[i].from);
+		const int take = page_take (&pg, from);
+		if (take < 0) {
+			break;
+		}
+		if (take && pg.pj) {
+			pj_o (pg.pj);
+			pj_kn (pg.pj, "from", edges[i].from);
+			pj_kn (pg.pj, "to", edges[i].to);
+			pj_end (pg.pj);
+		} else if (take) {
+			r_strbuf_appendf (pg.sb, "0x%08" PFMT64x " %s -> 0x%08" PFMT64x " %s\n",
+				edges[i].from, from, edges[i].to, index_fcn_name (anal, edges[i].to));
+		}
+	}
+	if (!pg.pj && pg.count == 0 && !pg.more) {
+		r_strbuf_append (pg.sb, "No calls found");
+	}
+	return page_finish (&pg, tc, NULL);
+}
+
+static char *tool_call_graph(R2McpToolCall *tc) {
+	R2McpSession *ss = tc->ss;
+	RAnal *anal = ss->core->anal;
+	R2McpIndex *ix = index_get (ss);
+	const char *root = r_json_get_str (tc->args, "root");
+	const char *format = r_json_get_str (tc->args, "format");
+	const char *file = r_json_get_str (tc->args, "file");
+	const R2McpEdge *edges = ix->calls;
+	size_t count = ix->ncalls;
+	R2McpEdge *sub = NULL;
+	if (root) {
+		RAnalFunction *fcn = r_anal_get_fcn_in (anal, index_resolve (ss, ix, root), 0);
+		if (!fcn) {
+			return create_error_response (-32602, "No function found at root", NULL, NULL);
+		}
+		const int depth = (int)r_json_get_num (tc->args, "depth");
+		sub = graph_subgraph (ix, fcn->addr, depth, &count);
+		edges = sub;
+	}
+	char *response = (file || (format && !strcmp (format, "compact")))
+		? graph_compact (tc, edges, count, file)
+		: graph_page (tc, anal, edges, count);
+	free (sub);
+	return response;
+}
+
+static char *tool_decompile_function(R2McpToolCall *tc) {
+	const char *address = r_json_get_str (tc->args, "address");
+	if (!address) {
+		return create_error_response (-32602, "Missing required parameter: address", NULL, NULL);
+	}
+	char *text = decomp_function (tc->ss, address);
+	char *response = create_tool_text_response (text);
+	free (text);
+	return response;
+}
+
+// Decompile a list of functions, the ones not in the cache are spread over
+// up to jobs helper threads
+static char *tool_decompile_functions(R2McpToolCall *tc) {
+	const RJson *addresses = r_json_get (tc->args, "addresses");
+	if (!addresses || addresses->type != R_JSON_ARRAY || !addresses->children.count) {
+		return create_error_response (-32602, "Missing required parameter: addresses", NULL, NULL);
+	}
+	R2McpSession *ss = tc->ss;
+	RCore *core = ss->core;
+	const size_t n = addresses->children.count;
+	R2McpDecompItem *items = R_NEWS0 (R2McpDecompItem, n);
+	R2McpIndex *ix = index_get (ss);
+	const RJson *js;
+	size_t i = 0, misses = 0;
+	for (js = addresses->children.first; js; js = js->next, i++) {
+		R2McpDecompItem *it = &items[i];
+		it->address = js->type == R_JSON_STRING ? js->str_value : NULL;
+		it->fcn = it->address ? r_anal_get_fcn_in (core->anal, index_resolve (ss, ix, it->address), 0) : NULL;
+		if (it->fcn) {
+			it->snapshot = decomp_snapshot (core, it->fcn);
+			it->text = decomp_get (ss, it->fcn->addr, it->snapshot);
+			misses += !it->text;
+		}
+	}
+	int jobs = (int)r_json_get_num (tc->args, "jobs");
+	if (jobs <= 0) {
+		jobs = sysconf (_SC_NPROCESSORS_ONLN);
+	}
+	jobs = R_MIN (R_MIN (jobs, R2MCP_DECOMP_JOBS), (int)misses);
+	const ut64 start = r_time_now_mono ();
+	if (jobs > 1 && r2_cons_own ()) {
+		decomp_parallel (ss, items, n, jobs);
+	}
+	RStrBuf *sb = r_strbuf_new ("");
+	for (i = 0; i < n; i++) {
+		R2McpDecompItem *it = &items[i];
+		if (!it->fcn) {
+			r_strbuf_appendf (sb, "// %s: no function at this address\n\n", it->address ? it->address : "?");
+			continue;
+		}
+		if (!it->text && !core->cons->context->breaked) {
+			it->text = decomp_run (core, it->fcn->addr);
+			it->fresh = true;
+		}
+		if (it->text && it->fresh && !core->cons->context->breaked) {
+			decomp_put (ss, it->fcn->addr, it->snapshot, it->text);
+		}
+		r_strbuf_appendf (sb, "// 0x%08" PFMT64x " %s\n%s\n", it->fcn->addr, it->fcn->name, r_str_get (it->text));
+		free (it->text);
+	}
+	stats_phase (R2MCP_PHASE_COMMAND, start);
+	free (items);
+	char *text = r_strbuf_drain (sb);
+	char *response = create_tool_text_response (text);
+	free (text);
+	return response;
+}
+
+static char *tool_rename_function(R2McpToolCall *tc) {
+	const char *address = r_json_get_str (tc->args, "address");
+	if (!address) {
+		return create_error_response (-32602, "Missing required parameter: address", NULL, NULL);
+	}
+	const char *name = r_json_get_str (tc->args, "name");
+	if (!name) {
+		return create_error_response (-32602, "Missing required parameter: name", NULL, NULL);
+	}
+	ut64 addr;
+	if (!r2_edit_address (tc->ss, address, &addr)) {
+		return create_error_response (-32602, "Invalid address", NULL, NULL);
+	}
+	if (!r_name_check (name)) {
+		return create_error_response (-32602, "Invalid function name", NULL, NULL);
+	}
+	char *cmd = arena_newf ("'@0x%" PFMT64x "'afn %s", addr, name);
+	r2_mutate (tc->ss, cmd, true);
+	dirty_mark_function (tc->ss, address);
+	return create_tool_text_response ("ok");
+}
+
+// Batches run their calls back to back, grouping them by session. A group
+// claims its session for all of its calls, and with parallel set the
+// groups run at the same time, unless the cores share one RCons. Keeping no session claimed while waiting
+// for another one is what keeps concurrent batches from deadlocking.
+#define R2MCP_BATCH_MAX 256
+
+typedef struct {
+	ut32 session; // 0 for the last used one
+	RJson **calls;
+	int *index;   // position of every call in the batch
+	int count;
+	char **results;
+	R2McpClient *client;
+	bool started;
+	pthread_t th;
+} R2McpBatchGroup;
+
+static void *batch_group_run(void *arg) {
+	R2McpBatchGroup *g = arg;
+	R2McpClient *prev = client_current;
+	client_current = g->client;
+	R2McpSession *ss = session_claim (g->session);
+	int i;
+	for (i = 0; i < g->count; i++) {
+		RJson *call = g->calls[i];
+		const char *name = r_json_get_str (call, "name");
+		if (!name) {
+			name = r_json_get_str (call, "tool");
+		}
+		char *res;
+		if (!name) {
+			res = create_error_response (-32602, "Missing required parameter: name", NULL, NULL);
+		} else if (!strcmp (name, "batch")) {
+			res = create_error_response (-32602, "Batches can not be nested", NULL, NULL);
+		} else if (shards.count) {
+			// the calls go to the shard of the group session
+			res = shard_invoke (name, call, g->session);
+		} else if (g->session && !ss) {
+			res = create_error_response (-32602, "Unknown session, use openFile or listSessions", NULL, NULL);
 		} else {
-			// It's a string
-			pj_ks (pj, "id", id);
+			res = tool_invoke (ss, name, call);
+		}
+		g->results[g->index[i]] = res;
+	}
+	session_release (ss);
+	client_current = prev;
+	return NULL;
+}
+
+// Groups after the first run on threads of their own, with their own arena
+static void *batch_group_thread(void *arg) {
+	batch_group_run (arg);
+	arena_fini ();
+	return NULL;
+}
+
+// Append the items of a tool result to the content array being built, and
+// its structuredContent, null without one, to the structured results.
+// Errors and plain strings become text items.
+static bool batch_append(RStrBuf *sb, RStrBuf *sc, const char *res) {
+	char *copy = strdup (res);
+	RJson *j = r_json_parse (copy);
+	const RJson *content = j ? r_json_get (j, "content") : NULL;
+	const RJson *structured = j ? r_json_get (j, "structuredContent") : NULL;
+	r_strbuf_append (sc, r_strbuf_length (sc) > 1 ? "," : "");
+	if (structured) {
+		json_write (sc, structured);
+	} else {
+		r_strbuf_append (sc, "null");
+	}
+	if (content && content->type == R_JSON_ARRAY) {
+		const RJson *item;
+		for (item = content->children.first; item; item = item->next) {
+			r_strbuf_append (sb, ",");
+			json_write (sb, item);
+		}
+	} else {
+		const RJson *error = j ? r_json_get (j, "error") : NULL;
+		char *text = NULL;
+		if (error) {
+			const char *msg = r_json_get_str (error, "message");
+			text = r_str_newf ("error: %s", msg ? msg : "unknown");
+		}
+		PJ *pj = pj_new ();
+		pj_o (pj);
+		pj_ks (pj, "type", "text");
+		pj_ks (pj, "text", text ? text : res);
+		pj_end (pj);
+		r_strbuf_append (sb, ",");
+		r_strbuf_append (sb, pj_string (pj));
+		pj_free (pj);
+		free (text);
+	}
+	r_json_free (j);
+	free (copy);
+	return structured != NULL;
+}
+
+static char *tool_batch(R2McpToolCall *tc) {
+	const RJson *calls = r_json_get (tc->args, "calls");
+	if (!calls || calls->type != R_JSON_ARRAY || !calls->children.count) {
+		return create_error_response (-32602, "Missing required parameter: calls", NULL, NULL);
+	}
+	const int n = (int)calls->children.count;
+	if (n > R2MCP_BATCH_MAX) {
+		return create_error_response (-32602, "Too many calls in the batch", NULL, NULL);
+	}
+	const ut32 session = (ut32)r_json_get_num (tc->args, "session");
+	const bool parallel = r_json_get_num (tc->args, "parallel");
+	char **results = R_NEWS0 (char *, n);
+	const char **names = R_NEWS0 (const char *, n);
+	R2McpBatchGroup *groups = R_NEWS0 (R2McpBatchGroup, n);
+	int i = 0;
+	int ngroups = 0;
+	const RJson *js;
+	for (js = calls->children.first; js; js = js->next, i++) {
+		ut32 sid = (ut32)r_json_get_num (r_json_get (js, "arguments"), "session");
+		if (!sid) {
+			sid = session;
+		}
+		int k;
+		for (k = 0; k < ngroups && groups[k].session != sid; k++) {
+		}
+		R2McpBatchGroup *g = &groups[k];
+		if (k == ngroups) {
+			g->session = sid;
+			g->calls = R_NEWS0 (RJson *, n);
+			g->index = R_NEWS0 (int, n);
+			g->results = results;
+			g->client = client_current;
+			ngroups++;
+		}
+		g->calls[g->count] = (RJson *)js;
+		g->index[g->count++] = i;
+		names[i] = r_json_get_str (js, "name");
+		if (!names[i]) {
+			names[i] = r_json_get_str (js, "tool");
+		}
+	}
+	// the batch already holds the console gate when the RCons is shared
+	if (parallel && (shards.count || r2_cons_own ())) {
+		for (i = 1; i < ngroups; i++) {
+			groups[i].started = !pthread_create (&groups[i].th, NULL, batch_group_thread, &groups[i]);
+		}
+	}
+	for (i = 0; i < ngroups; i++) {
+		if (groups[i].started) {
+			pthread_join (groups[i].th, NULL);
+		} else {
+			batch_group_run (&groups[i]);
+		}
+		free (groups[i].calls);
+		free (groups[i].index);
+	}
+	// one content array with a label before the items of every call, and
+	// the structured results of the calls in their order
+	RStrBuf *sb = r_strbuf_new ("{\"content\":[");
+	RStrBuf *sc = r_strbuf_new ("[");
+	bool structured = false;
+	for (i = 0; i < n; i++) {
+		char *label = r_str_newf ("[%d] %s", i, names[i] ? names[i] : "?");
+		PJ *pj = pj_new ();
+		pj_o (pj);
+		pj_ks (pj, "type", "text");
+		pj_ks (pj, "text", label);
+		pj_end (pj);
+		if (i) {
+			r_strbuf_append (sb, ",");
+		}
+		r_strbuf_append (sb, pj_string (pj));
+		pj_free (pj);
+		free (label);
+		if (results[i]) {
+			structured |= batch_append (sb, sc, results[i]);
+			free (results[i]);
+		} else {
+			r_strbuf_append (sc, i ? ",null" : "null");
+		}
+	}
+	r_strbuf_append (sb, "]");
+	if (structured) {
+		r_strbuf_appendf (sb, ",\"structuredContent\":{\"results\":%s]}", r_strbuf_get (sc));
+	}
+	r_strbuf_free (sc);
+	r_strbuf_append (sb, "}");
+	free (groups);
+	free (names);
+	free (results);
+	return r_strbuf_drain (sb);
+}
+
+// Every tool working on an opened file accepts the session to use
+#define SESSION_PROP "\"session\":{\"type\":\"string\",\"description\":\"Session id returned by openFile, defaults to the last used session\"}"
+
+// Arguments of the paginated tools
+#define PAGE_PROPS ",\"cursor\":{\"type\":\"string\",\"description\":\"Cursor returned by the previous page\"},\"limit\":{\"type\":\"integer\",\"description\":\"Maximum number of results per page (500 by default)\"}"
+
+// Argument of the tools able to return structured results
+#define FORMAT_PROP ",\"format\":{\"type\":\"string\",\"enum\":[\"text\",\"json\"],\"description\":\"json returns the data in structuredContent\"}"
+
+#define R2MCP_TOOL_RO (R2MCP_TOOL_SESSION | R2MCP_TOOL_READONLY)
+#define R2MCP_TOOL_RW (R2MCP_TOOL_SESSION | R2MCP_TOOL_MUTATES)
+
+// Tool registry: the description and input schema of every tool, the
+// handler implementing it and what the cache and the scheduler need to
+// know about it. Entries are listed by tools/list in this order.
+static const R2McpTool tools[] = {
+	{ "openFile",
+		"Open given file with radare2 to start the analysis, returns the session id to use with other tools",
+		"{\"type\":\"object\",\"properties\":{\"filePath\":{\"type\":\"string\",\"description\":\"Path to the file to open\"},\"openMode\":{\"type\":\"string\",\"enum\":[\"auto\",\"mmap\",\"buffered\"],\"description\":\"mmap maps the file read-only, buffered loads it with bin.cache, auto maps local files\"}},\"required\":[\"filePath\"]}",
+		tool_open_file, NULL, NULL, 0, R2MCP_COST_NORMAL },
+	{ "closeFile",
+		"Close the file of the given session",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP "}}",
+		tool_close_file, NULL, NULL, R2MCP_TOOL_RW, R2MCP_COST_CHEAP },
+	{ "listSessions",
+		"List the sessions and the files opened in them, most recently used first",
+		"{\"type\":\"object\",\"properties\":{}}",
+		tool_list_sessions, NULL, NULL, 0, R2MCP_COST_CHEAP },
+	{ "batch",
+		"Run a list of tool calls at once and get all their results in one response, use it to disassemble or decompile many addresses",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"calls\":{\"type\":\"array\",\"description\":\"Tool calls to run in order, they use the batch session unless their arguments say otherwise\",\"items\":{\"type\":\"object\",\"properties\":{\"name\":{\"type\":\"string\",\"description\":\"Name of the tool\"},\"arguments\":{\"type\":\"object\",\"description\":\"Arguments of the tool\"}},\"required\":[\"name\"]}},\"parallel\":{\"type\":\"boolean\",\"description\":\"Run the calls on different sessions at the same time\"}},\"required\":[\"calls\"]}",
+		tool_batch, NULL, NULL, 0, R2MCP_COST_NORMAL },
+	{ "listFunctions",
+		"List all functions found after the analysis",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP PAGE_PROPS FORMAT_PROP "}}",
+		tool_list_functions, NULL, NULL, R2MCP_TOOL_RO, R2MCP_COST_NORMAL },
+	{ "listLibraries",
+		"List libraries linked to this binary",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP FORMAT_PROP "}}",
+		tool_cmd, "ilq", "ilj", R2MCP_TOOL_RO, R2MCP_COST_CHEAP },
+	{ "listImports",
+		"Enumerate all the symbols imported in the binary",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP PAGE_PROPS FORMAT_PROP "}}",
+		tool_list_imports, NULL, NULL, R2MCP_TOOL_RO, R2MCP_COST_NORMAL },
+	{ "listSections",
+		"Show program sections and segments",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP FORMAT_PROP "}}",
+		tool_cmd, "iS;iSS", "iSj", R2MCP_TOOL_RO, R2MCP_COST_CHEAP },
+	{ "showFunctionDetails",
+		"Show function details",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP FORMAT_PROP "}}",
+		tool_cmd, "afi", "afij", R2MCP_TOOL_SESSION, R2MCP_COST_CHEAP },
+	{ "getCurrentAddress",
+		"Get name and address for the current offset",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP "}}",
+		tool_cmd, "s;fd", NULL, R2MCP_TOOL_SESSION, R2MCP_COST_CHEAP },
+	{ "showHeaders",
+		"Show program headers details and information from the binary",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP FORMAT_PROP "}}",
+		tool_cmd, "i;iH", "ij", R2MCP_TOOL_RO, R2MCP_COST_CHEAP },
+	{ "listSymbols",
+		"Enumerate all the symbols exported from the binary",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP PAGE_PROPS FORMAT_PROP "}}",
+		tool_list_symbols, NULL, NULL, R2MCP_TOOL_RO, R2MCP_COST_NORMAL },
+	{ "listEntrypoints",
+		"Enumerate entrypoints, constructor functions and main",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP FORMAT_PROP "}}",
+		tool_cmd, "ies", "iej", R2MCP_TOOL_RO, R2MCP_COST_CHEAP },
+	{ "listMethods",
+		"Enumerate methods for the given class",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"classname\":{\"type\":\"string\",\"description\":\"Name of the class to list its methods\"}},\"required\":[\"classname\"]}",
+		tool_list_methods, NULL, NULL, R2MCP_TOOL_RO, R2MCP_COST_CHEAP },
+	{ "listClasses",
+		"List C++, ObjC, Swift, Java, Dalvik class names",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"regexpFilter\":{\"type\":\"string\",\"description\":\"Regular expression to filter the results\"}}}",
+		tool_cmd_filter, "icqq", NULL, R2MCP_TOOL_RO, R2MCP_COST_NORMAL },
+	{ "listDecompilers",
+		"List all the decompilers available for radare2",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP "}}",
+		tool_cmd, "e cmd.pdc=?", NULL, R2MCP_TOOL_RO, R2MCP_COST_CHEAP },
+	{ "renameFunction",
+		"Change the name of the function located in given address",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"name\":{\"type\":\"string\",\"description\":\"Name of the decompiler\"},\"address\":{\"type\":\"string\",\"description\":\"address of the function to rename\"}},\"required\":[\"name\",\"address\"]}",
+		tool_rename_function, NULL, NULL, R2MCP_TOOL_RW, R2MCP_COST_CHEAP },
+	{ "useDecompiler",
+		"Select a different decompiler backend",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"name\":{\"type\":\"string\",\"description\":\"Name of the decompiler\"}},\"required\":[\"name\"]}",
+		tool_use_decompiler, NULL, NULL, R2MCP_TOOL_RW, R2MCP_COST_CHEAP },
+	{ "getFunctionPrototype",
+		"Get the signature / prototype for the function in the given address",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"address\":{\"type\":\"string\",\"description\":\"Address to put the comment in\"},\"prototype\":{\"type\":\"string\",\"description\":\"function signature or prototype description\"}},\"required\":[\"address\"]}",
+		tool_get_function_prototype, NULL, NULL, R2MCP_TOOL_RO, R2MCP_COST_CHEAP },
+	{ "setFunctionPrototype",
+		"Define the function signature (return type, symbol name and argument types and names)",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"address\":{\"type\":\"string\",\"description\":\"Address to put the comment in\"},\"prototype\":{\"type\":\"string\",\"description\":\"function signature or prototype description\"}},\"required\":[\"address\",\"prototype\"]}",
+		tool_set_function_prototype, NULL, NULL, R2MCP_TOOL_RW, R2MCP_COST_CHEAP },
+	{ "setComment",
+		"List strings in the rodata section of the binary matching the given regexp",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"address\":{\"type\":\"string\",\"description\":\"Address to put the comment in\"},\"message\":{\"type\":\"string\",\"description\":\"comment text to use\"}},\"required\":[\"address\",\"message\"]}",
+		tool_set_comment, NULL, NULL, R2MCP_TOOL_RW, R2MCP_COST_CHEAP },
+	{ "listStrings",
+		"List strings in the rodata section of the binary matching the given regexp",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"regexpFilter\":{\"type\":\"string\",\"description\":\"Regular expression to filter the results\"}" PAGE_PROPS FORMAT_PROP "}}",
+		tool_list_strings, NULL, NULL, R2MCP_TOOL_RO, R2MCP_COST_NORMAL },
+	{ "listAllStrings",
+		"Scan the whole binary looking for hardcoded strings matching the given regexp if specified (consider using this method when analyzing malware)",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"regexpFilter\":{\"type\":\"string\",\"description\":\"Regular expression to filter the results\"},\"minLength\":{\"type\":\"integer\",\"description\":\"Minimum string length in characters\"},\"encoding\":{\"type\":\"string\",\"enum\":[\"all\",\"ascii\",\"utf8\",\"utf16le\"],\"description\":\"Encodings to look for, all by default\"}" PAGE_PROPS FORMAT_PROP "}}",
+		tool_list_all_strings, NULL, NULL, R2MCP_TOOL_RO, R2MCP_COST_HEAVY },
+#if 0
+	{ "runCommand", // TODO: optional
+		"Run a radare2 command and get the output",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"command\":{\"type\":\"string\",\"description\":\"Command to execute\"}},\"required\":[\"command\"]}",
+		tool_run_command, NULL, NULL, R2MCP_TOOL_RW, R2MCP_COST_HEAVY },
+#endif
+	{ "analyze",
+		"Run analysis on the current file",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"level\":{\"type\":\"number\",\"description\":\"Analysis level (0, 1, 2, 3, 4)\"},\"background\":{\"type\":\"boolean\",\"description\":\"Return immediately and analyze in the background, sending progress notifications\"},\"full\":{\"type\":\"boolean\",\"description\":\"Rerun the whole analysis, by default only the functions edited since the last one are analyzed again\"},\"split\":{\"type\":\"boolean\",\"description\":\"With shards, analyze a part of the code in each shard at once and merge the functions and xrefs found\"}},\"required\":[]}",
+		tool_analyze, NULL, NULL, R2MCP_TOOL_RW, R2MCP_COST_HEAVY },
+	{ "serverStats",
+		"Show the server metrics: time spent per phase, calls, errors and latency of every tool, bytes in and out, cache hit rates and memory use of the sessions",
+		"{\"type\":\"object\",\"properties\":{\"format\":{\"type\":\"string\",\"enum\":[\"text\",\"json\"],\"description\":\"Return structured JSON instead of text\"}}}",
+		tool_server_stats, NULL, NULL, 0, R2MCP_COST_CHEAP },
+	{ "cacheStats",
+		"Show the hit and miss counters of the tool result cache",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP "}}",
+		tool_cache_stats, NULL, NULL, R2MCP_TOOL_SESSION, R2MCP_COST_CHEAP },
+	{ "analysisStatus",
+		"Show the progress of the background analysis, optionally waiting for it to finish",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"wait\":{\"type\":\"boolean\",\"description\":\"Wait for the analysis to finish\"},\"timeout\":{\"type\":\"number\",\"description\":\"Maximum seconds to wait (30 by default)\"},\"cancel\":{\"type\":\"boolean\",\"description\":\"Stop the running analysis\"}}}",
+		tool_analysis_status, NULL, NULL, R2MCP_TOOL_SESSION | R2MCP_TOOL_WAITS, R2MCP_COST_CHEAP },
+	{ "shardRanges",
+		"Split the code of the file in parts of about the same size",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"parts\":{\"type\":\"integer\"}},\"required\":[\"parts\"]}",
+		tool_shard_ranges, NULL, NULL, R2MCP_TOOL_SESSION | R2MCP_TOOL_SHARD, R2MCP_COST_CHEAP },
+	{ "shardAnalyze",
+		"Analyze the given address ranges and list the functions and references found",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"level\":{\"type\":\"number\"},\"ranges\":{\"type\":\"string\"}},\"required\":[\"ranges\"]}",
+		tool_shard_analyze, NULL, NULL, R2MCP_TOOL_RW | R2MCP_TOOL_SHARD, R2MCP_COST_HEAVY },
+	{ "shardMerge",
+		"Add the functions and references found by other shards",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"level\":{\"type\":\"number\"},\"parts\":{\"type\":\"integer\"},\"data\":{\"type\":\"string\"}},\"required\":[\"data\"]}",
+		tool_shard_merge, NULL, NULL, R2MCP_TOOL_RW | R2MCP_TOOL_SHARD, R2MCP_COST_HEAVY },
+	{ "xrefsTo",
+		"List all the references to the given address",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"address\":{\"type\":\"string\",\"description\":\"Address of the address to check for crossed references\"},\"addresses\":{\"type\":\"array\",\"description\":\"List of addresses to look up at once, instead of address\",\"items\":{\"type\":\"string\"}}" FORMAT_PROP "},\"required\":[]}",
+		tool_xrefs_to, NULL, NULL, R2MCP_TOOL_RO, R2MCP_COST_CHEAP },
+	{ "xrefsFrom",
+		"List all the references made from the given address or function",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"address\":{\"type\":\"string\",\"description\":\"Address the references are made from\"},\"addresses\":{\"type\":\"array\",\"description\":\"List of addresses to look up at once, instead of address\",\"items\":{\"type\":\"string\"}}" FORMAT_PROP "},\"required\":[]}",
+		tool_xrefs_from, NULL, NULL, R2MCP_TOOL_RO, R2MCP_COST_CHEAP },
+	{ "callGraph",
+		"Get the call graph of the program in one call, or the functions reachable from root",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"root\":{\"type\":\"string\",\"description\":\"Address or name of the function to start from, the whole graph when missing. An error when no function is found there\"},\"depth\":{\"type\":\"integer\",\"description\":\"Levels of calls to follow from root, 0 for all\"},\"format\":{\"type\":\"string\",\"enum\":[\"text\",\"json\",\"compact\"],\"description\":\"json returns the edges in structuredContent, compact as base64 varint deltas in chunks of up to 50000 edges\"},\"file\":{\"type\":\"string\",\"description\":\"Write the edges in the compact encoding to this path instead, the whole graph or the one reachable from root\"}" PAGE_PROPS "}}",
+		tool_call_graph, NULL, NULL, R2MCP_TOOL_SESSION, R2MCP_COST_NORMAL },
+	{ "decompileFunction",
+		"Decompile function at given address, consider using this method instead of disassembleFunction",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"address\":{\"type\":\"string\",\"description\":\"Address of the function to decompile\"}},\"required\":[\"address\"]}",
+		tool_decompile_function, NULL, NULL, R2MCP_TOOL_RO, R2MCP_COST_HEAVY },
+	{ "decompileFunctions",
+		"Decompile many functions at once, in parallel, use it to decompile a whole module",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"addresses\":{\"type\":\"array\",\"description\":\"Addresses of the functions to decompile\",\"items\":{\"type\":\"string\"}},\"jobs\":{\"type\":\"integer\",\"description\":\"Processes decompiling at the same time, the number of CPUs by default\"}},\"required\":[\"addresses\"]}",
+		tool_decompile_functions, NULL, NULL, R2MCP_TOOL_SESSION, R2MCP_COST_HEAVY },
+	{ "disassembleFunction",
+		"Disassemble function at given address",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"address\":{\"type\":\"string\",\"description\":\"Address of the function to disassemble\"}" FORMAT_PROP "},\"required\":[\"address\"]}",
+		tool_cmd_at, "pdf", "pdfj", R2MCP_TOOL_RO, R2MCP_COST_NORMAL },
+	{ "disassemble",
+		"Disassemble (numInstructions) at a given address",
+		"{\"type\":\"object\",\"properties\":{" SESSION_PROP ",\"address\":{\"type\":\"string\",\"description\":\"Address to start disassembly\"},\"numInstructions\":{\"type\":\"integer\",\"description\":\"Number of instructions to disassemble\"},\"cursor\":{\"type\":\"string\",\"description\":\"Cursor returned by the previous page, replaces the address\"}" FORMAT_PROP "},\"required\":[\"address\"]}",
+		tool_disassemble, NULL, NULL, R2MCP_TOOL_RO, R2MCP_COST_CHEAP }
+};
+
+#define TOOLS_COUNT     (sizeof (tools) / sizeof (tools[0]))
+// Above the number of tools, most clients never ask for a second page
+#define TOOLS_PAGE_SIZE 64
+
+// The tools/list results are serialized once from the registry. Every
+// listed tool entry is stored back to back in one string, so any page is a
+// slice of it, and the pages starting at multiples of the page size are
+// prebuilt. The tools used by the shard coordinator are not listed, and
+// take no place in the pages.
+typedef struct {
+	char *entries;
+	size_t count; // listed tools
+	size_t offsets[TOOLS_COUNT + 1]; // entry i spans offsets[i]..offsets[i+1]
+	char *pages[(TOOLS_COUNT + TOOLS_PAGE_SIZE - 1) / TOOLS_PAGE_SIZE];
+} R2McpToolsList;
+
+static R2McpToolsList tools_list = { 0 };
+
+static char *tools_list_page(size_t start) {
+	size_t end = R_MIN (start + TOOLS_PAGE_SIZE, tools_list.count);
+	RStrBuf *sb = r_strbuf_new ("{\"tools\":[");
+	if (tools_list.offsets[end] > tools_list.offsets[start]) {
+		// drop the comma following the last entry of the page
+		r_strbuf_append_n (sb, tools_list.entries + tools_list.offsets[start],
+			tools_list.offsets[end] - tools_list.offsets[start] - 1);
+	}
+	r_strbuf_append (sb, "]");
+	// Add nextCursor if there are more tools
+	if (end < tools_list.count) {
+		r_strbuf_appendf (sb, ",\"nextCursor\":\"%d\"", (int)end);
+	}
+	r_strbuf_append (sb, "}");
+	return r_strbuf_drain (sb);
+}
+
+static void tools_list_init(void) {
+	RStrBuf *sb = r_strbuf_new ("");
+	size_t i;
+	for (i = 0; i < TOOLS_COUNT; i++) {
+		if (tools[i].flags & R2MCP_TOOL_SHARD) {
+			continue;
+		}
+		tools_list.offsets[tools_list.count++] = r_strbuf_length (sb);
+		PJ *pj = pj_new ();
+		pj_o (pj);
+		pj_ks (pj, "name", tools[i].name);
+		pj_ks (pj, "description", tools[i].description);
+		pj_k (pj, "inputSchema");
+		pj_raw (pj, tools[i].schema);
+		pj_end (pj);
+		r_strbuf_append (sb, pj_string (pj));
+		r_strbuf_append (sb, ",");
+		pj_free (pj);
+	}
+	tools_list.offsets[tools_list.count] = r_strbuf_length (sb);
+	tools_list.entries = r_strbuf_drain (sb);
+	for (i = 0; i * TOOLS_PAGE_SIZE < tools_list.count; i++) {
+		tools_list.pages[i] = tools_list_page (i * TOOLS_PAGE_SIZE);
+	}
+}
+
+static char *handle_list_tools(RJson *params) {
+	// Add pagination support
+	const char *cursor = r_json_get_str (params, "cursor");
+	size_t start_index = 0;
+
+	// Parse cursor if provided
+	if (cursor && atoi (cursor) > 0) {
+		start_index = R_MIN ((size_t)atoi (cursor), tools_list.count);
+	}
+	if (start_index % TOOLS_PAGE_SIZE == 0 && start_index < tools_list.count) {
+		return strdup (tools_list.pages[start_index / TOOLS_PAGE_SIZE]);
+	}
+	return tools_list_page (start_index);
+}
+
+// Shard coordinator. With -s count the process forks count shards before
+// starting any thread, each one a regular r2mcp serving JSON-RPC on its
+// end of a socket pair, and keeps serving the client itself. A file goes
+// to the shard picked by its content hash, so each RCore lives in one
+// process. Shard i numbers its sessions i + 1, i + 1 + count and so on,
+// which is how the calls on a session find their way back. Responses are
+// matched to the calls by their id, so a shard keeps running the calls on
+// different sessions at the same time.
+
+static void json_write_str(RStrBuf *sb, const char *s) {
+	char *o = arena_alloc (json_escape (NULL, s) + 2);
+	if (o) {
+		o[0] = '"';
+		const size_t len = json_escape (o + 1, s);
+		o[len + 1] = '"';
+		r_strbuf_append_n (sb, o, len + 2);
+	}
+}
+
+// Serialize a parsed value back, for the requests that are forwarded
+static void json_write(RStrBuf *sb, const RJson *js) {
+	const RJson *c;
+	switch (js->type) {
+	case R_JSON_STRING:
+		json_write_str (sb, js->str_value);
+		break;
+	case R_JSON_INTEGER:
+		r_strbuf_appendf (sb, "%" PFMT64d, (st64)js->num.s_value);
+		break;
+	case R_JSON_DOUBLE:
+		r_strbuf_appendf (sb, "%.17g", js->num.dbl_value);
+		break;
+	case R_JSON_BOOLEAN:
+		r_strbuf_append (sb, js->num.u_value ? "true" : "false");
+		break;
+	case R_JSON_ARRAY:
+	case R_JSON_OBJECT:
+		r_strbuf_append (sb, js->type == R_JSON_ARRAY ? "[" : "{");
+		for (c = js->children.first; c; c = c->next) {
+			if (js->type == R_JSON_OBJECT) {
+				json_write_str (sb, c->key);
+				r_strbuf_append (sb, ":");
+			}
+			json_write (sb, c);
+			if (c->next) {
+				r_strbuf_append (sb, ",");
+			}
+		}
+		r_strbuf_append (sb, js->type == R_JSON_ARRAY ? "]" : "}");
+		break;
+	default:
+		r_strbuf_append (sb, "null");
+		break;
+	}
+}
+
+// Arguments of a routed call with the session it was routed to, which may
+// come from the batch or the last call instead of the client
+static char *shard_args(const RJson *args, ut32 session) {
+	RStrBuf *sb = r_strbuf_new ("{");
+	bool first = true;
+	if (session) {
+		r_strbuf_appendf (sb, "\"session\":%u", session);
+		first = false;
+	}
+	const RJson *js = args && args->type == R_JSON_OBJECT ? args->children.first : NULL;
+	for (; js; js = js->next) {
+		if (session && !strcmp (js->key, "session")) {
+			continue;
+		}
+		if (!first) {
+			r_strbuf_append (sb, ",");
+		}
+		first = false;
+		json_write_str (sb, js->key);
+		r_strbuf_append (sb, ":");
+		json_write (sb, js);
+	}
+	r_strbuf_append (sb, "}");
+	return r_strbuf_drain (sb);
+}
+
+// Run a tool on shard i and wait for its result. args and meta are JSON
+// texts, meta may be NULL
+static char *shard_request(int i, const char *name, const char *args, const char *meta, const char *token) {
+	R2McpShard *sh = &shards.list[i];
+	R2McpShardCall call = { .client = client_current, .job = job_current, .token = token };
+	pthread_mutex_lock (&shards.lock);
+	const bool alive = sh->alive;
+	if (alive) {
+		call.id = ++shards.next_id;
+		r_list_append (sh->pending, &call);
+	}
+	pthread_mutex_unlock (&shards.lock);
+	if (!alive) {
+		return create_error_response (-32000, "The shard process of this session exited", NULL, NULL);
+	}
+	char *head = arena_newf ("{\"jsonrpc\":\"2.0\",\"id\":%" PFMT64u ",\"method\":\"tools/call\",\"params\":{\"name\":\"%s\",\"arguments\":", call.id, name);
+	struct iovec iov[5] = {
+		{ head, strlen (head) },
+		{ (void *)args, strlen (args) },
+		{ (void *)",\"_meta\":", meta ? 9 : 0 },
+		{ (void *)(meta ? meta : ""), meta ? strlen (meta) : 0 },
+		{ (void *)"}}\n", 3 },
+	};
+	pthread_mutex_lock (&sh->wlock);
+	const bool sent = write_iov (sh->fd, iov, 5);
+	pthread_mutex_unlock (&sh->wlock);
+	pthread_mutex_lock (&shards.lock);
+	while (sent && !call.done && sh->alive) {
+		pthread_cond_wait (&shards.cond, &shards.lock);
+	}
+	r_list_delete_data (sh->pending, &call);
+	pthread_mutex_unlock (&shards.lock);
+	return call.result ? call.result : create_error_response (-32000, "The shard process of this session exited", NULL, NULL);
+}
+
+// Forward a call as the client made it
+static char *shard_forward(int i, const char *name, const RJson *params, ut32 session) {
+	const RJson *meta = r_json_get (params, "_meta");
+	char *args = shard_args (r_json_get (params, "arguments"), session);
+	char *mjson = NULL;
+	char token_buf[32];
+	const char *token = NULL;
+	if (meta) {
+		RStrBuf *sb = r_strbuf_new ("");
+		json_write (sb, meta);
+		mjson = r_strbuf_drain (sb);
+		token = json_id_tostring (r_json_get (meta, "progressToken"), token_buf, sizeof (token_buf));
+	}
+	char *res = shard_request (i, name, args, mjson, token);
+	free (args);
+	free (mjson);
+	return res;
+}
+
+// The text of a tool result, NULL for errors
+static char *shard_text(const char *res) {
+	if (!res || r_str_startswith (res, "{\"jsonrpc\"")) {
+		return NULL;
+	}
+	char *copy = strdup (res);
+	RJson *js = r_json_parse (copy);
+	const RJson *content = js ? r_json_get (js, "content") : NULL;
+	const RJson *item = content ? r_json_item (content, 0) : NULL;
+	const char *text = item ? r_json_get_str (item, "text") : NULL;
+	char *o = text ? strdup (text) : NULL;
+	r_json_free (js);
+	free (copy);
+	return o;
+}
+
+// Session id in the text of an openFile result
+static ut32 shard_session_id(const char *text) {
+	const char *s = text ? strstr (text, "session: ") : NULL;
+	return s ? (ut32)strtoul (s + 9, NULL, 10) : 0;
+}
+
+// Shard of a file by its contents, the first one to see a path keeps it
+static int shard_pick(const char *path) {
+	pthread_mutex_lock (&shards.lock);
+	const int known = (int)(size_t)ht_pp_find (shards.paths, path, NULL);
+	pthread_mutex_unlock (&shards.lock);
+	if (known) {
+		return known - 1;
+	}
+	char *hash = cache_file_key (path);
+	const char *p = hash ? hash : path;
+	ut64 h = 0xcbf29ce484222325ULL;
+	for (; *p; p++) {
+		h = (h ^ (ut8)*p) * 0x100000001b3ULL;
+	}
+	free (hash);
+	int i = h % shards.count;
+	pthread_mutex_lock (&shards.lock);
+	int tries;
+	// skip the shards that went away
+	for (tries = 0; tries < shards.count && !shards.list[i].alive; tries++) {
+		i = (i + 1) % shards.count;
+	}
+	ht_pp_update (shards.paths, path, (void *)(size_t)(i + 1));
+	pthread_mutex_unlock (&shards.lock);
+	return i;
+}
+
+static char *shard_open_file(const char *filepath, RJson *params) {
+	char *res = shard_forward (shard_pick (filepath), "openFile", params, 0);
+	char *text = shard_text (res);
+	const ut32 id = shard_session_id (text);
+	if (id) {
+		pthread_mutex_lock (&shards.lock);
+		ht_up_update (shards.sessions, id, strdup (filepath));
+		shards.last = id;
+		pthread_mutex_unlock (&shards.lock);
+	}
+	free (text);
+	return res;
+}
+
+// The sessions of every shard, most recently used first within each one
+static char *shard_list_sessions(void) {
+	RStrBuf *sb = r_strbuf_new ("");
+	int i;
+	for (i = 0; i < shards.count; i++) {
+		char *res = shard_request (i, "listSessions", "{}", NULL, NULL);
+		char *text = shard_text (res);
+		if (text) {
+			r_strbuf_append (sb, text);
+		}
+		free (text);
+		free (res);
+	}
+	char *text = r_strbuf_drain (sb);
+	char *o = create_tool_text_response (text);
+	free (text);
+	return o;
+}
+
+// One part of a split analysis, run on its shard
+typedef struct {
+	int shard;
+	ut32 session;       // 0 to open the file on the shard first
+	const char *path;
+	const char *ranges; // "from-to,..."
+	const char *meta;
+	int level;
+	R2McpClient *client;
+	R2McpJob *job;
+	char *text;  // functions and references found
+	char *error; // error response, when text is NULL
+} R2McpShardPart;
+
+static void shard_part_run(R2McpShardPart *pt) {
+	client_current = pt->client;
+	job_current = pt->job;
+	ut32 sid = pt->session;
+	bool opened = false;
+	if (!sid) {
+		PJ *pj = pj_new ();
+		pj_o (pj);
+		pj_ks (pj, "filePath", pt->path);
+		pj_end (pj);
+		char *res = shard_request (pt->shard, "openFile", pj_string (pj), NULL, NULL);
+		pj_free (pj);
+		char *text = shard_text (res);
+		sid = shard_session_id (text);
+		// a session already there is left open afterwards
+		opened = sid && !strstr (text, "reusing");
+		free (text);
+		if (!sid) {
+			pt->error = res;
+			return;
+		}
+		free (res);
+	}
+	char *args = arena_newf ("{\"session\":%u,\"level\":%d,\"ranges\":\"%s\"}", sid, pt->level, pt->ranges);
+	char *res = shard_request (pt->shard, "shardAnalyze", args, pt->meta, NULL);
+	pt->text = shard_text (res);
+	if (pt->text) {
+		free (res);
+	} else {
+		pt->error = res;
+	}
+	if (opened) {
+		free (shard_request (pt->shard, "closeFile", arena_newf ("{\"session\":%u}", sid), NULL, NULL));
+	}
+}
+
+static void *shard_part_thread(void *arg) {
+	shard_part_run (arg);
+	arena_fini ();
+	return NULL;
+}
+
+// _meta of the calls of a split analysis: no cap on the results, and the
+// deadline of the client call when it gave one
+static char *shard_part_meta(const RJson *params) {
+	const RJson *meta = r_json_get (params, "_meta");
+	const RJson *timeout = meta ? r_json_get (meta, "timeout") : NULL;
+	RStrBuf *sb = r_strbuf_new ("{\"maxBytes\":0");
+	if (timeout) {
+		r_strbuf_append (sb, ",\"timeout\":");
+		json_write (sb, timeout);
+	}
+	r_strbuf_append (sb, "}");
+	return r_strbuf_drain (sb);
+}
+
+// analyze with split: the shard owning the session cuts the code in one
+// part per shard, every shard analyzes its part at the same time (the
+// others on a session of their own) and lists the functions and xrefs it
+// found, and the owner adds them to the session
+static char *shard_analyze_split(RJson *params, ut32 sid, int owner) {
+	pthread_mutex_lock (&shards.lock);
+	const char *known = ht_up_find (shards.sessions, sid, NULL);
+	char *path = known ? strdup (known) : NULL;
+	pthread_mutex_unlock (&shards.lock);
+	if (!path) {
+		return create_error_response (-32602, "Unknown session, use openFile or listSessions", NULL, NULL);
+	}
+	const int n = shards.count;
+	const int level = (int)r_json_get_num (r_json_get (params, "arguments"), "level");
+	if (!r2_analysis_level_valid (level)) {
+		free (path);
+		return create_error_response (-32602, R2MCP_LEVEL_ERROR, NULL, NULL);
+	}
+	char *meta = shard_part_meta (params);
+	char *res = shard_request (owner, "shardRanges", arena_newf ("{\"session\":%u,\"parts\":%d}", sid, n), meta, NULL);
+	char *text = shard_text (res);
+	if (!text) {
+		free (path);
+		free (meta);
+		return res;
+	}
+	free (res);
+	RStrBuf **ranges = R_NEWS0 (RStrBuf *, n);
+	int k;
+	for (k = 0; k < n; k++) {
+		ranges[k] = r_strbuf_new ("");
+	}
+	char *line = text;
+	while (line && *line) {
+		char *end;
+		const int part = (int)strtol (line, &end, 10);
+		const ut64 from = strtoull (end, &end, 0);
+		const ut64 to = strtoull (end, &end, 0);
+		if (part >= 0 && part < n && to > from) {
+			r_strbuf_appendf (ranges[part], "%s0x%" PFMT64x "-0x%" PFMT64x,
+				r_strbuf_length (ranges[part]) ? "," : "", from, to);
+		}
+		line = strchr (end, '\n');
+		line = line ? line + 1 : NULL;
+	}
+	free (text);
+	// part 0 runs on the owner and the calling thread, the others on threads
+	R2McpShardPart *parts = R_NEWS0 (R2McpShardPart, n);
+	pthread_t *th = R_NEWS0 (pthread_t, n);
+	bool *started = R_NEWS0 (bool, n);
+	for (k = 0; k < n; k++) {
+		R2McpShardPart *pt = &parts[k];
+		pt->shard = (owner + k) % n;
+		pt->session = k ? 0 : sid;
+		pt->path = path;
+		pt->ranges = r_strbuf_get (ranges[k]);
+		pt->meta = meta;
+		pt->level = level;
+		pt->client = client_current;
+		pt->job = job_current;
+		if (k && *pt->ranges) {
+			started[k] = !pthread_create (&th[k], NULL, shard_part_thread, pt);
+		}
+	}
+	for (k = 0; k < n; k++) {
+		if (started[k]) {
+			pthread_join (th[k], NULL);
+		} else if (*parts[k].ranges) {
+			shard_part_run (&parts[k]);
+		}
+	}
+	// the first error wins, otherwise the owner merges what the others found
+	res = NULL;
+	RStrBuf *data = r_strbuf_new ("");
+	for (k = 0; k < n; k++) {
+		if (parts[k].error && !res) {
+			res = parts[k].error;
+		} else {
+			free (parts[k].error);
+		}
+		if (k && parts[k].text) {
+			r_strbuf_append (data, parts[k].text);
+		}
+		free (parts[k].text);
+		r_strbuf_free (ranges[k]);
+	}
+	if (!res) {
+		PJ *pj = pj_new ();
+		pj_o (pj);
+		pj_kn (pj, "session", sid);
+		pj_ki (pj, "level", level);
+		pj_ki (pj, "parts", n);
+		pj_ks (pj, "data", r_strbuf_get (data));
+		pj_end (pj);
+		res = shard_request (owner, "shardMerge", pj_string (pj), meta, NULL);
+		pj_free (pj);
+	}
+	r_strbuf_free (data);
+	free (ranges);
+	free (parts);
+	free (th);
+	free (started);
+	free (meta);
+	free (path);
+	return res;
+}
+
+// Route a session tool call to the shard of its session
+static char *shard_call_tool(const R2McpTool *tool, RJson *params, ut32 session) {
+	const RJson *args = r_json_get (params, "arguments");
+	ut32 sid = (ut32)r_json_get_num (args, "session");
+	pthread_mutex_lock (&shards.lock);
+	if (!sid) {
+		sid = session ? session : shards.last;
+	}
+	pthread_mutex_unlock (&shards.lock);
+	if (!sid) {
+		return create_error_response (-32611, "Use the openFile method before calling any other method", NULL, NULL);
+	}
+	const int i = (sid - 1) % shards.count;
+	char *res;
+	if (tool->fn == tool_analyze && r_json_get_num (args, "split")) {
+		res = shard_analyze_split (params, sid, i);
+	} else {
+		res = shard_forward (i, tool->name, params, sid);
+	}
+	pthread_mutex_lock (&shards.lock);
+	if (tool->fn == tool_close_file) {
+		ht_up_delete (shards.sessions, sid);
+		if (shards.last == sid) {
+			shards.last = 0;
+		}
+	} else {
+		shards.last = sid;
+	}
+	pthread_mutex_unlock (&shards.lock);
+	return res;
+}
+
+// Forward the cancellation of a job to the shards it is waiting on, their
+// calls answer with a cancelled error. Called with the pool lock held
+static void shard_cancel(R2McpJob *job) {
+	int i;
+	for (i = 0; i < shards.count; i++) {
+		R2McpShard *sh = &shards.list[i];
+		RListIter *iter;
+		R2McpShardCall *call;
+		ut64 id = 0;
+		pthread_mutex_lock (&shards.lock);
+		r_list_foreach (sh->pending, iter, call) {
+			if (call->job == job && !call->done) {
+				id = call->id;
+				break;
+			}
+		}
+		pthread_mutex_unlock (&shards.lock);
+		if (id) {
+			char *msg = r_str_newf ("{\"jsonrpc\":\"2.0\",\"method\":\"notifications/cancelled\",\"params\":{\"requestId\":%" PFMT64u "}}\n", id);
+			struct iovec iov = { msg, strlen (msg) };
+			pthread_mutex_lock (&sh->wlock);
+			write_iov (sh->fd, &iov, 1);
+			pthread_mutex_unlock (&sh->wlock);
+			free (msg);
+		}
+	}
+}
+
+// Notifications go to the client of the call with the same progressToken,
+// or the oldest call on the shard for the log messages
+static void shard_notify(R2McpShard *sh, const char *msg) {
+	char *copy = strdup (msg);
+	RJson *js = r_json_parse (copy);
+	const RJson *params = js ? r_json_get (js, "params") : NULL;
+	char token_buf[32];
+	const char *token = params ? json_id_tostring (r_json_get (params, "progressToken"), token_buf, sizeof (token_buf)) : NULL;
+	R2McpShardCall *call, *to = NULL;
+	RListIter *iter;
+	pthread_mutex_lock (&shards.lock);
+	r_list_foreach (sh->pending, iter, call) {
+		if (token ? call->token && !strcmp (call->token, token) : true) {
+			to = call;
+			break;
+		}
+	}
+	R2McpClient *client = to ? client_ref (to->client) : NULL;
+	pthread_mutex_unlock (&shards.lock);
+	if (to) {
+		send_notification (client, msg);
+		client_unref (client);
+	}
+	r_json_free (js);
+	free (copy);
+}
+
+// A message from a shard. Its responses start with the same envelope
+// response_prefix writes, so the result is taken as is
+static void shard_message(R2McpShard *sh, char *msg) {
+	static const char head[] = "{\"jsonrpc\":\"2.0\",\"id\":";
+	if (!r_str_startswith (msg, head)) {
+		shard_notify (sh, msg);
+		return;
+	}
+	char *p;
+	const ut64 id = strtoull (msg + sizeof (head) - 1, &p, 10);
+	char *res;
+	if (r_str_startswith (p, ",\"result\":")) {
+		p += strlen (",\"result\":");
+		// without the closing brace of the envelope
+		const size_t len = strlen (p) - 1;
+		res = malloc (len + 1);
+		if (res) {
+			memcpy (res, p, len);
+			res[len] = 0;
+		}
+	} else {
+		RJson *js = r_json_parse (msg);
+		const RJson *err = js ? r_json_get (js, "error") : NULL;
+		const char *text = err ? r_json_get_str (err, "message") : NULL;
+		res = create_error_response (err ? (int)r_json_get_num (err, "code") : -32603,
+			text ? text : "Invalid response from the shard", NULL, NULL);
+		r_json_free (js);
+	}
+	RListIter *iter;
+	R2McpShardCall *call;
+	pthread_mutex_lock (&shards.lock);
+	r_list_foreach (sh->pending, iter, call) {
+		if (call->id == id && !call->done) {
+			call->result = res;
+			call->done = true;
+			res = NULL;
+			pthread_cond_broadcast (&shards.cond);
+			break;
+		}
+	}
+	pthread_mutex_unlock (&shards.lock);
+	free (res);
+}
+
+static void *shard_reader(void *user) {
+	R2McpShard *sh = user;
+	ReadBuffer *buf = read_buffer_new ();
+	while (read_buffer_reserve (buf, READ_CHUNK_SIZE)) {
+		const ssize_t n = read (sh->fd, buf->data + buf->size, READ_CHUNK_SIZE);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		buf->size += n;
+		char *msg;
+		while ((msg = read_buffer_get_message (buf))) {
+			shard_message (sh, msg);
+		}
+	}
+	read_buffer_free (buf);
+	if (running) {
+		R_LOG_WARN ("Shard process %d exited", (int)sh->pid);
+	}
+	pthread_mutex_lock (&shards.lock);
+	sh->alive = false;
+	pthread_cond_broadcast (&shards.cond);
+	pthread_mutex_unlock (&shards.lock);
+	return NULL;
+}
+
+// Child side: serve the coordinator on stdin and stdout, numbering the
+// sessions so they tell the shard apart
+static int shard_child(int i, int n, int fd) {
+	int j;
+	for (j = 0; j < i; j++) {
+		close (shards.list[j].fd);
+	}
+	R_FREE (shards.list);
+	pool.next_id = i + 1;
+	pool.id_step = n;
+	dup2 (fd, STDIN_FILENO);
+	dup2 (fd, STDOUT_FILENO);
+	close (fd);
+	return r2mcp_serve (NULL, 0);
+}
+
+static void shard_session_kv_free(HtUPKv *kv) {
+	free (kv->value);
+}
+
+// Fork the shards, no thread may be running yet
+static bool shards_start(int n) {
+	shards.list = R_NEWS0 (R2McpShard, n);
+	int i;
+	for (i = 0; i < n; i++) {
+		R2McpShard *sh = &shards.list[i];
+		int sv[2];
+		if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv)) {
+			R_LOG_ERROR ("Cannot create the shard sockets");
+			break;
+		}
+		sh->pid = fork ();
+		if (sh->pid == 0) {
+			close (sv[0]);
+			_exit (shard_child (i, n, sv[1]));
+		}
+		close (sv[1]);
+		if (sh->pid == -1) {
+			R_LOG_ERROR ("Cannot fork shard %d", i);
+			close (sv[0]);
+			break;
+		}
+		sh->fd = sv[0];
+		sh->alive = true;
+		sh->pending = r_list_new ();
+		pthread_mutex_init (&sh->wlock, NULL);
+	}
+	shards.count = i;
+	if (i < n) {
+		shards_stop ();
+		return false;
+	}
+	shards.paths = ht_pp_new0 ();
+	shards.sessions = ht_up_new (NULL, shard_session_kv_free, NULL);
+	for (i = 0; i < n; i++) {
+		R2McpShard *sh = &shards.list[i];
+		sh->reading = !pthread_create (&sh->reader, NULL, shard_reader, sh);
+		sh->alive = sh->reading;
+	}
+	fprintf (stderr, "Coordinating %d shards\n", n);
+	return true;
+}
+
+// The shards see the end of their input, and are stopped like on Ctrl-C
+// in case they are in the middle of a call
+static void shards_stop(void) {
+	int i;
+	for (i = 0; i < shards.count; i++) {
+		shutdown (shards.list[i].fd, SHUT_RDWR);
+		kill (shards.list[i].pid, SIGTERM);
+	}
+	for (i = 0; i < shards.count; i++) {
+		R2McpShard *sh = &shards.list[i];
+		if (sh->reading) {
+			pthread_join (sh->reader, NULL);
+		}
+		waitpid (sh->pid, NULL, 0);
+		close (sh->fd);
+		r_list_free (sh->pending);
+		pthread_mutex_destroy (&sh->wlock);
+	}
+	shards.count = 0;
+	R_FREE (shards.list);
+	ht_pp_free (shards.paths);
+	shards.paths = NULL;
+	ht_up_free (shards.sessions);
+	shards.sessions = NULL;
+}
+
+// Per call budgets, by tool cost: a wall clock deadline enforced by
+// breaking the session core, and a cap on the result text with a cursor
+// to continue from. R2MCP_TIMEOUT (seconds, one value or cheap,normal,heavy)
+// and R2MCP_MAX_BYTES set them, and the _meta of a tools/call can pass
+// timeout, maxBytes and offset. R2MCP_SESSION_MEMORY caps what a session
+// may hold: its caches are dropped first, then heavy calls are refused.
+typedef struct {
+	ut64 timeout;     // microseconds, 0 for none
+	size_t max_bytes; // of result text, 0 for no limit
+	size_t offset;    // where the text starts, to continue a truncated one
+} R2McpBudget;
+
+static R2McpBudget budgets[R2MCP_COST_COUNT] = {
+	{ 30 * 1000000ULL, 8 * 1024 * 1024, 0 },
+	{ 120 * 1000000ULL, 8 * 1024 * 1024, 0 },
+	{ 900 * 1000000ULL, 8 * 1024 * 1024, 0 },
+};
+static ut64 session_memory_max = 0;
+
+static void budget_init(void) {
+	char *env = r_sys_getenv ("R2MCP_TIMEOUT");
+	if (R_STR_ISNOTEMPTY (env)) {
+		char *p = env;
+		int i, n = 0;
+		while (n < R2MCP_COST_COUNT && *p) {
+			budgets[n++].timeout = (ut64)(strtod (p, &p) * 1000000);
+			if (*p != ',') {
+				break;
+			}
+			p++;
+		}
+		// a single value applies to every cost
+		for (i = n; n == 1 && i < R2MCP_COST_COUNT; i++) {
+			budgets[i].timeout = budgets[0].timeout;
+		}
+	}
+	free (env);
+	env = r_sys_getenv ("R2MCP_MAX_BYTES");
+	if (R_STR_ISNOTEMPTY (env)) {
+		int i;
+		for (i = 0; i < R2MCP_COST_COUNT; i++) {
+			budgets[i].max_bytes = r_num_get (NULL, env);
 		}
 	}
+	free (env);
+	env = r_sys_getenv ("R2MCP_SESSION_MEMORY");
+	if (R_STR_ISNOTEMPTY (env)) {
+		session_memory_max = r_num_get (NULL, env);
+	}
+	free (env);
+}
+
+static void budget_get(R2McpBudget *b, const R2McpTool *tool, const RJson *params) {
+	*b = budgets[tool->cost];
+	if (tool->flags & R2MCP_TOOL_WAITS) {
+		b->timeout = 0;
+	}
+	const RJson *meta = r_json_get (params, "_meta");
+	const RJson *js = meta ? r_json_get (meta, "timeout") : NULL;
+	if (js && (js->type == R_JSON_INTEGER || js->type == R_JSON_DOUBLE)) {
+		const double secs = js->type == R_JSON_DOUBLE ? js->num.dbl_value : (double)js->num.s_value;
+		b->timeout = secs > 0 ? (ut64)(secs * 1000000) : 0;
+	}
+	js = meta ? r_json_get (meta, "maxBytes") : NULL;
+	if (js && js->type == R_JSON_INTEGER) {
+		b->max_bytes = js->num.s_value > 0 ? (size_t)js->num.s_value : 0;
+	}
+	js = meta ? r_json_get (meta, "offset") : NULL;
+	if (js && js->type == R_JSON_INTEGER && js->num.s_value > 0) {
+		b->offset = (size_t)js->num.s_value;
+	}
+}
 
-	pj_k (pj, "result");
-	if (result) {
-		pj_raw (pj, result);
+// Cut the text of a result to its budget, or replace a structured one
+// that does not fit. Takes ownership of res
+static char *budget_finish(char *res, const R2McpBudget *b, bool timed_out) {
+	if (!res || r_str_startswith (res, "{\"jsonrpc\"")) {
+		return res;
+	}
+	const size_t len = strlen (res);
+	const bool big = b->max_bytes && len > b->max_bytes;
+	if (!timed_out && !big && !b->offset) {
+		return res;
+	}
+	char *json = strdup (res);
+	RJson *root = r_json_parse (json);
+	const RJson *content = root ? r_json_get (root, "content") : NULL;
+	const RJson *first = content && content->type == R_JSON_ARRAY ? content->children.first : NULL;
+	const char *text = first ? r_json_get_str (first, "text") : NULL;
+	char *out = NULL;
+	if (!text || r_json_get (root, "structuredContent")) {
+		if (timed_out || big) {
+			char *msg = timed_out
+				? r_str_newf ("Interrupted after the %.1fs budget, no partial result for this format", b->timeout / 1000000.0)
+				: r_str_newf ("The result is %zu bytes, over the %zu bytes budget, use the paging arguments", len, b->max_bytes);
+			out = create_tool_text_response (msg);
+			free (msg);
+		}
 	} else {
-		pj_null (pj);
+		const size_t tlen = strlen (text);
+		const size_t start = R_MIN (b->offset, tlen);
+		size_t end = tlen;
+		if (b->max_bytes && end - start > b->max_bytes) {
+			end = start + b->max_bytes;
+			// do not split an utf8 sequence
+			while (end > start && ((ut8)text[end] & 0xc0) == 0x80) {
+				end--;
+			}
+		}
+		RStrBuf *sb = r_strbuf_new ("");
+		r_strbuf_append_n (sb, text + start, end - start);
+		if (timed_out) {
+			r_strbuf_appendf (sb, "\n-- interrupted after the %.1fs budget, the output is partial", b->timeout / 1000000.0);
+		}
+		if (end < tlen) {
+			r_strbuf_appendf (sb, "\n-- truncated at %zu of %zu bytes, call again with _meta.offset %zu to continue", end, tlen, end);
+		}
+		char *s = r_strbuf_drain (sb);
+		out = create_tool_text_response (s);
+		free (s);
+	}
+	if (out && big) {
+		stats_add (&stats.truncated, 1);
 	}
+	r_json_free (root);
+	free (json);
+	if (out) {
+		free (res);
+		return out;
+	}
+	return res;
+}
 
-	pj_end (pj);
-	char *s = pj_drain (pj);
-	r2mcp_log (">>>");
-	r2mcp_log (s);
-	return s;
+static size_t index_bytes(const R2McpIndex *ix) {
+	return ix ? ix->count * 2 * sizeof (R2McpXref) + ix->ncalls * sizeof (R2McpEdge) : 0;
 }
 
-// Helper function to create a simple text tool result
-static char *create_tool_text_response(const char *text) {
-	PJ *pj = pj_new ();
-	pj_o (pj);
-	pj_k (pj, "content");
-	pj_a (pj);
-	pj_o (pj);
-	pj_ks (pj, "type", "text");
-	pj_ks (pj, "text", text);
-	pj_end (pj);
-	pj_end (pj);
-	pj_end (pj);
-	return pj_drain (pj);
+// Keep the session under the memory ceiling dropping its caches, false
+// when that is not enough for a heavy call to run
+static bool budget_memory(R2McpSession *ss, const R2McpTool *tool) {
+	if (!session_memory_max) {
+		return true;
+	}
+	const ut64 used = ss->mem + ss->memo_bytes + ss->decomp_bytes + index_bytes (ss->index);
+	if (used <= session_memory_max) {
+		return true;
+	}
+	if (ss->mem > session_memory_max) {
+		// dropping the caches would not help, they are kept
+		return tool->cost != R2MCP_COST_HEAVY;
+	}
+	// the cheapest to rebuild go first, only as many as needed
+	R_LOG_INFO ("Session %u over its memory budget, dropping caches", ss->id);
+	memo_clear (ss);
+	if (ss->mem + ss->decomp_bytes + index_bytes (ss->index) > session_memory_max) {
+		decomp_clear (ss);
+	}
+	if (ss->mem + index_bytes (ss->index) > session_memory_max) {
+		index_free (ss->index);
+		ss->index = NULL;
+	}
+	return true;
 }
 
-static char *handle_mcp_request(const char *method, RJson *params, const char *id) {
-	char *error = NULL;
-	char *result = NULL;
+// Deadlines of the running tool calls. The watchdog thread breaks the
+// core of the calls past theirs, the same way a cancellation does
+typedef struct {
+	ut64 at;
+	RConsContext *ctx;
+	bool expired;
+} R2McpDeadline;
+
+static struct {
+	RList *calls; // R2McpDeadline
+	pthread_t th;
+	bool running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} watchdog = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
 
-	if (!assert_capability_for_method (method, &error) || !assert_request_handler_capability (method, &error)) {
-		char *response = create_error_response (-32601, error, id, NULL);
-		free (error);
-		return response;
-	}
+#define R2MCP_WATCHDOG_RETRY 100000
 
-	if (!strcmp (method, "initialize")) {
-		result = handle_initialize (params);
-	} else if (!strcmp (method, "notifications/initialized")) {
-		return NULL; // No response for notifications
-	} else if (!strcmp (method, "ping")) {
-		result = strdup ("{}");
-	} else if (!strcmp (method, "resources/templates/list")) {
-		return create_error_response (-32601, "Method not implemented: templates are not supported", id, NULL);
-	} else if (!strcmp (method, "resources/list")) {
-		return create_error_response (-32601, "Method not implemented: resources are not supported", id, NULL);
-	} else if (!strcmp (method, "resources/read") || !strcmp (method, "resource/read")) {
-		return create_error_response (-32601, "Method not implemented: resources are not supported", id, NULL);
-	} else if (!strcmp (method, "resources/subscribe") || !strcmp (method, "resource/subscribe")) {
-		return create_error_response (-32601, "Method not implemented: subscriptions are not supported", id, NULL);
-	} else if (!strcmp (method, "tools/list") || !strcmp (method, "tool/list")) {
-		result = handle_list_tools (params);
-	} else if (!strcmp (method, "tools/call") || !strcmp (method, "tool/call")) {
-		result = handle_call_tool (params);
-	} else {
-		return create_error_response (-32601, "Unknown method", id, NULL);
+// Breaking an RCons context shared by every core would interrupt the calls
+// on other sessions and the background analyses too, so a late call on one
+// waits until nothing else runs radare2 commands
+static bool watchdog_may_break_locked(R2McpDeadline *dl) {
+	if (r2_cons_own ()) {
+		return true;
 	}
-
-	char *response = create_success_response (result, id);
-	free (result);
-	return response;
+	RListIter *iter;
+	R2McpDeadline *other;
+	r_list_foreach (watchdog.calls, iter, other) {
+		if (other != dl && !other->expired) {
+			return false;
+		}
+	}
+	pthread_mutex_lock (&pool.lock);
+	const bool alone = pool.analyses == 0;
+	pthread_mutex_unlock (&pool.lock);
+	return alone;
 }
 
-static char *handle_list_tools(RJson *params) {
-	// Add pagination support
-	const char *cursor = r_json_get_str (params, "cursor");
-	int page_size = 32; // Default page size XXX pagination doesnt work. just use > len (tools)
-	int start_index = 0;
-
-	// Parse cursor if provided
-	if (cursor) {
-		start_index = atoi (cursor);
-		if (start_index < 0) {
-			start_index = 0;
+static void *watchdog_thread(void *user) {
+	(void)user;
+	pthread_mutex_lock (&watchdog.lock);
+	while (watchdog.running) {
+		const ut64 now = r_time_now_mono ();
+		ut64 next = UT64_MAX;
+		RListIter *iter;
+		R2McpDeadline *dl;
+		r_list_foreach (watchdog.calls, iter, dl) {
+			if (dl->expired) {
+				continue;
+			}
+			if (dl->at <= now && !watchdog_may_break_locked (dl)) {
+				// checked again until the call is alone on the shared RCons
+				next = R_MIN (next, now + R2MCP_WATCHDOG_RETRY);
+			} else if (dl->at <= now) {
+				dl->expired = true;
+				r_cons_context_break (dl->ctx);
+			} else {
+				next = R_MIN (next, dl->at);
+			}
 		}
+		if (next == UT64_MAX) {
+			pthread_cond_wait (&watchdog.cond, &watchdog.lock);
+			continue;
+		}
+		struct timespec ts;
+		clock_gettime (CLOCK_REALTIME, &ts);
+		const ut64 ns = ts.tv_nsec + (next - now) * 1000;
+		ts.tv_sec += ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		pthread_cond_timedwait (&watchdog.cond, &watchdog.lock, &ts);
 	}
+	pthread_mutex_unlock (&watchdog.lock);
+	return NULL;
+}
 
-	// Use more straightforward JSON construction for tools list
-	RStrBuf *sb = r_strbuf_new ("");
-	r_strbuf_append (sb, "{\"tools\":[");
-
-	// Define our tools with their descriptions and schemas
-	// Format: {name, description, schema_definition}
-	const char *tools[26][3] = {
-		{ "openFile",
-			"Open given file with radare2 to start the analysis",
-			"{\"type\":\"object\",\"properties\":{\"filePath\":{\"type\":\"string\",\"description\":\"Path to the file to open\"}},\"required\":[\"filePath\"]}" },
-		{ "closeFile",
-			"Close the currently open file",
-			"{\"type\":\"object\",\"properties\":{}}" },
-		{ "listFunctions",
-			"List all functions found after the analysis",
-			"{\"type\":\"object\",\"properties\":{}}" },
-		{ "listLibraries",
-			"List libraries linked to this binary",
-			"{\"type\":\"object\",\"properties\":{}}" },
-		{ "listImports",
-			"Enumerate all the symbols imported in the binary",
-			"{\"type\":\"object\",\"properties\":{}}" },
-		{ "listSections",
-			"Show program sections and segments",
-			"{\"type\":\"object\",\"properties\":{}}" },
-		{ "showFunctionDetails",
-			"Show function details",
-			"{\"type\":\"object\",\"properties\":{}}" },
-		{ "getCurrentAddress",
-			"Get name and address for the current offset",
-			"{\"type\":\"object\",\"properties\":{}}" },
-		{ "showHeaders",
-			"Show program headers details and information from the binary",
-			"{\"type\":\"object\",\"properties\":{}}" },
-		{ "listSymbols",
-			"Enumerate all the symbols exported from the binary",
-			"{\"type\":\"object\",\"properties\":{}}" },
-		{ "listEntrypoints",
-			"Enumerate entrypoints, constructor functions and main",
-			"{\"type\":\"object\",\"properties\":{}}" },
-		{ "listMethods",
-			"Enumerate methods for the given class",
-			"{\"type\":\"object\",\"properties\":{\"classname\":{\"type\":\"string\",\"description\":\"Name of the class to list its methods\"}},\"required\":[\"classname\"]}" },
-		{ "listClasses",
-			"List C++, ObjC, Swift, Java, Dalvik class names",
-			"{\"type\":\"object\",\"properties\":{\"regexpFilter\":{\"type\":\"string\",\"description\":\"Regular expression to filter the results\"}}}" },
-		{ "listDecompilers",
-			"List all the decompilers available for radare2",
-			"{\"type\":\"object\",\"properties\":{}}" },
-		{ "renameFunction",
-			"Change the name of the function located in given address",
-			"{\"type\":\"object\",\"properties\":{\"name\":{\"type\":\"string\",\"description\":\"Name of the decompiler\"},\"address\":{\"type\":\"string\",\"description\":\"address of the function to rename\"}},\"required\":[\"name\",\"address\"]}" },
-		{ "useDecompiler",
-			"Select a different decompiler backend",
-			"{\"type\":\"object\",\"properties\":{\"name\":{\"type\":\"string\",\"description\":\"Name of the decompiler\"}},\"required\":[\"name\"]}" },
-		{ "getFunctionPrototype",
-			"Get the signature / prototype for the function in the given address",
-			"{\"type\":\"object\",\"properties\":{\"address\":{\"type\":\"string\",\"description\":\"Address to put the comment in\"},\"prototype\":{\"type\":\"string\",\"description\":\"function signature or prototype description\"}},\"required\":[\"address\"]}" },
-		{ "setFunctionPrototype",
-			"Define the function signature (return type, symbol name and argument types and names)",
-			"{\"type\":\"object\",\"properties\":{\"address\":{\"type\":\"string\",\"description\":\"Address to put the comment in\"},\"prototype\":{\"type\":\"string\",\"description\":\"function signature or prototype description\"}},\"required\":[\"address\",\"prototype\"]}" },
-		{ "setComment",
-			"List strings in the rodata section of the binary matching the given regexp",
-			"{\"type\":\"object\",\"properties\":{\"address\":{\"type\":\"string\",\"description\":\"Address to put the comment in\"},\"message\":{\"type\":\"string\",\"description\":\"comment text to use\"}},\"required\":[\"address\",\"message\"]}" },
-		{ "listStrings",
-			"List strings in the rodata section of the binary matching the given regexp",
-			"{\"type\":\"object\",\"properties\":{\"regexpFilter\":{\"type\":\"string\",\"description\":\"Regular expression to filter the results\"}}}" },
-		{ "listAllStrings",
-			"Scan the whole binary looking for hardcoded strings matching the given regexp if specified (consider using this method when analyzing malware)",
-			"{\"type\":\"object\",\"properties\":{\"regexpFilter\":{\"type\":\"string\",\"description\":\"Regular expression to filter the results\"}}}" },
-#if 0
-		{ "runCommand", // TODO: optional
-			"Run a radare2 command and get the output",
-			"{\"type\":\"object\",\"properties\":{\"command\":{\"type\":\"string\",\"description\":\"Command to execute\"}},\"required\":[\"command\"]}" },
-#endif
-		{ "analyze",
-			"Run analysis on the current file",
-			"{\"type\":\"object\",\"properties\":{\"level\":{\"type\":\"number\",\"description\":\"Analysis level (0, 1, 2, 3, 4)\"}},\"required\":[]}" },
-		{ "xrefsTo",
-			"List all the references to the given address",
-			"{\"type\":\"object\",\"properties\":{\"address\":{\"type\":\"string\",\"description\":\"Address of the address to check for crossed references\"}},\"required\":[\"address\"]}" },
-		{ "decompileFunction",
-			"Decompile function at given address, consider using this method instead of disassembleFunction",
-			"{\"type\":\"object\",\"properties\":{\"address\":{\"type\":\"string\",\"description\":\"Address of the function to decompile\"}},\"required\":[\"address\"]}" },
-		{ "disassembleFunction",
-			"Disassemble function at given address",
-			"{\"type\":\"object\",\"properties\":{\"address\":{\"type\":\"string\",\"description\":\"Address of the function to disassemble\"}},\"required\":[\"address\"]}" },
-		{ "disassemble",
-			"Disassemble (numInstructions) at a given address",
-			"{\"type\":\"object\",\"properties\":{\"address\":{\"type\":\"string\",\"description\":\"Address to start disassembly\"},\"numInstructions\":{\"type\":\"integer\",\"description\":\"Number of instructions to disassemble\"}},\"required\":[\"address\"]}" }
-	};
+static void watchdog_start(void) {
+	watchdog.calls = r_list_new ();
+	watchdog.running = true;
+	if (pthread_create (&watchdog.th, NULL, watchdog_thread, NULL)) {
+		R_LOG_WARN ("Cannot create watchdog thread, tool calls have no deadline");
+		watchdog.running = false;
+	}
+}
 
-	int total_tools = sizeof (tools) / sizeof (tools[0]);
-	int end_index = start_index + page_size;
-	if (end_index > total_tools) {
-		end_index = total_tools;
+static void watchdog_stop(void) {
+	pthread_mutex_lock (&watchdog.lock);
+	const bool running = watchdog.running;
+	watchdog.running = false;
+	pthread_cond_signal (&watchdog.cond);
+	pthread_mutex_unlock (&watchdog.lock);
+	if (running) {
+		pthread_join (watchdog.th, NULL);
 	}
+	r_list_free (watchdog.calls);
+	watchdog.calls = NULL;
+}
 
-	// Add tools for this page
-	for (int i = start_index; i < end_index; i++) {
-		if (i > start_index) {
-			r_strbuf_appendf (sb, ",");
-		}
-		r_strbuf_appendf (sb, "{\"name\":\"%s\",\"description\":\"%s\",\"inputSchema\":%s}",
-			tools[i][0], tools[i][1], tools[i][2]);
+static void watchdog_add(R2McpDeadline *dl, RConsContext *ctx, ut64 timeout) {
+	dl->at = r_time_now_mono () + timeout;
+	dl->ctx = ctx;
+	dl->expired = false;
+	pthread_mutex_lock (&watchdog.lock);
+	if (watchdog.running) {
+		r_list_append (watchdog.calls, dl);
+		pthread_cond_signal (&watchdog.cond);
 	}
+	pthread_mutex_unlock (&watchdog.lock);
+}
 
-	r_strbuf_append (sb, "]");
+// Returns true if the deadline passed and the core was broken
+static bool watchdog_remove(R2McpDeadline *dl) {
+	pthread_mutex_lock (&watchdog.lock);
+	r_list_delete_data (watchdog.calls, dl);
+	const bool expired = dl->expired;
+	pthread_mutex_unlock (&watchdog.lock);
+	return expired;
+}
 
-	// Add nextCursor if there are more tools
-	if (end_index < total_tools) {
-		r_strbuf_appendf (sb, ",\"nextCursor\":\"%d\"", end_index);
+static void stats_tool(const R2McpTool *tool, ut64 us, const char *res, bool hit) {
+	R2McpToolStats *ts = &stats.tools[tool - tools];
+	int b = 0;
+	while (b < R2MCP_HIST_BUCKETS - 1 && us > r2mcp_hist_le[b]) {
+		b++;
+	}
+	stats_add (&ts->calls, 1);
+	stats_add (&ts->us, us);
+	stats_add (&ts->hist[b], 1);
+	stats_max (&ts->max_us, us);
+	if (hit) {
+		stats_add (&ts->memo_hits, 1);
+	}
+	if (!res || r_str_startswith (res, "{\"jsonrpc\"")) {
+		stats_add (&ts->errors, 1);
+	} else {
+		stats_add (&ts->bytes_out, strlen (res));
 	}
-
-	r_strbuf_appendf (sb, "}");
-	return r_strbuf_drain (sb);
 }
 
-static char *handle_call_tool(RJson *params) {
-	const char *tool_name = r_json_get_str (params, "name");
+// Tool calls of a coordinator: the session tools run on the shard of the
+// session, the others here
+static char *shard_invoke(const char *name, RJson *params, ut32 session) {
+	const R2McpTool *tool = tool_find (name);
+	if (!tool || !(tool->flags & R2MCP_TOOL_SESSION)) {
+		return tool_invoke (NULL, name, params);
+	}
+	const ut64 start = r_time_now_mono ();
+	char *res = shard_call_tool (tool, params, session);
+	stats_tool (tool, r_time_now_mono () - start, res, false);
+	return res;
+}
 
+// Run a tool, memoizing the results of the read-only ones. params holds
+// the arguments and runs with the session core claimed
+static char *tool_invoke(R2McpSession *ss, const char *tool_name, RJson *params) {
 	if (!tool_name) {
 		return create_error_response (-32602, "Missing required parameter: name", NULL, NULL);
 	}
-
-	RJson *tool_args = (RJson *)r_json_get (params, "arguments");
-
-	// Handle openFile tool
-	if (!strcmp (tool_name, "openFile")) {
-		const char *filepath = r_json_get_str (tool_args, "filePath");
-		if (!filepath) {
-			return create_error_response (-32602, "Missing required parameter: filePath", NULL, NULL);
-		}
-
-		bool success = r2_open_file (filepath);
-		return create_tool_text_response (success ? "File opened successfully." : "Failed to open file.");
+	const R2McpTool *tool = tool_find (tool_name);
+	if (!tool) {
+		char *msg = r_str_newf ("Unknown tool: %s", tool_name);
+		char *res = create_error_response (-32602, msg, NULL, NULL);
+		free (msg);
+		return res;
+	}
+	if (shards.count && (tool->flags & R2MCP_TOOL_SESSION)) {
+		return shard_invoke (tool_name, params, 0);
 	}
-	if (!file_opened) {
+	if ((tool->flags & R2MCP_TOOL_SESSION) && !ss) {
 		return create_error_response (-32611, "Use the openFile method before calling any other method", NULL, NULL);
-		// return create_tool_text_response ("Use the openFile method toNo file was open.");
 	}
-	// Handle listMethods tool
-	if (!strcmp (tool_name, "listMethods")) {
-		const char *classname = r_json_get_str (tool_args, "classname");
-		if (!classname) {
-			return create_tool_text_response ("Missing classname parameter");
-		}
-		char *cmd = r_str_newf ("'ic %s", classname);
-		char *res = r2_cmd (cmd);
-		free (cmd);
-		char *o = create_tool_text_response (res);
-		free (res);
-		return o;
+	R2McpToolCall tc = {
+		.tool = tool,
+		.ss = (tool->flags & R2MCP_TOOL_SESSION) ? ss : NULL,
+		.params = params,
+		.args = (RJson *)r_json_get (params, "arguments"),
+	};
+	R2McpBudget budget;
+	budget_get (&budget, tool, params);
+	if (tc.ss && !budget_memory (tc.ss, tool)) {
+		stats_add (&stats.refused, 1);
+		return create_error_response (-32000, "The session is over its memory budget, close some files or raise R2MCP_SESSION_MEMORY", NULL, NULL);
 	}
-
-	// Handle listClasses tool
-	if (!strcmp (tool_name, "listClasses")) {
-		const char *filter = r_json_get_str (tool_args, "filter");
-		char *res = r2_cmd ("icqq");
-		if (R_STR_ISNOTEMPTY (filter)) {
-			RStrBuf *sb = r_strbuf_new ("");
-			RList *strings = r_str_split_list (res, "\n", 0);
-			RListIter *iter;
-			const char *str;
-			RRegex rx;
-			int re_flags = r_regex_flags ("e");
-			bool ok = r_regex_init (&rx, filter, re_flags);
-			if (ok) {
-				r_list_foreach (strings, iter, str) {
-					if (r_regex_exec (&rx, str, 0, 0, 0) == 0) {
-						r_strbuf_appendf (sb, "%s\n", str);
-					}
-				}
-				r_regex_fini (&rx);
-			} else {
-				R_LOG_ERROR ("Invalid regex: %s", filter);
-			}
-			free (res);
-			res = r_strbuf_drain (sb);
+	const ut64 start = r_time_now_mono ();
+	char *key = NULL;
+	char *res = NULL;
+	bool timed_out = false;
+	if (tool->flags & R2MCP_TOOL_READONLY) {
+		key = memo_key (tool_name, tc.args);
+		res = memo_get (ss, key);
+	}
+	const bool hit = res != NULL;
+	if (!res) {
+		R2McpDeadline dl;
+		RConsContext *ctx = tc.ss ? tc.ss->core->cons->context : NULL;
+		if (ctx && budget.timeout) {
+			watchdog_add (&dl, ctx, budget.timeout);
+		}
+		res = tool->fn (&tc);
+		// errors and interrupted commands are not remembered
+		if (key && res && r_str_startswith (res, "{\"content\"") && !ss->core->cons->context->breaked) {
+			memo_put (ss, key, res);
+		}
+		if (ctx && budget.timeout && watchdog_remove (&dl)) {
+			// the session stayed claimed, so this is still its core
+			ctx->breaked = false;
+			stats_add (&stats.timeouts, 1);
+			timed_out = true;
 		}
-		char *o = create_tool_text_response (res);
-		free (res);
-		return o;
 	}
-
-	// Handle listDecompilers tool
-	if (!strcmp (tool_name, "listDecompilers")) {
-		char *res = r2_cmd ("e cmd.pdc=?");
-		char *o = create_tool_text_response (res);
-		free (res);
-		return o;
+	free (key);
+	res = budget_finish (res, &budget, timed_out);
+	if (!prefetch_self) {
+		stats_tool (tool, r_time_now_mono () - start, res, hit);
 	}
+	return res;
+}
 
-	// Handle listFunctions tool
-	if (!strcmp (tool_name, "listFunctions")) {
-		char *res = r2_cmd ("afl,addr/cols/name");
-		char *o = create_tool_text_response (res);
-		free (res);
-		return o;
-	}
+static char *handle_call_tool(RJson *params, R2McpSession *ss) {
+	return tool_invoke (ss, r_json_get_str (params, "name"), params);
+}
 
-	// Handle listImports tool
-	if (!strcmp (tool_name, "listImports")) {
-		char *res = r2_cmd ("iiq");
-		char *o = create_tool_text_response (res);
-		free (res);
-		return o;
-	}
+// Method handlers return the whole response, or NULL for notifications
+static char *method_result(char *result, const char *id) {
+	char *response = create_success_response (result, id);
+	free (result);
+	return response;
+}
 
-	// Handle listSections tool
-	if (!strcmp (tool_name, "listSections")) {
-		char *res = r_core_cmd_str (r_core, "iS;iSS");
-		char *o = create_tool_text_response (res);
-		free (res);
-		return o;
-	}
+static char *method_initialize(RJson *params, const char *id) {
+	return method_result (handle_initialize (params), id);
+}
 
-	// Handle showHeaders tool
-	if (!strcmp (tool_name, "showHeaders")) {
-		char *res = r_core_cmd_str (r_core, "i;iH");
-		char *o = create_tool_text_response (res);
-		free (res);
-		return o;
-	}
+static char *method_initialized(RJson *params, const char *id) {
+	(void)params;
+	(void)id;
+	return NULL; // No response for notifications
+}
 
-	// Handle showFunctionDetails tool
-	if (!strcmp (tool_name, "showFunctionDetails")) {
-		char *res = r_core_cmd_str (r_core, "afi");
-		char *o = create_tool_text_response (res);
-		free (res);
-		return o;
-	}
+static char *method_ping(RJson *params, const char *id) {
+	(void)params;
+	return method_result (strdup ("{}"), id);
+}
 
-	// Handle getCurrentAddress tool
-	if (!strcmp (tool_name, "getCurrentAddress")) {
-		char *res = r_core_cmd_str (r_core, "s;fd");
-		char *o = create_tool_text_response (res);
-		free (res);
-		return o;
+static char *method_set_level(RJson *params, const char *id) {
+	const int level = r2mcp_log_level_from_name (r_json_get_str (params, "level"));
+	if (level == -1 || level == R2MCP_LOGLVL_OFF) {
+		return create_error_response (-32602, "Invalid log level", id, NULL);
 	}
+	r2mcp_log_set_level (level);
+	return method_result (strdup ("{}"), id);
+}
 
-	// Handle listSymbols tool
-	if (!strcmp (tool_name, "listSymbols")) {
-		char *res = r_core_cmd_str (r_core, "isq~!func.,!imp.");
-		// TODO: remove imports and func
-		char *o = create_tool_text_response (res);
-		free (res);
-		return o;
-	}
+static char *method_list_tools(RJson *params, const char *id) {
+	return method_result (handle_list_tools (params), id);
+}
 
-	// Handle listEntrypoints tool
-	if (!strcmp (tool_name, "listEntrypoints")) {
-		char *res = r_core_cmd_str (r_core, "ies");
-		char *o = create_tool_text_response (res);
-		free (res);
-		return o;
+static char *method_call_tool(RJson *params, const char *id) {
+	R2McpSession *ss = NULL;
+	char *result;
+	if (!session_acquire (params, &ss)) {
+		result = create_error_response (-32602, "Unknown session, use openFile or listSessions", NULL, NULL);
+	} else {
+		const bool gate = r2_cons_gate_enter ();
+		result = handle_call_tool (params, ss);
+		r2_cons_gate_leave (gate);
+		session_release (ss);
 	}
+	return method_result (result, id);
+}
 
-	// Handle listLibraries tool
-	if (!strcmp (tool_name, "listLibraries")) {
-		char *res = r_core_cmd_str (r_core, "ilq");
-		char *o = create_tool_text_response (res);
-		free (res);
-		return o;
-	}
+// Method registry, methods without a handler answer with their error
+typedef struct {
+	const char *name;
+	char *(*fn)(RJson *params, const char *id);
+	const char *error;
+} R2McpMethod;
+
+static const R2McpMethod methods[] = {
+	{ "initialize", method_initialize, NULL },
+	{ "notifications/initialized", method_initialized, NULL },
+	{ "ping", method_ping, NULL },
+	{ "logging/setLevel", method_set_level, NULL },
+	{ "resources/templates/list", NULL, "Method not implemented: templates are not supported" },
+	{ "resources/list", NULL, "Method not implemented: resources are not supported" },
+	{ "resources/read", NULL, "Method not implemented: resources are not supported" },
+	{ "resource/read", NULL, "Method not implemented: resources are not supported" },
+	{ "resources/subscribe", NULL, "Method not implemented: subscriptions are not supported" },
+	{ "resource/subscribe", NULL, "Method not implemented: subscriptions are not supported" },
+	{ "tools/list", method_list_tools, NULL },
+	{ "tool/list", method_list_tools, NULL },
+	{ "tools/call", method_call_tool, NULL },
+	{ "tool/call", method_call_tool, NULL },
+};
 
-	// Handle closeFile tool
-	if (!strcmp (tool_name, "closeFile")) {
-		char filepath_copy[1024];
-		strncpy (filepath_copy, current_file, sizeof (filepath_copy) - 1);
-		if (r_core) {
-			r_core_cmd0 (r_core, "o-*");
-			file_opened = false;
-			memset (current_file, 0, sizeof (current_file));
-		}
+// Name lookups for both registries, built once and never modified, so they
+// are read without locking
+static HtPP *tools_ht = NULL;
+static HtPP *methods_ht = NULL;
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
 
-		return create_tool_text_response ("File closed successfully.");
+static void registry_init(void) {
+	size_t i;
+	tools_ht = ht_pp_new (NULL, NULL, NULL);
+	for (i = 0; i < TOOLS_COUNT; i++) {
+		ht_pp_insert (tools_ht, tools[i].name, (void *)&tools[i]);
+	}
+	stats.tools = R_NEWS0 (R2McpToolStats, TOOLS_COUNT);
+	methods_ht = ht_pp_new (NULL, NULL, NULL);
+	for (i = 0; i < sizeof (methods) / sizeof (methods[0]); i++) {
+		ht_pp_insert (methods_ht, methods[i].name, (void *)&methods[i]);
 	}
+	tools_list_init ();
+}
 
-#if 0
-	// Handle runCommand tool
-	if (!strcmp (tool_name, "runCommand")) {
-		if (!r_core || !file_opened) {
-			return strdup ("Error: No file is open");
-		}
-		const char *command = r_json_get_str (tool_args, "command");
-		if (!command) {
-			return create_error_response (-32602, "Missing required parameter: command", NULL, NULL);
-		}
+static const R2McpTool *tool_find(const char *name) {
+	pthread_once (&registry_once, registry_init);
+	return name ? ht_pp_find (tools_ht, name, NULL) : NULL;
+}
 
-		char *result = r2_cmd (command);
-		char *response = create_tool_text_response (result);
-		free (result);
-		return response;
+static char *tool_server_stats(R2McpToolCall *tc) {
+	pthread_once (&registry_once, registry_init);
+	const bool json = tool_json (tc);
+	RStrBuf *sb = json ? NULL : r_strbuf_new ("");
+	PJ *pj = json ? pj_new () : NULL;
+	const ut64 uptime = r_time_now_mono () - stats.started;
+	const ut64 rss = stats_rss ();
+	size_t i;
+	int b;
+	if (json) {
+		pj_o (pj);
+		pj_kn (pj, "uptime_us", uptime);
+		pj_kn (pj, "messages", stats.messages);
+		pj_kn (pj, "bytes_in", stats.bytes_in);
+		pj_kn (pj, "bytes_out", stats.bytes_out);
+		pj_kn (pj, "prefetched", stats.prefetched);
+		pj_kn (pj, "timeouts", stats.timeouts);
+		pj_kn (pj, "truncated", stats.truncated);
+		pj_kn (pj, "refused", stats.refused);
+		pj_kn (pj, "rss", rss);
+		pj_ko (pj, "phases");
+	} else {
+		r_strbuf_appendf (sb, "uptime: %.1fs\nmessages: %" PFMT64u ", %" PFMT64u " bytes in, %" PFMT64u " bytes out\n"
+			"prefetched: %" PFMT64u " calls\nbudgets: %" PFMT64u " timeouts, %" PFMT64u " truncated, %" PFMT64u " refused\n"
+			"rss: %.1f MB\nphases:\n", uptime / 1000000.0, stats.messages, stats.bytes_in, stats.bytes_out,
+			stats.prefetched, stats.timeouts, stats.truncated, stats.refused, rss / 1048576.0);
 	}
-#endif
-	// Handle setComment tool
-	if (!strcmp (tool_name, "setComment")) {
-		const char *address = r_json_get_str (tool_args, "address");
-		const char *message = r_json_get_str (tool_args, "message");
-		if (!address || !message) {
-			return create_error_response (-32602, "Missing required parameters: address and message", NULL, NULL);
+	for (i = 0; i < R2MCP_PHASE_COUNT; i++) {
+		if (json) {
+			pj_ko (pj, r2mcp_phase_names[i]);
+			pj_kn (pj, "calls", stats.phase_calls[i]);
+			pj_kn (pj, "us", stats.phase_us[i]);
+			pj_end (pj);
+		} else {
+			r_strbuf_appendf (sb, "  %s: %" PFMT64u " calls, %.1f ms\n", r2mcp_phase_names[i],
+				stats.phase_calls[i], stats.phase_us[i] / 1000.0);
 		}
-
-		r_core_cmdf (r_core, "'@%s'%s", address, message);
-		return strdup ("ok");
 	}
-
-	// Handle setFunctionPrototype tool
-	if (!strcmp (tool_name, "setFunctionPrototype")) {
-		const char *address = r_json_get_str (tool_args, "address");
-		const char *prototype = r_json_get_str (tool_args, "prototype");
-		if (!address || !prototype) {
-			return create_error_response (-32602, "Missing required parameters: address and prototype", NULL, NULL);
-		}
-		r_core_cmdf (r_core, "'@%s'afs %s", address, prototype);
-		return strdup ("ok");
+	if (json) {
+		pj_end (pj);
+		pj_ka (pj, "tools");
+	} else {
+		r_strbuf_append (sb, "tools:\n");
 	}
-
-	// Handle getFunctionPrototype tool
-	if (!strcmp (tool_name, "getFunctionPrototype")) {
-		const char *address = r_json_get_str (tool_args, "address");
-		if (!address) {
-			return create_error_response (-32602, "Missing required parameters: address", NULL, NULL);
+	for (i = 0; i < TOOLS_COUNT; i++) {
+		const R2McpToolStats *ts = &stats.tools[i];
+		if (!ts->calls) {
+			continue;
 		}
-		char *s = r_str_newf ("'@%s'afs", address);
-		char *res = r2_cmd (s);
-		free (s);
-		return res;
-	}
-
-	// Handle listStrings tool
-	if (!strcmp (tool_name, "listStrings")) {
-		const char *filter = r_json_get_str (tool_args, "filter");
-
-		char *result = r2_cmd ("izqq");
-		if (R_STR_ISNOTEMPTY (filter)) {
-			RStrBuf *sb = r_strbuf_new ("");
-			RList *strings = r_str_split_list (result, "\n", 0);
-			RListIter *iter;
-			const char *str;
-			RRegex rx;
-			int re_flags = r_regex_flags ("e");
-			bool ok = r_regex_init (&rx, filter, re_flags);
-			if (ok) {
-				r_list_foreach (strings, iter, str) {
-					if (r_regex_exec (&rx, str, 0, 0, 0) == 0) {
-						r_strbuf_appendf (sb, "%s\n", str);
-					}
+		if (json) {
+			pj_o (pj);
+			pj_ks (pj, "name", tools[i].name);
+			pj_kn (pj, "calls", ts->calls);
+			pj_kn (pj, "errors", ts->errors);
+			pj_kn (pj, "memo_hits", ts->memo_hits);
+			pj_kn (pj, "us", ts->us);
+			pj_kn (pj, "max_us", ts->max_us);
+			pj_kn (pj, "bytes_out", ts->bytes_out);
+			pj_ka (pj, "histogram");
+			for (b = 0; b < R2MCP_HIST_BUCKETS; b++) {
+				pj_o (pj);
+				if (b < R2MCP_HIST_BUCKETS - 1) {
+					pj_kn (pj, "le_us", r2mcp_hist_le[b]);
 				}
-				r_regex_fini (&rx);
-			} else {
-				R_LOG_ERROR ("Invalid regex: %s", filter);
+				pj_kn (pj, "count", ts->hist[b]);
+				pj_end (pj);
 			}
-			free (result);
-			result = r_strbuf_drain (sb);
+			pj_end (pj);
+			pj_end (pj);
+		} else {
+			r_strbuf_appendf (sb, "  %s: %" PFMT64u " calls, %" PFMT64u " errors, %" PFMT64u " cached, "
+				"avg %.1f ms, max %.1f ms, %" PFMT64u " bytes\n", tools[i].name, ts->calls, ts->errors,
+				ts->memo_hits, ts->us / 1000.0 / ts->calls, ts->max_us / 1000.0, ts->bytes_out);
 		}
-		char *response = create_tool_text_response (result);
-		free (result);
-		return response;
 	}
-
-	// Handle listAllStrings tool
-	if (!strcmp (tool_name, "listAllStrings")) {
-		const char *filter = r_json_get_str (tool_args, "filter");
-
-		char *result = r2_cmd ("izzzqq");
-		if (R_STR_ISNOTEMPTY (filter)) {
-			RStrBuf *sb = r_strbuf_new ("");
-			RList *strings = r_str_split_list (result, "\n", 0);
-			RListIter *iter;
-			const char *str;
-			RRegex rx;
-			int re_flags = r_regex_flags ("e");
-			bool ok = r_regex_init (&rx, filter, re_flags);
-			if (ok) {
-				r_list_foreach (strings, iter, str) {
-					if (r_regex_exec (&rx, str, 0, 0, 0) == 0) {
-						r_strbuf_appendf (sb, "%s\n", str);
-					}
-				}
-				r_regex_fini (&rx);
-			} else {
-				R_LOG_ERROR ("Invalid regex: %s", filter);
-			}
-			free (result);
-			result = r_strbuf_drain (sb);
+	if (json) {
+		pj_end (pj);
+		pj_ka (pj, "sessions");
+	} else {
+		r_strbuf_append (sb, "sessions:\n");
+	}
+	RListIter *iter;
+	R2McpSession *ss;
+	pthread_mutex_lock (&pool.lock);
+	r_list_foreach (pool.sessions, iter, ss) {
+		const int functions = r_list_length (ss->core->anal->fcns);
+		const ut64 total = ss->memo_hits + ss->memo_misses;
+		if (json) {
+			pj_o (pj);
+			pj_kn (pj, "id", ss->id);
+			pj_ks (pj, "path", ss->path);
+			pj_ki (pj, "functions", functions);
+			pj_kn (pj, "memo_hits", ss->memo_hits);
+			pj_kn (pj, "memo_misses", ss->memo_misses);
+			pj_kn (pj, "memo_bytes", ss->memo_bytes);
+			pj_kn (pj, "memory", ss->mem);
+			pj_end (pj);
+		} else {
+			r_strbuf_appendf (sb, "  %u %s: %d functions, %.1f%% of %" PFMT64u " calls cached in %zu bytes, memory %.1f MB\n",
+				ss->id, ss->path, functions, total ? 100.0 * ss->memo_hits / total : 0.0, total,
+				ss->memo_bytes, ss->mem / 1048576.0);
 		}
-		char *response = create_tool_text_response (result);
-		free (result);
-		return response;
 	}
-
-	// Handle analyze tool
-	if (!strcmp (tool_name, "analyze")) {
-		const int level = r_json_get_num (tool_args, "level");
-		r2_analyze (level);
-		char *result = r2_cmd ("aflc");
-		char *text = format_string ("Analysis completed with level %d.\n\nfound %d functions", level, atoi (result));
-		char *response = create_tool_text_response (text);
-		free (result);
-		free (text);
-		return response;
+	pthread_mutex_unlock (&pool.lock);
+	if (!json) {
+		char *res = r_strbuf_drain (sb);
+		char *o = create_tool_text_response (res);
+		free (res);
+		return o;
 	}
+	pj_end (pj);
+	pj_end (pj);
+	char *res = pj_drain (pj);
+	char *o = create_tool_json_response (res, "Server metrics in structuredContent");
+	free (res);
+	return o;
+}
 
-	// Handle disassemble tool
-	if (!strcmp (tool_name, "disassemble")) {
-		const char *address = r_json_get_str (tool_args, "address");
-		if (!address) {
-			return create_error_response (-32602, "Missing required parameter: address", NULL, NULL);
-		}
-
-		// Use const_cast pattern
-		RJson *num_instr_json = (RJson *)r_json_get (tool_args, "numInstructions");
-		int num_instructions = 10;
-		if (num_instr_json && num_instr_json->type == R_JSON_INTEGER) {
-			num_instructions = (int)num_instr_json->num.u_value;
-		}
-
-		char *cmd = r_str_newf ("'@%s'pd %d", address, num_instructions);
-		char *disasm = r2_cmd (cmd);
-		free (cmd);
-		char *response = create_tool_text_response (disasm);
-		free (disasm);
-		return response;
+// The same metrics in the Prometheus text exposition format
+static char *stats_prometheus(void) {
+	pthread_once (&registry_once, registry_init);
+	RStrBuf *sb = r_strbuf_new ("");
+	r_strbuf_appendf (sb, "# TYPE r2mcp_uptime_seconds gauge\nr2mcp_uptime_seconds %.3f\n",
+		(r_time_now_mono () - stats.started) / 1000000.0);
+	r_strbuf_appendf (sb, "# TYPE r2mcp_messages_total counter\nr2mcp_messages_total %" PFMT64u "\n", stats.messages);
+	r_strbuf_appendf (sb, "# TYPE r2mcp_received_bytes_total counter\nr2mcp_received_bytes_total %" PFMT64u "\n", stats.bytes_in);
+	r_strbuf_appendf (sb, "# TYPE r2mcp_sent_bytes_total counter\nr2mcp_sent_bytes_total %" PFMT64u "\n", stats.bytes_out);
+	r_strbuf_appendf (sb, "# TYPE r2mcp_prefetched_calls_total counter\nr2mcp_prefetched_calls_total %" PFMT64u "\n", stats.prefetched);
+	r_strbuf_appendf (sb, "# TYPE r2mcp_timeouts_total counter\nr2mcp_timeouts_total %" PFMT64u "\n", stats.timeouts);
+	r_strbuf_appendf (sb, "# TYPE r2mcp_truncated_total counter\nr2mcp_truncated_total %" PFMT64u "\n", stats.truncated);
+	r_strbuf_appendf (sb, "# TYPE r2mcp_refused_total counter\nr2mcp_refused_total %" PFMT64u "\n", stats.refused);
+	r_strbuf_appendf (sb, "# TYPE r2mcp_resident_memory_bytes gauge\nr2mcp_resident_memory_bytes %" PFMT64u "\n", stats_rss ());
+	size_t i;
+	int b;
+	r_strbuf_append (sb, "# TYPE r2mcp_phase_seconds_total counter\n");
+	for (i = 0; i < R2MCP_PHASE_COUNT; i++) {
+		r_strbuf_appendf (sb, "r2mcp_phase_seconds_total{phase=\"%s\"} %.6f\n", r2mcp_phase_names[i], stats.phase_us[i] / 1000000.0);
 	}
-
-	// Handle useDecompiler tool
-	if (!strcmp (tool_name, "useDecompiler")) {
-		const char *deco = r_json_get_str (tool_args, "useDecompiler");
-		if (!deco) {
-			return create_error_response (-32602, "Missing required parameter: address", NULL, NULL);
-		}
-		char *decompilersAvailable = r_core_cmd_str (r_core, "e cmd.pdc=?");
-		const char *response = "ok";
-		if (strstr (deco, "ghidra")) {
-			if (strstr (decompilersAvailable, "pdg")) {
-				r_core_cmd0 (r_core, "-e cmd.pdc=pdg");
-			} else {
-				response = "This decompiler is not available";
-			}
-		} else if (strstr (deco, "decai")) {
-			if (strstr (decompilersAvailable, "decai")) {
-				r_core_cmd0 (r_core, "-e cmd.pdc=decai -d");
-			} else {
-				response = "This decompiler is not available";
-			}
-		} else if (strstr (deco, "r2dec")) {
-			if (strstr (decompilersAvailable, "pdd")) {
-				r_core_cmd0 (r_core, "-e cmd.pdc=pdd");
+	r_strbuf_append (sb, "# TYPE r2mcp_tool_errors_total counter\n");
+	for (i = 0; i < TOOLS_COUNT; i++) {
+		r_strbuf_appendf (sb, "r2mcp_tool_errors_total{tool=\"%s\"} %" PFMT64u "\n", tools[i].name, stats.tools[i].errors);
+	}
+	r_strbuf_append (sb, "# TYPE r2mcp_tool_cached_total counter\n");
+	for (i = 0; i < TOOLS_COUNT; i++) {
+		r_strbuf_appendf (sb, "r2mcp_tool_cached_total{tool=\"%s\"} %" PFMT64u "\n", tools[i].name, stats.tools[i].memo_hits);
+	}
+	r_strbuf_append (sb, "# TYPE r2mcp_tool_duration_seconds histogram\n");
+	for (i = 0; i < TOOLS_COUNT; i++) {
+		const R2McpToolStats *ts = &stats.tools[i];
+		ut64 count = 0;
+		for (b = 0; b < R2MCP_HIST_BUCKETS; b++) {
+			count += ts->hist[b];
+			if (b < R2MCP_HIST_BUCKETS - 1) {
+				r_strbuf_appendf (sb, "r2mcp_tool_duration_seconds_bucket{tool=\"%s\",le=\"%g\"} %" PFMT64u "\n",
+					tools[i].name, r2mcp_hist_le[b] / 1000000.0, count);
 			} else {
-				response = "This decompiler is not available";
+				r_strbuf_appendf (sb, "r2mcp_tool_duration_seconds_bucket{tool=\"%s\",le=\"+Inf\"} %" PFMT64u "\n",
+					tools[i].name, count);
 			}
-		} else {
-			response = "Unknown decompiler";
 		}
-		return create_tool_text_response (response);
+		r_strbuf_appendf (sb, "r2mcp_tool_duration_seconds_sum{tool=\"%s\"} %.6f\n", tools[i].name, ts->us / 1000000.0);
+		r_strbuf_appendf (sb, "r2mcp_tool_duration_seconds_count{tool=\"%s\"} %" PFMT64u "\n", tools[i].name, count);
 	}
-
-	// Handle xrefsTo tool
-	if (!strcmp (tool_name, "xrefsTo")) {
-		const char *address = r_json_get_str (tool_args, "address");
-		if (!address) {
-			return create_error_response (-32602, "Missing required parameter: address", NULL, NULL);
-		}
-		char *cmd = r_str_newf ("'@%s'axt", address);
-		char *disasm = r2_cmd (cmd);
-		char *response = create_tool_text_response (disasm);
-		free (cmd);
-		free (disasm);
-		return response;
+	RListIter *iter;
+	R2McpSession *ss;
+	r_strbuf_append (sb, "# TYPE r2mcp_session_memo_hits_total counter\n");
+	pthread_mutex_lock (&pool.lock);
+	r_list_foreach (pool.sessions, iter, ss) {
+		r_strbuf_appendf (sb, "r2mcp_session_memo_hits_total{session=\"%u\"} %" PFMT64u "\n", ss->id, ss->memo_hits);
 	}
-
-	// Handle disassembleFunction tool
-	if (!strcmp (tool_name, "disassembleFunction")) {
-		const char *address = r_json_get_str (tool_args, "address");
-		if (!address) {
-			return create_error_response (-32602, "Missing required parameter: address", NULL, NULL);
-		}
-		char *cmd = r_str_newf ("'@%s'pdf", address);
-		char *disasm = r2_cmd (cmd);
-		char *response = create_tool_text_response (disasm);
-		free (cmd);
-		free (disasm);
-		return response;
+	r_strbuf_append (sb, "# TYPE r2mcp_session_memo_misses_total counter\n");
+	r_list_foreach (pool.sessions, iter, ss) {
+		r_strbuf_appendf (sb, "r2mcp_session_memo_misses_total{session=\"%u\"} %" PFMT64u "\n", ss->id, ss->memo_misses);
 	}
-
-	// Handle renameFunction tool
-	if (!strcmp (tool_name, "renameFunction")) {
-		const char *address = r_json_get_str (tool_args, "address");
-		if (!address) {
-			return create_error_response (-32602, "Missing required parameter: address", NULL, NULL);
-		}
-		const char *name = r_json_get_str (tool_args, "name");
-		if (!name) {
-			return create_error_response (-32602, "Missing required parameter: name", NULL, NULL);
-		}
-		char *cmd = r_str_newf ("'@%s'afn %s", address, name);
-		r_core_cmd0 (r_core, cmd);
-		return create_tool_text_response ("ok");
+	r_strbuf_append (sb, "# TYPE r2mcp_session_memory_bytes gauge\n");
+	r_list_foreach (pool.sessions, iter, ss) {
+		r_strbuf_appendf (sb, "r2mcp_session_memory_bytes{session=\"%u\"} %" PFMT64u "\n", ss->id, ss->mem);
 	}
+	pthread_mutex_unlock (&pool.lock);
+	return r_strbuf_drain (sb);
+}
 
-	// Handle decompileFunction tool
-	if (!strcmp (tool_name, "decompileFunction")) {
-		const char *address = r_json_get_str (tool_args, "address");
-		if (!address) {
-			return create_error_response (-32602, "Missing required parameter: address", NULL, NULL);
-		}
-		char *cmd = r_str_newf ("'@%s'pdc", address);
-		char *disasm = r2_cmd (cmd);
-		char *response = create_tool_text_response (disasm);
-		free (cmd);
-		free (disasm);
+static char *handle_mcp_request(const char *method, RJson *params, const char *id) {
+	char *error = NULL;
+
+	if (!assert_capability_for_method (method, &error) || !assert_request_handler_capability (method, &error)) {
+		char *response = create_error_response (-32601, error, id, NULL);
+		free (error);
 		return response;
 	}
 
-	return create_error_response (-32602, format_string ("Unknown tool: %s", tool_name), NULL, NULL);
+	pthread_once (&registry_once, registry_init);
+	const R2McpMethod *m = ht_pp_find (methods_ht, method, NULL);
+	if (!m) {
+		return create_error_response (-32601, "Unknown method", id, NULL);
+	}
+	if (!m->fn) {
+		return create_error_response (-32601, m->error, id, NULL);
+	}
+	return m->fn (params, id);
 }